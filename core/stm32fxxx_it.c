@@ -36,6 +36,7 @@
 //#ifdef USE_USB_OTG_FS
 #include "usb_core.h"
 #include "usbd_core.h"
+#include "usb_midi.h"
 //#include "usbd_cdc_core.h"
 
 /* Private typedef -----------------------------------------------------------*/
@@ -46,10 +47,10 @@
 extern USB_OTG_CORE_HANDLE           USB_OTG_dev;
 extern uint32_t USBD_OTG_ISR_Handler (USB_OTG_CORE_HANDLE *pdev);
 
-//#ifdef USB_OTG_HS_DEDICATED_EP1_ENABLED 
-//extern uint32_t USBD_OTG_EP1IN_ISR_Handler (USB_OTG_CORE_HANDLE *pdev);
-//extern uint32_t USBD_OTG_EP1OUT_ISR_Handler (USB_OTG_CORE_HANDLE *pdev);
-//#endif
+#ifdef USB_OTG_HS_DEDICATED_EP1_ENABLED 
+extern uint32_t USBD_OTG_EP1IN_ISR_Handler (USB_OTG_CORE_HANDLE *pdev);
+extern uint32_t USBD_OTG_EP1OUT_ISR_Handler (USB_OTG_CORE_HANDLE *pdev);
+#endif
 //#endif
 
 /******************************************************************************/
@@ -142,6 +143,9 @@ void DebugMon_Handler(void)
   */
 void PendSV_Handler(void)
 {
+#if USB_MIDI_DEFERRED
+  USB_MIDI_PendSV_Handler();
+#endif
 }
 
 /**
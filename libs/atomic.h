@@ -0,0 +1,68 @@
+#ifndef _ATOMIC_H
+#define _ATOMIC_H
+
+#include "main.h"
+
+// exclusive access to a halfword or word (LDREXH/STREXH, LDREX/STREX of the Cortex-M3/M4)
+// an exception between the load and the store clears the exclusive monitor,
+// the store fails then and the read-modify-write has to be repeated
+// (lock-free updates from different interrupt priorities without masking them)
+
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
+
+static inline uint16_t ATOMIC_LoadExclusive16(volatile uint16_t *addr)
+{
+	uint32_t value;
+
+	__asm volatile ("ldrexh %0, [%1]" : "=r" (value) : "r" (addr) : "memory");
+
+	return value;
+}
+
+// returns 0 if the value has been stored
+static inline uint32_t ATOMIC_StoreExclusive16(volatile uint16_t *addr, uint16_t value)
+{
+	uint32_t failed;
+
+	__asm volatile ("strexh %0, %2, [%1]" : "=&r" (failed) : "r" (addr), "r" (value) : "memory");
+
+	return failed;
+}
+
+// same for a word (LDREX/STREX)
+static inline uint32_t ATOMIC_LoadExclusive32(volatile uint32_t *addr)
+{
+	uint32_t value;
+
+	__asm volatile ("ldrex %0, [%1]" : "=r" (value) : "r" (addr) : "memory");
+
+	return value;
+}
+
+static inline uint32_t ATOMIC_StoreExclusive32(volatile uint32_t *addr, uint32_t value)
+{
+	uint32_t failed;
+
+	__asm volatile ("strex %0, %2, [%1]" : "=&r" (failed) : "r" (addr), "r" (value) : "memory");
+
+	return failed;
+}
+
+// has to be called if the load isn't followed by a store
+static inline void ATOMIC_ClearExclusive(void)
+{
+	__asm volatile ("clrex" ::: "memory");
+}
+
+#else
+
+// other cores (host build): provided by the BSP
+uint16_t ATOMIC_LoadExclusive16(volatile uint16_t *addr);
+uint32_t ATOMIC_StoreExclusive16(volatile uint16_t *addr, uint16_t value);
+uint32_t ATOMIC_LoadExclusive32(volatile uint32_t *addr);
+uint32_t ATOMIC_StoreExclusive32(volatile uint32_t *addr, uint32_t value);
+void ATOMIC_ClearExclusive(void);
+
+#endif
+
+#endif
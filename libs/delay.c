@@ -1,43 +1,155 @@
 #include <libs/delay.h>
+#include <libs/irq.h>
 
-#define DELAY_TIMER  TIM1
+#if STM32F==1
+// no 32bit timer: TIM3 counts the uS, its update event clocks TIM4 (upper 16 bits)
+#define DELAY_TIMER      TIM3
+#define DELAY_TIMER_HIGH TIM4
+#define DELAY_TIMER_RCC  (RCC_APB1Periph_TIM3 | RCC_APB1Periph_TIM4)
+#define DELAY_TIMER_IRQn TIM3_IRQn
+#define DELAY_TIMER_IRQHandler TIM3_IRQHandler
+// the compare channel only matches the lower 16 bits: wake up in between for longer delays
+#define DELAY_COMPARE_MAX_US 0x8000
+#else
+// 32bit timer
+#define DELAY_TIMER      TIM5
+#define DELAY_TIMER_RCC  RCC_APB1Periph_TIM5
+#define DELAY_TIMER_IRQn TIM5_IRQn
+#define DELAY_TIMER_IRQHandler TIM5_IRQHandler
+#endif
 
-#define DELAY_TIMER_RCC RCC_APB2Periph_TIM1
+// DELAY_Now64_uS(): upper 32 bits, and last value of the 32bit counter
+static uint32_t now64_high;
+static uint32_t now64_last;
+
+static void (*compare_handler)(void);
 
 
 void DELAY_Init(void)
 {
 
 	// enable timer clock
-	if( DELAY_TIMER == TIM1 || DELAY_TIMER == TIM8 )
-		RCC_APB2PeriphClockCmd(DELAY_TIMER_RCC, ENABLE);
-	else
-		RCC_APB1PeriphClockCmd(DELAY_TIMER_RCC, ENABLE);
+	RCC_APB1PeriphClockCmd(DELAY_TIMER_RCC, ENABLE);
 
 
 	RCC_ClocksTypeDef RCC_Clocks;
 	RCC_GetClocksFreq(&RCC_Clocks);
 
+	// the APB1 timers run with 2*PCLK1 if APB1 is divided
+	uint32_t timer_clock = RCC_Clocks.PCLK1_Frequency;
+	if( RCC_Clocks.PCLK1_Frequency != RCC_Clocks.HCLK_Frequency )
+		timer_clock *= 2;
+
 	// time base configuration
 	TIM_TimeBaseInitTypeDef TIM_TimeBaseStructure;
-	TIM_TimeBaseStructure.TIM_Period = 65535; // maximum value
-	TIM_TimeBaseStructure.TIM_Prescaler = (RCC_Clocks.SYSCLK_Frequency/1000000)-1; // for 1 uS accuracy
+	TIM_TimeBaseStructure.TIM_Period = 65535; // maximum value of the 16bit timers
+	TIM_TimeBaseStructure.TIM_Prescaler = (timer_clock/1000000)-1; // for 1 uS accuracy
 	TIM_TimeBaseStructure.TIM_ClockDivision = 0;
 	TIM_TimeBaseStructure.TIM_CounterMode = TIM_CounterMode_Up;
+#if STM32F==1
+	TIM_TimeBaseInit(DELAY_TIMER, &TIM_TimeBaseStructure);
+
+	// TIM4 counts the update events of TIM3 (internal trigger ITR2)
+	TIM_SelectOutputTrigger(DELAY_TIMER, TIM_TRGOSource_Update);
+	TIM_SelectMasterSlaveMode(DELAY_TIMER, TIM_MasterSlaveMode_Enable);
+	TIM_TimeBaseStructure.TIM_Prescaler = 0;
+	TIM_TimeBaseInit(DELAY_TIMER_HIGH, &TIM_TimeBaseStructure);
+	TIM_SelectInputTrigger(DELAY_TIMER_HIGH, TIM_TS_ITR2);
+	TIM_SelectSlaveMode(DELAY_TIMER_HIGH, TIM_SlaveMode_External1);
+
+	// enable counters, the upper one first
+	TIM_Cmd(DELAY_TIMER_HIGH, ENABLE);
+#else
+	TIM_TimeBaseStructure.TIM_Period = 0xffffffff; // maximum value
 	TIM_TimeBaseInit(DELAY_TIMER, &TIM_TimeBaseStructure);
+#endif
 
 	// enable counter
 	TIM_Cmd(DELAY_TIMER, ENABLE);
 
 }
 
-void DELAY_Wait_uS(uint16_t uS)
+void DELAY_Wait_uS(uint32_t uS)
+{
+	uint32_t start = DELAY_Now_uS();
+
+	// note that this even works on 32bit counter wrap-arounds
+	while( (uint32_t)(DELAY_Now_uS() - start) <= uS );
+
+}
+
+
+uint32_t DELAY_Now_uS(void)
+{
+#if STM32F==1
+	uint16_t high, low;
+
+	// read the upper half again if the lower one has wrapped in between
+	do {
+		high = DELAY_TIMER_HIGH->CNT;
+		low = DELAY_TIMER->CNT;
+	} while( high != DELAY_TIMER_HIGH->CNT );
+
+	return ((uint32_t)high << 16) | low;
+#else
+	return DELAY_TIMER->CNT;
+#endif
+}
+
+
+uint64_t DELAY_Now64_uS(void)
+{
+	uint64_t now;
+	uint32_t prev;
+
+	// atomic operation, the wrap-around is counted only once
+	// (masked up to the timer priority like the timer wheel, callers above it aren't allowed)
+	prev = IRQ_TIMER_Disable();
+	uint32_t now32 = DELAY_Now_uS();
+	if( now32 < now64_last )
+		++now64_high;
+	now64_last = now32;
+	now = ((uint64_t)now64_high << 32) | now32;
+	IRQ_TIMER_Enable(prev);
+
+	return now;
+}
+
+
+void DELAY_CompareInit(void (*handler)(void))
+{
+	compare_handler = handler;
+
+	TIM_ITConfig(DELAY_TIMER, TIM_IT_CC1, DISABLE);
+	IRQ_Install(DELAY_TIMER_IRQn, IRQ_TIMER_PRIORITY);
+}
+
+void DELAY_CompareSet(uint32_t at_uS)
 {
-	uint16_t start = DELAY_TIMER->CNT;
+#ifdef DELAY_COMPARE_MAX_US
+	if( (int32_t)(at_uS - DELAY_Now_uS()) > DELAY_COMPARE_MAX_US )
+		at_uS = DELAY_Now_uS() + DELAY_COMPARE_MAX_US;
+#endif
+
+	TIM_SetCompare1(DELAY_TIMER, at_uS);
+	TIM_ClearITPendingBit(DELAY_TIMER, TIM_IT_CC1);
+	TIM_ITConfig(DELAY_TIMER, TIM_IT_CC1, ENABLE);
 
-	// note that this even works on 16bit counter wrap-arounds
-	while( (uint16_t)(DELAY_TIMER->CNT - start) <= uS );
+	// the time could have passed before the compare value has been written
+	if( (int32_t)(DELAY_Now_uS() - at_uS) >= 0 )
+		NVIC_SetPendingIRQ(DELAY_TIMER_IRQn);
+}
 
+void DELAY_CompareDisable(void)
+{
+	TIM_ITConfig(DELAY_TIMER, TIM_IT_CC1, DISABLE);
 }
 
+void DELAY_TIMER_IRQHandler(void)
+{
+	// also entered via DELAY_CompareSet() without a compare match
+	TIM_ClearITPendingBit(DELAY_TIMER, TIM_IT_CC1);
 
+	if( compare_handler )
+		compare_handler();
+}
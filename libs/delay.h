@@ -4,6 +4,44 @@
 #include "main.h"
 
 void DELAY_Init(void);
-void DELAY_Wait_uS(uint16_t uS);
+void DELAY_Wait_uS(uint32_t uS);
+
+// free running uS counter, wraps every 71.6 minutes
+// (time differences have to be calculated with uint32_t arithmetic)
+uint32_t DELAY_Now_uS(void);
+
+// 64bit extension of DELAY_Now_uS(), has to be called at least once per wrap-around
+// (not from interrupts above IRQ_TIMER_PRIORITY)
+uint64_t DELAY_Now64_uS(void);
+
+// compare channel of the timer, the handler is called from the interrupt (IRQ_TIMER_PRIORITY)
+// once DELAY_Now_uS() has reached the programmed time (used by libs/timer.c)
+void DELAY_CompareInit(void (*handler)(void));
+void DELAY_CompareSet(uint32_t at_uS);
+void DELAY_CompareDisable(void);
+
+
+// non-blocking timeouts: a deadline can be polled instead of waiting for it
+// (max. 2^31 uS = 35 minutes in the future)
+typedef uint32_t delay_deadline_t;
+
+static inline delay_deadline_t DELAY_DeadlineSet_uS(uint32_t uS)
+{
+	return DELAY_Now_uS() + uS;
+}
+
+// returns 1 once the deadline has been reached
+static inline int32_t DELAY_DeadlineExpired(delay_deadline_t deadline)
+{
+	return (int32_t)(DELAY_Now_uS() - deadline) >= 0;
+}
+
+// returns 0 if the deadline has been reached
+static inline uint32_t DELAY_DeadlineRemaining_uS(delay_deadline_t deadline)
+{
+	int32_t remaining = (int32_t)(deadline - DELAY_Now_uS());
+
+	return (remaining > 0) ? (uint32_t)remaining : 0;
+}
 
 #endif
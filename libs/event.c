@@ -0,0 +1,58 @@
+#include "libs/event.h"
+#include "libs/atomic.h"
+
+static volatile uint32_t event_flags;
+
+
+// sets event flags (can be called from any context)
+// the flag word is updated with LDREX/STREX instead of masking the interrupts:
+// an exception between the load and the store lets the store fail and the update is repeated
+void EVENT_Set(uint32_t events)
+{
+	uint32_t flags;
+
+	do {
+		flags = ATOMIC_LoadExclusive32(&event_flags);
+	} while( ATOMIC_StoreExclusive32(&event_flags, flags | events) );
+}
+
+// returns and clears the pending events of the mask (doesn't wait)
+uint32_t EVENT_Get(uint32_t mask)
+{
+	uint32_t flags;
+	uint32_t events;
+
+	do {
+		flags = ATOMIC_LoadExclusive32(&event_flags);
+		events = flags & mask;
+		if( !events ) {
+			ATOMIC_ClearExclusive();
+			return 0;
+		}
+	} while( ATOMIC_StoreExclusive32(&event_flags, flags & ~events) );
+
+	return events;
+}
+
+// sleeps until one of the events of the mask is set, returns and clears the pending events
+// (main loop only, not with interrupts disabled)
+uint32_t EVENT_Wait(uint32_t mask)
+{
+	uint32_t events;
+
+	while( 1 ) {
+		// the flags are checked with interrupts masked: an interrupt which sets an event
+		// after the check stays pending, so that WFI returns immediately
+		__asm volatile ("cpsid i" ::: "memory");
+		events = event_flags & mask;
+		if( events ) {
+			event_flags &= ~events;
+			__asm volatile ("cpsie i" ::: "memory");
+			return events;
+		}
+		__asm volatile ("wfi");
+
+		// let the pending interrupt run
+		__asm volatile ("cpsie i" ::: "memory");
+	}
+}
@@ -0,0 +1,17 @@
+#ifndef _EVENT_H
+#define _EVENT_H
+
+#include "main.h"
+
+// event flags, set from interrupt context and consumed by the main loop
+#define EVENT_USB_MIDI_RX	(1 << 0)	// packages have been put into the USB MIDI Rx buffer
+#define EVENT_USB_MIDI_TX	(1 << 1)	// IN transfer complete, Tx buffer space available again
+#define EVENT_KEY		(1 << 2)	// debounced key press
+#define EVENT_TICK		(1 << 3)	// timer job for slow periodic work
+
+
+void EVENT_Set(uint32_t events);
+uint32_t EVENT_Get(uint32_t mask);
+uint32_t EVENT_Wait(uint32_t mask);
+
+#endif
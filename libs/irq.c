@@ -55,6 +55,9 @@ int32_t IRQ_Install(uint8_t IRQn, uint8_t priority)
 		return -1; // invalid priority
 
 	u32 tmppriority = (0x700 - ((SCB->AIRCR) & (uint32_t)0x700)) >> 8;
+	// with more than 4 preemption bits (e.g. reset value of PRIGROUP) all implemented bits are preemption bits
+	if( tmppriority > 4 )
+		tmppriority = 4;
 	u32 tmppre = (4 - tmppriority);
 	tmppriority = priority << tmppre;
 	tmppriority = tmppriority << 4;
@@ -71,3 +74,15 @@ void IRQ_DeInstall(uint8_t IRQn)
 	NVIC_DisableIRQ(IRQn);
 }
 
+void IRQ_PendSV_Init(void)
+{
+	// system handler priority, not affected by the priority grouping of IRQ_Install()
+	NVIC_SetPriority(PendSV_IRQn, IRQ_PENDSV_PRIORITY);
+}
+
+void IRQ_PendSV_Set(void)
+{
+	// PendSV is taken once no other exception is active (tail-chained to the pending one)
+	SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+}
+
@@ -5,6 +5,19 @@
 
 #define IRQ_USB_PRIORITY	8
 
+// compare interrupt of the DELAY timer (libs/timer.c), timing jobs run above USB
+#define IRQ_TIMER_PRIORITY	4
+
+// PendSV runs the deferred work of the interrupt handlers, below all interrupts
+#define IRQ_PENDSV_PRIORITY	15
+
+// BASEPRI value which masks the USB interrupt and all interrupts with a lower priority
+// (same encoding as IRQ_Install(): all implemented priority bits are preemption bits)
+#define IRQ_USB_BASEPRI		((IRQ_USB_PRIORITY << (8 - __NVIC_PRIO_BITS)) & 0xff)
+
+// same for the compare interrupt of the timer wheel (masks USB as well)
+#define IRQ_TIMER_BASEPRI	((IRQ_TIMER_PRIORITY << (8 - __NVIC_PRIO_BITS)) & 0xff)
+
 
 void IRQ_Disable(void);
 int32_t IRQ_Enable(void);
@@ -12,4 +25,71 @@ int32_t IRQ_Enable(void);
 int32_t IRQ_Install(uint8_t IRQn, uint8_t priority);
 void IRQ_DeInstall(uint8_t IRQn);
 
+void IRQ_PendSV_Init(void);
+void IRQ_PendSV_Set(void);
+
+
+// priority ceiling critical section: masks the interrupts up to IRQ_USB_PRIORITY,
+// interrupts with a higher priority (e.g. timers of the MIDI clock) continue to run.
+// The previous state is returned and has to be passed to IRQ_USB_Enable(), so that
+// the sections can be nested without a global counter:
+//   uint32_t prev = IRQ_USB_Disable();
+//   ...
+//   IRQ_USB_Enable(prev);
+// IRQ_TIMER_Disable()/IRQ_TIMER_Enable() work the same with the ceiling IRQ_TIMER_PRIORITY.
+
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
+
+static inline uint32_t IRQ_USB_Disable(void)
+{
+	uint32_t prev;
+
+	// BASEPRI_MAX only raises the masking level, an enclosing section with a higher ceiling stays intact
+	__asm volatile ("mrs %0, basepri" : "=r" (prev));
+	__asm volatile ("msr basepri_max, %0" :: "r" (IRQ_USB_BASEPRI) : "memory");
+
+	return prev;
+}
+
+static inline void IRQ_USB_Enable(uint32_t prev)
+{
+	__asm volatile ("msr basepri, %0" :: "r" (prev) : "memory");
+}
+
+static inline uint32_t IRQ_TIMER_Disable(void)
+{
+	uint32_t prev;
+
+	__asm volatile ("mrs %0, basepri" : "=r" (prev));
+	__asm volatile ("msr basepri_max, %0" :: "r" (IRQ_TIMER_BASEPRI) : "memory");
+
+	return prev;
+}
+
+static inline void IRQ_TIMER_Enable(uint32_t prev)
+{
+	__asm volatile ("msr basepri, %0" :: "r" (prev) : "memory");
+}
+
+// returns != 0 if called from an exception handler (IPSR: active exception number)
+static inline uint32_t IRQ_InHandler(void)
+{
+	uint32_t ipsr;
+
+	__asm volatile ("mrs %0, ipsr" : "=r" (ipsr));
+
+	return ipsr & 0x1ff;
+}
+
+#else
+
+// other cores (host build): provided by the BSP
+uint32_t IRQ_USB_Disable(void);
+void IRQ_USB_Enable(uint32_t prev);
+uint32_t IRQ_TIMER_Disable(void);
+void IRQ_TIMER_Enable(uint32_t prev);
+uint32_t IRQ_InHandler(void);
+
+#endif
+
 #endif 
@@ -0,0 +1,298 @@
+#include <stddef.h>
+
+#include "libs/timer.h"
+#include "libs/delay.h"
+#include "libs/irq.h"
+
+#define TIMER_SLOTS		(1 << TIMER_LEVEL_BITS)
+#define TIMER_SLOT_US		(1u << TIMER_SLOT_SHIFT)
+
+// slot index and slot width of a level
+#define TIMER_SHIFT(level)	(TIMER_SLOT_SHIFT + (level)*TIMER_LEVEL_BITS)
+#define TIMER_INDEX(t, level)	(((t) >> TIMER_SHIFT(level)) & (TIMER_SLOTS-1))
+
+#if TIMER_LEVEL_BITS > 6
+# error "TIMER_LEVEL_BITS: the used slots of a level are kept in 64 bits"
+#endif
+#define TIMER_SLOTS_MASK	(~(uint64_t)0 >> (64 - TIMER_SLOTS))
+
+static timer_job_t *wheel[TIMER_LEVELS][TIMER_SLOTS];
+
+// one bit for each non-empty slot, the next slot is found without scanning the wheel
+static uint64_t wheel_used[TIMER_LEVELS];
+
+// start of the current slot of level 0, the wheel has been processed up to here
+static uint32_t wheel_time;
+
+// jobs which have expired, sorted by expiry time
+static timer_job_t *due;
+
+
+static void TIMER_Link(timer_job_t **head, timer_job_t *job)
+{
+	job->next = *head;
+	if( job->next )
+		job->next->pprev = &job->next;
+	job->pprev = head;
+	*head = job;
+}
+
+static void TIMER_Unlink(timer_job_t *job)
+{
+	*job->pprev = job->next;
+	if( job->next )
+		job->next->pprev = job->pprev;
+	job->pprev = NULL;
+}
+
+// puts the job into the level which covers its distance from the wheel time
+// (a job of level n > 0 is never in the current slot of its level, it's moved
+// to the lower levels when the wheel time reaches the slot)
+static void TIMER_Insert(timer_job_t *job)
+{
+	uint32_t t = job->expires;
+	uint8_t level;
+
+	// late jobs go into the current slot
+	if( (int32_t)(t - wheel_time) < 0 )
+		t = wheel_time;
+
+	for(level=0; level<(TIMER_LEVELS-1); ++level) {
+		if( ((t >> TIMER_SHIFT(level)) - (wheel_time >> TIMER_SHIFT(level))) < TIMER_SLOTS )
+			break;
+	}
+
+	job->level = level;
+	job->slot = TIMER_INDEX(t, level);
+	wheel_used[level] |= (uint64_t)1 << job->slot;
+	TIMER_Link(&wheel[level][job->slot], job);
+}
+
+static void TIMER_Remove(timer_job_t *job)
+{
+	TIMER_Unlink(job);
+
+	// due jobs have already left the wheel
+	if( job->level < TIMER_LEVELS && !wheel[job->level][job->slot] )
+		wheel_used[job->level] &= ~((uint64_t)1 << job->slot);
+}
+
+// distance of the first used slot of a level from the slot index, which is at least min
+// (the level must contain jobs)
+static uint8_t TIMER_NextSlot(uint8_t level, uint8_t index, uint8_t min)
+{
+	uint64_t used = wheel_used[level];
+
+	// rotate the slot index to bit 0
+	if( index )
+		used = ((used >> index) | (used << (TIMER_SLOTS - index))) & TIMER_SLOTS_MASK;
+	used &= TIMER_SLOTS_MASK << min;
+
+	return used ? __builtin_ctzll(used) : TIMER_SLOTS;
+}
+
+// moves the expired jobs of a slot of level 0 into the due list
+static void TIMER_Collect(timer_job_t **slot, uint32_t now)
+{
+	timer_job_t *job = *slot;
+
+	while( job ) {
+		timer_job_t *next = job->next;
+
+		if( (int32_t)(now - job->expires) >= 0 ) {
+			timer_job_t **pos = &due;
+
+			TIMER_Remove(job);
+			job->level = TIMER_LEVELS;
+			while( *pos && (int32_t)(job->expires - (*pos)->expires) >= 0 )
+				pos = &(*pos)->next;
+			TIMER_Link(pos, job);
+		}
+
+		job = next;
+	}
+}
+
+// the wheel time has reached a new slot: the jobs of the slots which start here are moved down
+static void TIMER_Cascade(void)
+{
+	int8_t level;
+
+	for(level=TIMER_LEVELS-1; level>0; --level) {
+		timer_job_t *job;
+
+		if( wheel_time & ((1u << TIMER_SHIFT(level)) - 1) )
+			continue;
+
+		job = wheel[level][TIMER_INDEX(wheel_time, level)];
+		while( job ) {
+			timer_job_t *next = job->next;
+			TIMER_Remove(job);
+			TIMER_Insert(job);
+			job = next;
+		}
+	}
+}
+
+static void TIMER_Advance(uint32_t now)
+{
+	while( (int32_t)(now - wheel_time) >= (int32_t)TIMER_SLOT_US ) {
+		if( wheel_used[0] ) {
+			// the slot has passed completely
+			TIMER_Collect(&wheel[0][TIMER_INDEX(wheel_time, 0)], now);
+			wheel_time += TIMER_SLOT_US;
+		} else {
+			// nothing on level 0: continue at the next slot of the first level which contains jobs
+			uint8_t level;
+			uint32_t next;
+
+			for(level=1; level<TIMER_LEVELS && !wheel_used[level]; ++level);
+			next = (wheel_time | ((1u << TIMER_SHIFT(level < TIMER_LEVELS ? level : 0)) - 1)) + 1;
+			if( level >= TIMER_LEVELS || (int32_t)(now - next) < 0 ) {
+				wheel_time = now & ~(TIMER_SLOT_US - 1);
+				break;
+			}
+			wheel_time = next;
+		}
+
+		TIMER_Cascade();
+	}
+
+	TIMER_Collect(&wheel[0][TIMER_INDEX(wheel_time, 0)], now);
+}
+
+// programs the compare channel for the next due job or cascade
+// (the jobs of a higher level can be due before the ones of a lower level which have been queued later)
+static void TIMER_Program(void)
+{
+	uint32_t next = 0;
+	uint8_t found = 0;
+	uint8_t level;
+	uint8_t i;
+
+	if( due ) {
+		DELAY_CompareSet(due->expires);
+		return;
+	}
+
+	if( wheel_used[0] ) {
+		// the jobs of level 0 are sorted by slot, starting at the current one: only the first used slot is searched
+		timer_job_t *job;
+
+		i = TIMER_NextSlot(0, TIMER_INDEX(wheel_time, 0), 0);
+		for(job=wheel[0][TIMER_INDEX(wheel_time + i*TIMER_SLOT_US, 0)]; job; job=job->next) {
+			if( !found++ || (int32_t)(job->expires - next) < 0 )
+				next = job->expires;
+		}
+	}
+
+	for(level=1; level<TIMER_LEVELS; ++level) {
+		uint32_t slot;
+
+		if( !wheel_used[level] )
+			continue;
+
+		// the jobs are moved down once the wheel time reaches the start of their slot
+		i = TIMER_NextSlot(level, TIMER_INDEX(wheel_time, level), 1);
+		if( i >= TIMER_SLOTS )
+			continue;
+
+		slot = ((wheel_time >> TIMER_SHIFT(level)) + i) << TIMER_SHIFT(level);
+		if( !found++ || (int32_t)(slot - next) < 0 )
+			next = slot;
+	}
+
+	if( found )
+		DELAY_CompareSet(next);
+	else
+		DELAY_CompareDisable();
+}
+
+
+void TIMER_Init(void)
+{
+	wheel_time = DELAY_Now_uS() & ~(TIMER_SLOT_US - 1);
+	DELAY_CompareInit(TIMER_Handler);
+}
+
+void TIMER_JobInit(timer_job_t *job, timer_callback_t callback, void *arg)
+{
+	job->pprev = NULL;
+	job->callback = callback;
+	job->arg = arg;
+}
+
+// starts (or restarts) a job at an absolute DELAY_Now_uS() time, period_uS 0: one-shot
+int32_t TIMER_StartAt(timer_job_t *job, uint32_t at_uS, uint32_t period_uS)
+{
+	uint32_t prev;
+
+	if( (int32_t)(at_uS - DELAY_Now_uS()) > (int32_t)TIMER_MAX_DELAY_US || period_uS > TIMER_MAX_DELAY_US )
+		return -1; // too far in the future
+
+	// atomic operation, the wheel is modified by the compare interrupt
+	// (only masked up to its priority, interrupts above it aren't delayed)
+	prev = IRQ_TIMER_Disable();
+	if( job->pprev )
+		TIMER_Remove(job);
+	job->expires = at_uS;
+	job->period = period_uS;
+	TIMER_Advance(DELAY_Now_uS());
+	TIMER_Insert(job);
+	TIMER_Program();
+	IRQ_TIMER_Enable(prev);
+
+	return 0;
+}
+
+int32_t TIMER_Start(timer_job_t *job, uint32_t delay_uS, uint32_t period_uS)
+{
+	if( delay_uS > TIMER_MAX_DELAY_US )
+		return -1; // too far in the future
+
+	return TIMER_StartAt(job, DELAY_Now_uS() + delay_uS, period_uS);
+}
+
+// returns -1 if the job wasn't queued
+int32_t TIMER_Stop(timer_job_t *job)
+{
+	int32_t status = -1;
+	uint32_t prev;
+
+	prev = IRQ_TIMER_Disable();
+	if( job->pprev ) {
+		TIMER_Remove(job);
+		TIMER_Program();
+		status = 0;
+	}
+	IRQ_TIMER_Enable(prev);
+
+	return status;
+}
+
+void TIMER_Handler(void)
+{
+	timer_job_t *job;
+	uint32_t prev;
+
+	prev = IRQ_TIMER_Disable();
+	TIMER_Advance(DELAY_Now_uS());
+	while( (job = due) ) {
+		TIMER_Unlink(job);
+
+		// periodic jobs are queued again before the callback, so that it can stop or restart them
+		// (the period is added to the expiry time, not to the current time: no drift)
+		if( job->period ) {
+			job->expires += job->period;
+			TIMER_Insert(job);
+		}
+
+		IRQ_TIMER_Enable(prev);
+		job->callback(job->arg);
+		IRQ_TIMER_Disable();
+
+		TIMER_Advance(DELAY_Now_uS());
+	}
+	TIMER_Program();
+	IRQ_TIMER_Enable(prev);
+}
@@ -0,0 +1,42 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include "main.h"
+
+// software timers with uS resolution, kept in a hierarchical timing wheel and driven
+// by one compare channel of the DELAY timer, which is programmed for the next due
+// job only (no periodic tick). The callbacks run in the compare interrupt (IRQ_TIMER_PRIORITY).
+
+// 4 levels of 64 slots, the slots of level 0 are 128 uS wide
+#define TIMER_LEVELS		4
+#define TIMER_LEVEL_BITS	6
+#define TIMER_SLOT_SHIFT	7
+
+// max. delay of TIMER_Start() and TIMER_StartAt() (about 35 minutes)
+#define TIMER_MAX_DELAY_US	(0x80000000u - (1u << (TIMER_SLOT_SHIFT + (TIMER_LEVELS-1)*TIMER_LEVEL_BITS)))
+
+typedef void (*timer_callback_t)(void *arg);
+
+typedef struct timer_job_s {
+	struct timer_job_s *next;
+	struct timer_job_s **pprev;	// NULL if the job isn't queued
+	uint32_t expires;		// DELAY_Now_uS() time
+	uint32_t period;		// 0: one-shot
+	timer_callback_t callback;
+	void *arg;
+	uint8_t level;
+	uint8_t slot;
+} timer_job_t;
+
+
+void TIMER_Init(void);
+
+void TIMER_JobInit(timer_job_t *job, timer_callback_t callback, void *arg);
+int32_t TIMER_Start(timer_job_t *job, uint32_t delay_uS, uint32_t period_uS);
+int32_t TIMER_StartAt(timer_job_t *job, uint32_t at_uS, uint32_t period_uS);
+int32_t TIMER_Stop(timer_job_t *job);
+
+// compare interrupt
+void TIMER_Handler(void);
+
+#endif
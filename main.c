@@ -1,7 +1,11 @@
+#include <stddef.h>
+
 #include "main.h"
 
 #include "usb.h"
 #include "libs/delay.h"
+#include "libs/event.h"
+#include "libs/timer.h"
 #include "usb_midi.h"
 
 
@@ -15,32 +19,53 @@ static uint16_t key_state;
 static uint16_t key_press;
 static uint32_t buttonsInitialized = 0;
 
-void SysTick_Handler(void)
+// the LED blinks with 2*TICK_PERIOD_MS
+#define TICK_PERIOD_MS 50
+
+// the buttons are sampled every 3 mS
+#define DEBOUNCE_PERIOD_MS 3
+
+// the timer jobs run above the USB interrupt (IRQ_TIMER_PRIORITY): USB_MIDI_Periodic_mS()
+// may only pend the buffer handlers
+#if !USB_MIDI_DEFERRED
+#error "USB_MIDI_Periodic_mS() is called from a timer job, USB_MIDI_DEFERRED is required"
+#endif
+
+static timer_job_t usb_job;
+static timer_job_t tick_job;
+static timer_job_t debounce_job;
+
+static void usb_periodic(void *arg __attribute__((__unused__)))
+{
+	USB_MIDI_Periodic_mS();
+}
+
+static void tick(void *arg __attribute__((__unused__)))
+{
+	EVENT_Set(EVENT_TICK);
+}
+
+static void debounce(void *arg __attribute__((__unused__)))
 {
 	static uint16_t ct0, ct1;
-	static uint16_t button_event = 3;
 	uint16_t i;
 
-	USB_MIDI_Periodic_mS();
-	
 	if(buttonsInitialized)
 	{
-		button_event--;
-		if(button_event == 0)
-		{
-			uint16_t key_curr = ((GPIO_ReadInputDataBit(GPIOC, GPIO_Pin_4)<<1)|
-								  GPIO_ReadInputDataBit(GPIOC, GPIO_Pin_6));
-	
-			i = key_state ^ ~key_curr;
-			ct0 = ~( ct0 & i );
-			ct1 = ct0 ^ (ct1 & i);
-			i &= ct0 & ct1;
-			key_state ^= i;
-			key_press |= key_state & i;
-			button_event=3;
-		}
+		uint16_t key_curr = ((GPIO_ReadInputDataBit(GPIOC, GPIO_Pin_4)<<1)|
+							  GPIO_ReadInputDataBit(GPIOC, GPIO_Pin_6));
+
+		i = key_state ^ ~key_curr;
+		ct0 = ~( ct0 & i );
+		ct1 = ct0 ^ (ct1 & i);
+		i &= ct0 & ct1;
+		key_state ^= i;
+		key_press |= key_state & i;
+		if(key_state & i)
+			EVENT_Set(EVENT_KEY);
 	}
 }
+
 uint16_t get_key_press( uint16_t key_mask )
 {
 	key_mask &= key_press;                          // read key(s)
@@ -56,12 +81,15 @@ uint16_t get_key_state( uint16_t key_mask )
 
 int main(void)
 {
-	RCC_ClocksTypeDef RCC_Clocks;
-	RCC_GetClocksFreq(&RCC_Clocks);
-	/* SysTick event each 1ms */
-	SysTick_Config(RCC_Clocks.HCLK_Frequency / 1000);
-
 	DELAY_Init();
+
+	/* periodic work runs as timer jobs, the compare interrupt is only taken when a job is due (no SysTick) */
+	TIMER_Init();
+	TIMER_JobInit(&usb_job, usb_periodic, NULL);
+	TIMER_Start(&usb_job, 1000, 1000);
+	TIMER_JobInit(&tick_job, tick, NULL);
+	TIMER_Start(&tick_job, TICK_PERIOD_MS*1000, TICK_PERIOD_MS*1000);
+
 	USB_Init(0);
 	
 #if STM32F!=1
@@ -98,45 +126,45 @@ int main(void)
 	GPIO_Init(GPIOC, &GPIO_InitStructure);  
 	buttonsInitialized=1;
 
-	int loopcount = 0;
+	TIMER_JobInit(&debounce_job, debounce, NULL);
+	TIMER_Start(&debounce_job, DEBOUNCE_PERIOD_MS*1000, DEBOUNCE_PERIOD_MS*1000);
+
+	int tickcount = 0;
 	while(1)
 	{
-		midi_package_t rpack;
+		// sleep until a package has been received, a key has been pressed or the LED has to blink
+		uint32_t events = EVENT_Wait(EVENT_USB_MIDI_RX | EVENT_KEY | EVENT_TICK);
 
-		int recv = USB_MIDI_PackageReceive(&rpack);
-
-		if(recv != -1)
+		if(events & EVENT_USB_MIDI_RX)
 		{
-			if(rpack.velocity > 50)
-			{
-				GPIOB->ODR           |=       1<<13;
-			}
-			else
+			midi_package_t rpack;
+
+			while(USB_MIDI_PackageReceive(&rpack) != -1)
 			{
-				GPIOB->ODR           &=       ~(1<<13);
+				if(rpack.velocity > 50)
+				{
+					GPIOB->ODR           |=       1<<13;
+				}
+				else
+				{
+					GPIOB->ODR           &=       ~(1<<13);
+				}
 			}
 		}
 
-		loopcount++;
-		if((loopcount == 50)||(loopcount == 150))
+		if(events & EVENT_TICK)
 		{
+			tickcount ^= 1;
 			if(USB_MIDI_CheckAvailable(0))
 			{
-				GPIOB->ODR           &=       ~(1<<12);
+				if(tickcount)
+					GPIOB->ODR           &=       ~(1<<12);
+				else
+					GPIOB->ODR           |=       1<<12;
 			}
 		}
-		if((loopcount == 100)||(loopcount == 200))
-		{
-			if(USB_MIDI_CheckAvailable(0))
-			{
-				GPIOB->ODR           |=       1<<12;
-			}
 
-			if(loopcount==200)
-				loopcount = 0;
-  		
-		}
-		
+		// keys (EVENT_KEY)
 /*
 		if(get_key_press(KEY_A))
 		{
@@ -167,7 +195,6 @@ int main(void)
 		}
 			
 */
-		DELAY_Wait_uS(1000);
 	}
 
 
@@ -51,13 +51,26 @@
 #define CS_INTERFACE	0x24	// Class-specific type: Interface
 #define CS_ENDPOINT	0x25	// Class-specific type: Endpoint
 
+// USB core: OTG_FS with the embedded PHY, or OTG_HS with an external ULPI PHY and internal DMA
+#ifdef USE_USB_OTG_HS
+# if STM32F==1
+#  error "the OTG_HS core is only available on STM32F2/F4"
+# endif
+# define USB_CORE_ID		USB_OTG_HS_CORE_ID
+# define USB_CORE_BASE_ADDR	USB_OTG_HS_BASE_ADDR
+# define USB_CORE_IRQn		OTG_HS_IRQn
+#else
+# define USB_CORE_ID		USB_OTG_FS_CORE_ID
+# define USB_CORE_BASE_ADDR	USB_OTG_FS_BASE_ADDR
+# define USB_CORE_IRQn		OTG_FS_IRQn
+#endif
+
 /////////////////////////////////////////////////////////////////////////////
 // Global Variables
 /////////////////////////////////////////////////////////////////////////////
 
 // also used in usb_midi.c
 __ALIGN_BEGIN USB_OTG_CORE_HANDLE  USB_OTG_dev __ALIGN_END;
-uint32_t USB_rx_buffer[USB_MIDI_DATA_OUT_SIZE/4];
 
 
 /////////////////////////////////////////////////////////////////////////////
@@ -89,12 +102,17 @@ uint32_t USB_rx_buffer[USB_MIDI_DATA_OUT_SIZE/4];
 #define USB_NUM_INTERFACES              (USB_MIDI_NUM_INTERFACES)
 #define USB_SIZ_CONFIG_DESC             (9 + USB_MIDI_SIZ_CONFIG_DESC)
 
+// the bulk endpoint descriptors are located at the end of the config descriptor
+// (each followed by the class-specific descriptor)
+#define USB_CONFIG_DESC_OUT_MPS_OFFSET  (USB_SIZ_CONFIG_DESC - 2*(9+4+USB_MIDI_NUM_PORTS) + 4)
+#define USB_CONFIG_DESC_IN_MPS_OFFSET   (USB_SIZ_CONFIG_DESC - (9+4+USB_MIDI_NUM_PORTS) + 4)
+
 
 /////////////////////////////////////////////////////////////////////////////
 // USB Standard Device Descriptor
 /////////////////////////////////////////////////////////////////////////////
 #define USB_SIZ_DEVICE_DESC 18
-static const __ALIGN_BEGIN u8 USB_DeviceDescriptor[USB_SIZ_DEVICE_DESC] = {
+static const __ALIGN_BEGIN u8 USB_DeviceDescriptor[USB_SIZ_DEVICE_DESC] __ALIGN_END = {
   (u8)(USB_SIZ_DEVICE_DESC&0xff), // Device Descriptor length
   DSCR_DEVICE,			// Decriptor type
   (u8)(0x0200 & 0xff),		// Specification Version (BCD, LSB)
@@ -116,6 +134,26 @@ static const __ALIGN_BEGIN u8 USB_DeviceDescriptor[USB_SIZ_DEVICE_DESC] = {
 };
 
 
+#ifdef USB_OTG_HS_CORE
+/////////////////////////////////////////////////////////////////////////////
+// USB Device Qualifier Descriptor (high speed capable device)
+// referenced in usbd_req.c, describes the device at the other speed
+/////////////////////////////////////////////////////////////////////////////
+__ALIGN_BEGIN u8 USBD_DeviceQualifierDesc[USB_LEN_DEV_QUALIFIER_DESC] __ALIGN_END = {
+  USB_LEN_DEV_QUALIFIER_DESC,	// Descriptor length
+  USB_DESC_TYPE_DEVICE_QUALIFIER, // Descriptor type
+  (u8)(0x0200 & 0xff),		// Specification Version (BCD, LSB)
+  (u8)(0x0200 >> 8),		// Specification Version (BCD, MSB)
+  0x00,				// Device class (same as in the device descriptor)
+  0x00,				// Device sub-class
+  0x00,				// Device sub-sub-class
+  0x40,				// Maximum packet size of EP0 at the other speed
+  0x01,				// Number of other-speed configurations
+  0x00				// reserved
+};
+#endif
+
+
 /* USB Standard Device Descriptor */
 static const __ALIGN_BEGIN u8 USBD_LangIDDesc[4] __ALIGN_END =
 {
@@ -134,7 +172,7 @@ static const __ALIGN_BEGIN u8 USBD_LangIDDesc[4] __ALIGN_END =
 // this has to be done in *USB_CB_GetConfigDescriptor()
 // Problem: it would increase stack or static RAM consumption
 
-static const __ALIGN_BEGIN u8 USB_ConfigDescriptor[USB_SIZ_CONFIG_DESC] = {
+static const __ALIGN_BEGIN u8 USB_ConfigDescriptor[USB_SIZ_CONFIG_DESC] __ALIGN_END = {
   // Configuration Descriptor
   9,				// Descriptor length
   DSCR_CONFIG,			// Descriptor type
@@ -531,10 +569,10 @@ static const __ALIGN_BEGIN u8 USB_ConfigDescriptor[USB_SIZ_CONFIG_DESC] = {
   // Standard Bulk OUT Endpoint Descriptor
   9,				// Descriptor length
   DSCR_ENDPNT,			// Descriptor type
-  0x02,				// Out Endpoint 2
+  USB_MIDI_DATA_OUT_EP,		// Out Endpoint 2 (1 with the dedicated OTG_HS EP1 vectors)
   0x02,				// Bulk, not shared
-  (u8)(USB_MIDI_DATA_IN_SIZE&0xff),	// num of bytes per packet (LSB)
-  (u8)(USB_MIDI_DATA_IN_SIZE>>8),	// num of bytes per packet (MSB)
+  (u8)(USB_MIDI_DATA_OUT_SIZE&0xff),	// num of bytes per packet (LSB)
+  (u8)(USB_MIDI_DATA_OUT_SIZE>>8),	// num of bytes per packet (MSB)
   0x00,				// ignore for bulk
   0x00,				// unused
   0x00,				// unused
@@ -572,8 +610,8 @@ static const __ALIGN_BEGIN u8 USB_ConfigDescriptor[USB_SIZ_CONFIG_DESC] = {
   DSCR_ENDPNT,			// Descriptor type
   USB_MIDI_DATA_IN_EP,	// In Endpoint 1
   0x02,				// Bulk, not shared
-  (u8)(USB_MIDI_DATA_OUT_SIZE&0xff),	// num of bytes per packet (LSB)
-  (u8)(USB_MIDI_DATA_OUT_SIZE>>8),	// num of bytes per packet (MSB)
+  (u8)(USB_MIDI_DATA_IN_SIZE&0xff),	// num of bytes per packet (LSB)
+  (u8)(USB_MIDI_DATA_IN_SIZE>>8),	// num of bytes per packet (MSB)
   0x00,				// ignore for bulk
   0x00,				// unused
   0x00,				// unused
@@ -608,6 +646,12 @@ static const __ALIGN_BEGIN u8 USB_ConfigDescriptor[USB_SIZ_CONFIG_DESC] = {
 
 };
 
+#ifdef USB_OTG_HS_CORE
+// the descriptor above contains the high speed endpoints, the full speed variant
+// (and the other-speed descriptors) are copied into RAM with patched max-packet sizes
+static __ALIGN_BEGIN u8 USB_SpeedConfigDescriptor[USB_SIZ_CONFIG_DESC] __ALIGN_END;
+#endif
+
 
 
 /**
@@ -841,7 +885,51 @@ static const USBD_Usr_cb_TypeDef USBD_USR_Callbacks =
 void USB_OTG_BSP_Init(USB_OTG_CORE_HANDLE *pdev __attribute__((__unused__)))
 {
   GPIO_InitTypeDef GPIO_InitStructure;
-#if STM32F!=1
+#if defined(USE_USB_OTG_HS)
+  // ULPI PHY (pinout of the STM324xG-EVAL board with an USB3300)
+  RCC_AHB1PeriphClockCmd( RCC_AHB1Periph_GPIOA | RCC_AHB1Periph_GPIOB | RCC_AHB1Periph_GPIOC |
+			  RCC_AHB1Periph_GPIOH | RCC_AHB1Periph_GPIOI, ENABLE);
+  GPIO_InitStructure.GPIO_Speed = GPIO_Speed_100MHz;
+  GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF;
+  GPIO_InitStructure.GPIO_OType = GPIO_OType_PP;
+  GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_NOPULL;
+
+  // CLK, D0
+  GPIO_InitStructure.GPIO_Pin = GPIO_Pin_5 | GPIO_Pin_3;
+  GPIO_Init(GPIOA, &GPIO_InitStructure);
+  GPIO_PinAFConfig(GPIOA,GPIO_PinSource5,GPIO_AF_OTG2_HS) ;
+  GPIO_PinAFConfig(GPIOA,GPIO_PinSource3,GPIO_AF_OTG2_HS) ;
+
+  // D1 D2 D3 D4 D5 D6 D7
+  GPIO_InitStructure.GPIO_Pin = GPIO_Pin_0 | GPIO_Pin_1 | GPIO_Pin_5 | GPIO_Pin_10 |
+                                GPIO_Pin_11 | GPIO_Pin_12 | GPIO_Pin_13;
+  GPIO_Init(GPIOB, &GPIO_InitStructure);
+  GPIO_PinAFConfig(GPIOB,GPIO_PinSource0, GPIO_AF_OTG2_HS) ;
+  GPIO_PinAFConfig(GPIOB,GPIO_PinSource1, GPIO_AF_OTG2_HS) ;
+  GPIO_PinAFConfig(GPIOB,GPIO_PinSource5, GPIO_AF_OTG2_HS) ;
+  GPIO_PinAFConfig(GPIOB,GPIO_PinSource10,GPIO_AF_OTG2_HS) ;
+  GPIO_PinAFConfig(GPIOB,GPIO_PinSource11,GPIO_AF_OTG2_HS) ;
+  GPIO_PinAFConfig(GPIOB,GPIO_PinSource12,GPIO_AF_OTG2_HS) ;
+  GPIO_PinAFConfig(GPIOB,GPIO_PinSource13,GPIO_AF_OTG2_HS) ;
+
+  // STP
+  GPIO_InitStructure.GPIO_Pin = GPIO_Pin_0;
+  GPIO_Init(GPIOC, &GPIO_InitStructure);
+  GPIO_PinAFConfig(GPIOC,GPIO_PinSource0,GPIO_AF_OTG2_HS) ;
+
+  // NXT
+  GPIO_InitStructure.GPIO_Pin = GPIO_Pin_4;
+  GPIO_Init(GPIOH, &GPIO_InitStructure);
+  GPIO_PinAFConfig(GPIOH,GPIO_PinSource4,GPIO_AF_OTG2_HS) ;
+
+  // DIR
+  GPIO_InitStructure.GPIO_Pin = GPIO_Pin_11;
+  GPIO_Init(GPIOI, &GPIO_InitStructure);
+  GPIO_PinAFConfig(GPIOI,GPIO_PinSource11,GPIO_AF_OTG2_HS) ;
+
+  RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_OTG_HS | RCC_AHB1Periph_OTG_HS_ULPI, ENABLE) ;
+
+#elif STM32F!=1
   RCC_AHB1PeriphClockCmd( RCC_AHB1Periph_GPIOA , ENABLE);
   GPIO_InitStructure.GPIO_Speed = GPIO_Speed_100MHz;
   GPIO_InitStructure.GPIO_OType = GPIO_OType_PP;
@@ -885,7 +973,12 @@ void USB_OTG_BSP_Init(USB_OTG_CORE_HANDLE *pdev __attribute__((__unused__)))
 */
 void USB_OTG_BSP_EnableInterrupt(USB_OTG_CORE_HANDLE *pdev __attribute__((__unused__)))
 {
-  IRQ_Install(OTG_FS_IRQn, IRQ_USB_PRIORITY);
+  IRQ_Install(USB_CORE_IRQn, IRQ_USB_PRIORITY);
+#ifdef USB_OTG_HS_DEDICATED_EP1_ENABLED
+  // transfer completions of the MIDI endpoints (same priority, IRQ_USB_Disable() masks them as well)
+  IRQ_Install(OTG_HS_EP1_OUT_IRQn, IRQ_USB_PRIORITY);
+  IRQ_Install(OTG_HS_EP1_IN_IRQn, IRQ_USB_PRIORITY);
+#endif
 }
 
 /**
@@ -920,6 +1013,7 @@ void USB_OTG_BSP_uDelay (const uint32_t usec)
 */
 void USB_OTG_BSP_mDelay (const uint32_t msec)
 {
+  // 32bit timebase: no truncation of delays >= 66 mS
   USB_OTG_BSP_uDelay(msec * 1000);
 }
 
@@ -939,15 +1033,17 @@ void USB_OTG_BSP_mDelay (const uint32_t msec)
 static uint8_t  USB_CLASS_Init (void  *pdev, 
 				       uint8_t cfgidx __attribute__((__unused__)))
 {
-  // Open Endpoints
+  // Open Endpoints (with the max-packet size of the enumerated speed)
+#ifdef USB_OTG_HS_CORE
+  u8 high_speed = ((USB_OTG_CORE_HANDLE *)pdev)->cfg.speed == USB_OTG_SPEED_HIGH;
+  DCD_EP_Open(pdev, USB_MIDI_DATA_OUT_EP, high_speed ? USB_MIDI_DATA_OUT_SIZE : USB_MIDI_DATA_FS_SIZE, USB_OTG_EP_BULK);
+  DCD_EP_Open(pdev, USB_MIDI_DATA_IN_EP, high_speed ? USB_MIDI_DATA_IN_SIZE : USB_MIDI_DATA_FS_SIZE, USB_OTG_EP_BULK);
+#else
   DCD_EP_Open(pdev, USB_MIDI_DATA_OUT_EP, USB_MIDI_DATA_OUT_SIZE, USB_OTG_EP_BULK);
   DCD_EP_Open(pdev, USB_MIDI_DATA_IN_EP, USB_MIDI_DATA_IN_SIZE, USB_OTG_EP_BULK);
+#endif
 
-  // configuration for next transfer
-  DCD_EP_PrepareRx(&USB_OTG_dev,
-		   USB_MIDI_DATA_OUT_EP,
-		   (uint8_t*)(USB_rx_buffer),
-		   USB_MIDI_DATA_OUT_SIZE);
+  // the OUT endpoint is armed by USB_MIDI_ChangeConnectionState() once the device is configured
 
   return USBD_OK;
 }
@@ -1022,7 +1118,24 @@ static uint8_t  USB_CLASS_DataIn (void *pdev __attribute__((__unused__)), uint8_
 static uint8_t  USB_CLASS_DataOut (void *pdev __attribute__((__unused__)), uint8_t epnum)
 {      
   if( epnum == USB_MIDI_DATA_OUT_EP )
+#ifdef USB_OTG_HS_DEDICATED_EP1_ENABLED
+    USB_MIDI_EP1_OUT_Callback(epnum, 0); // parameters not relevant for STM32F4
+#else
     USB_MIDI_EP2_OUT_Callback(epnum, 0); // parameters not relevant for STM32F4
+#endif
+
+  return USBD_OK;
+}
+
+/**
+  * @brief  USB_CLASS_SOF
+  *         Start Of Frame event
+  * @param  pdev: device instance
+  * @retval status
+  */
+static uint8_t  USB_CLASS_SOF (void *pdev __attribute__((__unused__)))
+{
+  USB_MIDI_SOF_Callback();
 
   return USBD_OK;
 }
@@ -1034,12 +1147,42 @@ static uint8_t  USB_CLASS_DataOut (void *pdev __attribute__((__unused__)), uint8
   * @param  length : pointer data length
   * @retval pointer to descriptor buffer
   */
+#ifdef USB_OTG_HS_CORE
+// copies the config descriptor into RAM with the endpoint sizes of the given speed
+static uint8_t  *USB_CLASS_SpeedCfgDesc (uint8_t high_speed, uint8_t type, uint16_t *length)
+{
+  u16 out_size = high_speed ? USB_MIDI_DATA_OUT_SIZE : USB_MIDI_DATA_FS_SIZE;
+  u16 in_size = high_speed ? USB_MIDI_DATA_IN_SIZE : USB_MIDI_DATA_FS_SIZE;
+
+  memcpy(USB_SpeedConfigDescriptor, USB_ConfigDescriptor, sizeof(USB_ConfigDescriptor));
+  USB_SpeedConfigDescriptor[1] = type;
+  USB_SpeedConfigDescriptor[USB_CONFIG_DESC_OUT_MPS_OFFSET+0] = (u8)(out_size & 0xff);
+  USB_SpeedConfigDescriptor[USB_CONFIG_DESC_OUT_MPS_OFFSET+1] = (u8)(out_size >> 8);
+  USB_SpeedConfigDescriptor[USB_CONFIG_DESC_IN_MPS_OFFSET+0] = (u8)(in_size & 0xff);
+  USB_SpeedConfigDescriptor[USB_CONFIG_DESC_IN_MPS_OFFSET+1] = (u8)(in_size >> 8);
+
+  *length = sizeof(USB_SpeedConfigDescriptor);
+  return USB_SpeedConfigDescriptor;
+}
+#endif
+
 static uint8_t  *USB_CLASS_GetCfgDesc (uint8_t speed __attribute__((__unused__)), uint16_t *length)
 {
+#ifdef USB_OTG_HS_CORE
+  if( speed != USB_OTG_SPEED_HIGH )
+    return USB_CLASS_SpeedCfgDesc(0, USB_DESC_TYPE_CONFIGURATION, length);
+#endif
   *length = sizeof (USB_ConfigDescriptor);
   return (uint8_t *)USB_ConfigDescriptor;
 }
 
+#ifdef USB_OTG_HS_CORE
+static uint8_t  *USB_CLASS_GetOtherCfgDesc (uint8_t speed, uint16_t *length)
+{
+  return USB_CLASS_SpeedCfgDesc(speed != USB_OTG_SPEED_HIGH, USB_DESC_TYPE_OTHER_SPEED_CONFIGURATION, length);
+}
+#endif
+
 static uint8_t  *USB_CLASS_GetStrDesc (uint8_t speed __attribute__((__unused__)), uint8_t index __attribute__((__unused__)), uint16_t *length)
 {
 	const uint8_t vendor_str[] = "MIDI 1";
@@ -1058,10 +1201,13 @@ static const USBD_Class_cb_TypeDef USB_CLASS_cb =
   USB_CLASS_EP0_RxReady,
   USB_CLASS_DataIn,
   USB_CLASS_DataOut,
-  NULL, // USB_CLASS_SOF // not used
+  USB_CLASS_SOF,
   NULL,
   NULL,     
   USB_CLASS_GetCfgDesc,
+#ifdef USB_OTG_HS_CORE
+  USB_CLASS_GetOtherCfgDesc,
+#endif
   USB_CLASS_GetStrDesc,
 };
 
@@ -1092,6 +1238,11 @@ s32 USB_Init(u32 mode)
   // change connection state to disconnected
   USBD_USR_DeviceDisconnected();
 
+#if USB_OTG_ISR_STATS
+  // clear the interrupt source counters, enables the DWT cycle counter
+  USBD_OTG_ISR_StatsReset();
+#endif
+
   if( mode == 0 && usb_is_initialized ) {
     // if mode == 0: no reconnection, important for BSL!
 
@@ -1106,7 +1257,7 @@ s32 USB_Init(u32 mode)
     USB_OTG_dev.dev.usr_device = (USBD_DEVICE *)&USR_desc;
 
     // some additional handle init stuff which doesn't hurt
-    USB_OTG_SelectCore(&USB_OTG_dev, USB_OTG_FS_CORE_ID);
+    USB_OTG_SelectCore(&USB_OTG_dev, USB_CORE_ID);
 
     // enable interrupts
     USB_OTG_EnableGlobalInt(&USB_OTG_dev);
@@ -1125,7 +1276,7 @@ s32 USB_Init(u32 mode)
   } else {
     // init USB device and driver
     USBD_Init(&USB_OTG_dev,
-	      USB_OTG_FS_CORE_ID,
+	      USB_CORE_ID,
 	      (USBD_DEVICE *)&USR_desc,
 	      (USBD_Class_cb_TypeDef *)&USB_CLASS_cb,
 	      (USBD_Usr_cb_TypeDef *)&USBD_USR_Callbacks);
@@ -1153,7 +1304,7 @@ s32 USB_Init(u32 mode)
 s32 USB_IsInitialized(void)
 {
   // we assume that initialisation has been done when B-Session valid flag is set
-  __IO USB_OTG_GREGS *GREGS = (USB_OTG_GREGS *)(USB_OTG_FS_BASE_ADDR + USB_OTG_CORE_GLOBAL_REGS_OFFSET);
+  __IO USB_OTG_GREGS *GREGS = (USB_OTG_GREGS *)(USB_CORE_BASE_ADDR + USB_OTG_CORE_GLOBAL_REGS_OFFSET);
   return (GREGS->GOTGCTL & (1 << 19)) ? 1 : 0;
 }
 
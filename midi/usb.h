@@ -39,7 +39,9 @@
 #define USB_VERSION_ID   0x0100        // v1.00
 #endif
 
+#ifndef USB_MIDI_NUM_PORTS
 #define USB_MIDI_NUM_PORTS 1
+#endif
 
 // internal defines which are used by MIOS32 USB MIDI/COM (don't touch)
 #define USB_EP_NUM   5
@@ -23,6 +23,9 @@
 #include <usb_midi.h>
 
 #include "libs/irq.h"
+#include "libs/event.h"
+#include "libs/delay.h"
+#include "libs/atomic.h"
 
 #include <usb_core.h>
 #include <usbd_req.h>
@@ -31,8 +34,6 @@
 
 // imported from usb.c
 extern USB_OTG_CORE_HANDLE  USB_OTG_dev;
-extern uint32_t USB_rx_buffer[USB_MIDI_DATA_OUT_SIZE/4];
-static uint32_t USB_tx_buffer[USB_MIDI_DATA_IN_SIZE/4];
 
 
 /////////////////////////////////////////////////////////////////////////////
@@ -41,25 +42,207 @@ static uint32_t USB_tx_buffer[USB_MIDI_DATA_IN_SIZE/4];
 
 static void USB_MIDI_TxBufferHandler(void);
 static void USB_MIDI_RxBufferHandler(void);
+static void USB_MIDI_RxArm(void);
+static void USB_MIDI_RxCallbacks(u8 ix);
+static void USB_MIDI_Defer(u8 work);
+static u16 USB_MIDI_TxPending(u8 cable);
+static u16 USB_MIDI_TxReserve(volatile u16 *reserve, volatile u16 *tail, u16 size, u16 num, u16 *pos);
+static void USB_MIDI_TxPublish(volatile u16 *head, volatile u16 *seq, u16 mask, u16 pos, u16 num);
+#if USB_MIDI_TX_COALESCING
+static s32 USB_MIDI_TxCoalescingKey(midi_package_t package);
+static u8 USB_MIDI_TxCoalesce(midi_package_t package, s32 key);
+static void USB_MIDI_TxCoalescingIndexClear(void);
+#endif
+#if USB_MIDI_TX_DEADLINES
+static u8 USB_MIDI_TxStale(u8 cable, u16 pos, u32 now);
+#endif
 
 
 /////////////////////////////////////////////////////////////////////////////
-// Local Variables
+// Local definitions
 /////////////////////////////////////////////////////////////////////////////
 
-// Rx buffer
-static u32 rx_buffer[USB_MIDI_RX_BUFFER_SIZE];
-static volatile u16 rx_buffer_tail;
-static volatile u16 rx_buffer_head;
-static volatile u16 rx_buffer_size;
-static volatile u8 rx_buffer_new_data;
+#if USB_MIDI_NUM_PORTS < 1 || USB_MIDI_NUM_PORTS > 8
+# error "USB_MIDI_NUM_PORTS has to be 1..8"
+#endif
+
+// the ring indices are free running, buffer sizes have to be a power of two
+#if (USB_MIDI_RX_BUFFER_SIZE & (USB_MIDI_RX_BUFFER_SIZE-1)) || USB_MIDI_RX_BUFFER_SIZE > 0x8000
+# error "USB_MIDI_RX_BUFFER_SIZE has to be a power of two <= 0x8000"
+#endif
+#if (USB_MIDI_TX_BUFFER_SIZE & (USB_MIDI_TX_BUFFER_SIZE-1)) || USB_MIDI_TX_BUFFER_SIZE > 0x8000
+# error "USB_MIDI_TX_BUFFER_SIZE has to be a power of two <= 0x8000"
+#endif
+
+#if (USB_MIDI_TX_RT_BUFFER_SIZE & (USB_MIDI_TX_RT_BUFFER_SIZE-1)) || USB_MIDI_TX_RT_BUFFER_SIZE > 0x8000
+# error "USB_MIDI_TX_RT_BUFFER_SIZE has to be a power of two <= 0x8000"
+#endif
+
+#if USB_MIDI_TX_PACKETS_PER_TRANSFER < 1 || (USB_MIDI_TX_PACKETS_PER_TRANSFER*USB_MIDI_DATA_IN_SIZE/4) > USB_MIDI_TX_BUFFER_SIZE
+# error "USB_MIDI_TX_PACKETS_PER_TRANSFER doesn't fit into the Tx buffer"
+#endif
+
+// the packet count of DIEPTSIZ has 10 bits (full speed max-packets)
+#if (USB_MIDI_TX_DIRECT_TRANSFER_SIZE & 3) || USB_MIDI_TX_DIRECT_TRANSFER_SIZE < (USB_MIDI_TX_PACKETS_PER_TRANSFER*USB_MIDI_DATA_IN_SIZE) || \
+    USB_MIDI_TX_DIRECT_TRANSFER_SIZE > (4*USB_MIDI_TX_BUFFER_SIZE) || USB_MIDI_TX_DIRECT_TRANSFER_SIZE > (1023*USB_MIDI_DATA_FS_SIZE)
+# error "USB_MIDI_TX_DIRECT_TRANSFER_SIZE has to be a multiple of 4 between USB_MIDI_TX_PACKETS_PER_TRANSFER max-packets and the Tx buffer size"
+#endif
+
+#if USB_MIDI_RX_PACKETS_PER_TRANSFER < 1 || (USB_MIDI_RX_PACKETS_PER_TRANSFER*USB_MIDI_DATA_OUT_SIZE/4) > USB_MIDI_RX_BUFFER_SIZE
+# error "USB_MIDI_RX_PACKETS_PER_TRANSFER doesn't fit into the Rx buffer"
+#endif
+
+#if USB_MIDI_RX_LOW_WATERMARK >= USB_MIDI_RX_HIGH_WATERMARK
+# error "USB_MIDI_RX_LOW_WATERMARK has to be below USB_MIDI_RX_HIGH_WATERMARK"
+#endif
+
+// max. number of packages per OUT transfer
+#define RX_TRANSFER_PACKAGES (USB_MIDI_RX_PACKETS_PER_TRANSFER*USB_MIDI_DATA_OUT_SIZE/4)
+
+// max. number of packages per gathered IN transfer
+#define TX_TRANSFER_PACKAGES (USB_MIDI_TX_PACKETS_PER_TRANSFER*USB_MIDI_DATA_IN_SIZE/4)
+
+// max. number of packages per IN transfer sent directly from the Tx buffer (>= TX_TRANSFER_PACKAGES)
+#define TX_DIRECT_PACKAGES (USB_MIDI_TX_DIRECT_TRANSFER_SIZE/4)
+
+#define RX_BUFFER_MASK (USB_MIDI_RX_BUFFER_SIZE-1)
+#define TX_BUFFER_MASK (USB_MIDI_TX_BUFFER_SIZE-1)
+#define TX_RT_BUFFER_MASK (USB_MIDI_TX_RT_BUFFER_SIZE-1)
+
+// single byte system realtime message (timing clock, start/continue/stop, active sensing, reset)
+#define IS_REALTIME_PACKAGE(p) ((p).cin == 0xf && (p).evnt0 >= 0xf8)
+
+// work of the interrupt handlers (USB_MIDI_Defer())
+#define USB_MIDI_DEFER_RX 0x01
+#define USB_MIDI_DEFER_TX 0x02
 
-// Tx buffer
-static u32 tx_buffer[USB_MIDI_TX_BUFFER_SIZE];
-static volatile u16 tx_buffer_tail;
-static volatile u16 tx_buffer_head;
-static volatile u16 tx_buffer_size;
-static volatile u8 tx_buffer_busy;
+// orders the buffer access against the index update
+// (sufficient for thread/ISR communication on a single Cortex-M core)
+#define USB_MIDI_BARRIER() __asm volatile ("" ::: "memory")
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Local Variables
+/////////////////////////////////////////////////////////////////////////////
+
+// Rx buffers (single producer: OUT endpoint handler, single consumer: application)
+// head is only written by the producer, tail only by the consumer
+static u32 rx_buffer[USB_MIDI_NUM_PORTS][USB_MIDI_RX_BUFFER_SIZE];
+static volatile u16 rx_buffer_tail[USB_MIDI_NUM_PORTS];
+static volatile u16 rx_buffer_head[USB_MIDI_NUM_PORTS];
+static u8 rx_cable_next;                  // round robin: next cable which will be read
+
+// OUT endpoint buffers, the endpoint is armed alternately with both of them
+// so that the host can continue while a received transfer waits for free space in rx_buffer
+static u32 rx_transfer_buffer[2][RX_TRANSFER_PACKAGES];
+static volatile u16 rx_transfer_count[2]; // number of received packages
+static u32 rx_transfer_consumed[2][(RX_TRANSFER_PACKAGES+31)/32]; // packages which have been consumed by a callback
+static volatile u8 rx_transfer_full[2];   // received data not copied into rx_buffer yet
+static u8 rx_transfer_arm;                // next buffer which will be armed
+static u8 rx_transfer_copy;               // next buffer which will be copied
+static u8 rx_transfer_blocked;            // the next transfer doesn't fit (already counted as overflow)
+static volatile u8 rx_endpoint_armed;
+static volatile u8 rx_handler_busy;
+static volatile u8 rx_handler_retrigger;
+
+#if USB_MIDI_DEFERRED
+// buffer handlers which have to be run by USB_MIDI_PendSV_Handler()
+static volatile u8 deferred_rx;
+static volatile u8 deferred_tx;
+#endif
+
+// callbacks which get the received packages before they are put into the Rx buffers
+typedef struct {
+  usb_midi_rx_callback_t callback;
+  u16 cin_mask;
+  u8 cable;
+} rx_callback_entry_t;
+static rx_callback_entry_t rx_callback[USB_MIDI_RX_CALLBACKS];
+
+// Tx buffers (multiple producers: application and interrupts, single consumer: owner of the IN endpoint)
+// producers reserve slots lock-free, a written slot is marked with its position in tx_buffer_seq,
+// the head is advanced over all consecutive written slots (see USB_MIDI_TxPublish())
+// IN transfers are sent directly from the buffer if only one cable has pending packages,
+// the transmitted slots are released once the transfer has been completed
+static u32 tx_buffer[USB_MIDI_NUM_PORTS][USB_MIDI_TX_BUFFER_SIZE];
+static volatile u16 tx_buffer_seq[USB_MIDI_NUM_PORTS][USB_MIDI_TX_BUFFER_SIZE];
+static volatile u16 tx_buffer_tail[USB_MIDI_NUM_PORTS];
+static volatile u16 tx_buffer_head[USB_MIDI_NUM_PORTS];
+static volatile u16 tx_buffer_reserve[USB_MIDI_NUM_PORTS];
+static u16 tx_zerocopy_pos[USB_MIDI_NUM_PORTS];   // open reservation of USB_MIDI_PackageSendReserve()
+static u16 tx_zerocopy_num[USB_MIDI_NUM_PORTS];   // (0: none)
+static volatile u8 tx_buffer_busy;         // 2: transfer is prepared, 1: tx_transfer_count valid
+static u16 tx_transfer_count[USB_MIDI_NUM_PORTS]; // packages of each cable in the current transfer
+static u8 tx_cable_next;                  // round robin: cable which is served first in the next transfer
+static u16 tx_transfer_len;               // bytes of the current transfer
+static u8 tx_zlp_pending;                 // the last transfer ended with a full max-packet
+
+// Tx buffer for system realtime messages, drained before the cable buffers
+static u32 tx_rt_buffer[USB_MIDI_TX_RT_BUFFER_SIZE];
+static volatile u16 tx_rt_buffer_seq[USB_MIDI_TX_RT_BUFFER_SIZE];
+static volatile u16 tx_rt_buffer_tail;
+static volatile u16 tx_rt_buffer_head;
+static volatile u16 tx_rt_buffer_reserve;
+static u16 tx_rt_transfer_count;
+
+// realtime messages and packages of multiple cables are combined in this buffer
+static u32 tx_transfer_buffer[TX_TRANSFER_PACKAGES];
+
+#if USB_MIDI_TX_COALESCING
+// position of the last queued package of each controller (hashed), validated on access
+static u16 tx_coalescing_index[USB_MIDI_NUM_PORTS][USB_MIDI_TX_BUFFER_SIZE];
+static u8 tx_coalescing;
+#endif
+
+#if USB_MIDI_TX_DEADLINES
+// enqueue time of each package (USB_MIDI_Periodic_mS() ticks)
+static u32 tx_buffer_time[USB_MIDI_NUM_PORTS][USB_MIDI_TX_BUFFER_SIZE];
+static volatile u32 tx_time_ms;
+static u16 tx_deadline_ms[USB_MIDI_TX_CLASSES] = {
+  USB_MIDI_TX_DEADLINE_NOTE_MS,
+  USB_MIDI_TX_DEADLINE_CC_MS,
+  USB_MIDI_TX_DEADLINE_SYSEX_MS,
+  USB_MIDI_TX_DEADLINE_COMMON_MS,
+};
+
+// message class of each CIN
+static const u8 tx_deadline_class[16] = {
+  USB_MIDI_TX_CLASS_COMMON, USB_MIDI_TX_CLASS_COMMON, // 0x0, 0x1: reserved
+  USB_MIDI_TX_CLASS_COMMON, USB_MIDI_TX_CLASS_COMMON, // 0x2, 0x3: two/three byte system common
+  USB_MIDI_TX_CLASS_SYSEX,  USB_MIDI_TX_CLASS_SYSEX,  // 0x4, 0x5: SysEx start/continue and end
+  USB_MIDI_TX_CLASS_SYSEX,  USB_MIDI_TX_CLASS_SYSEX,  // 0x6, 0x7: SysEx end
+  USB_MIDI_TX_CLASS_NOTE,   USB_MIDI_TX_CLASS_NOTE,   // 0x8, 0x9: note off/on
+  USB_MIDI_TX_CLASS_NOTE,   USB_MIDI_TX_CLASS_CC,     // 0xa: poly pressure, 0xb: CC
+  USB_MIDI_TX_CLASS_CC,     USB_MIDI_TX_CLASS_CC,     // 0xc, 0xd: program change, channel pressure
+  USB_MIDI_TX_CLASS_CC,     USB_MIDI_TX_CLASS_COMMON, // 0xe: pitch bend, 0xf: single byte
+};
+#endif
+
+// USB_MIDI_TX_FLUSH_*
+static u8 tx_flush_mode = USB_MIDI_TX_FLUSH_SYSTICK;
+static u16 tx_flush_head[USB_MIDI_NUM_PORTS]; // SOF mode: end of the packages queued before the last SOF
+static u16 tx_flush_deadline = USB_MIDI_TX_FLUSH_DEADLINE_US;
+static u32 tx_aggregate_start;            // AGGREGATE mode: time at which the first package has been held back
+static u8 tx_aggregate_waiting;
+static u8 tx_aggregate_due;               // AGGREGATE mode: packages which didn't fit into the last transfer
+
+// rejected packages (Tx) and held back OUT transfers (Rx) due to full buffers
+static u32 tx_overflow_ctr[USB_MIDI_NUM_PORTS];
+static u32 rx_overflow_ctr[USB_MIDI_NUM_PORTS];
+
+// packages which have been dropped by the Tx handler because their deadline has passed
+static u32 tx_dropped_ctr[USB_MIDI_NUM_PORTS];
+
+// stalled host detection: SOFs since the current IN transfer has been started
+// or the host has read a packet of it (remaining packet count)
+static volatile u16 tx_sof_ctr;
+static volatile u16 tx_transfer_sof;
+static u16 tx_transfer_pktcnt;
+static volatile u8 tx_host_stalled;        // the send functions drop all packages
+
+// SOF of the last queued realtime message, direct transfers are short while tx_rt_active is set
+static volatile u16 tx_rt_sof;
+static volatile u8 tx_rt_active;
 
 // transfer possible?
 static u8 transfer_possible = 0;
@@ -77,6 +260,10 @@ s32 USB_MIDI_Init(u32 mode)
   if( mode != 0 )
     return -1; // unsupported mode
 
+#if USB_MIDI_DEFERRED
+  IRQ_PendSV_Init();
+#endif
+
   return 0; // no error
 }
 
@@ -91,14 +278,43 @@ s32 USB_MIDI_ChangeConnectionState(u8 connected)
 {
   // in all cases: re-initialize USB MIDI driver
   // clear buffer counters and busy/wait signals again (e.g., so that no invalid data will be sent out)
-  rx_buffer_tail = rx_buffer_head = rx_buffer_size = 0;
-  rx_buffer_new_data = 0; // no data received yet
-  tx_buffer_tail = tx_buffer_head = tx_buffer_size = 0;
+  u8 cable;
+  u16 i;
+  for(cable=0; cable<USB_MIDI_NUM_PORTS; ++cable) {
+    rx_buffer_tail[cable] = rx_buffer_head[cable] = 0;
+    tx_buffer_tail[cable] = tx_buffer_head[cable] = tx_buffer_reserve[cable] = 0;
+    tx_zerocopy_num[cable] = 0;
+    tx_flush_head[cable] = 0;
+    tx_transfer_count[cable] = 0;
+    // no slot is marked as written
+    for(i=0; i<USB_MIDI_TX_BUFFER_SIZE; ++i)
+      tx_buffer_seq[cable][i] = i - USB_MIDI_TX_BUFFER_SIZE;
+  }
+  rx_cable_next = tx_cable_next = 0;
+  tx_rt_buffer_tail = tx_rt_buffer_head = tx_rt_buffer_reserve = 0;
+  for(i=0; i<USB_MIDI_TX_RT_BUFFER_SIZE; ++i)
+    tx_rt_buffer_seq[i] = i - USB_MIDI_TX_RT_BUFFER_SIZE;
+  tx_rt_transfer_count = 0;
+  tx_rt_active = 0;
+  tx_aggregate_waiting = tx_aggregate_due = 0;
+  tx_zlp_pending = 0;
+  tx_host_stalled = 0;
+#if USB_MIDI_TX_COALESCING
+  USB_MIDI_TxCoalescingIndexClear();
+#endif
+  rx_transfer_full[0] = rx_transfer_full[1] = 0; // no data received yet
+  rx_transfer_arm = rx_transfer_copy = 0;
+  rx_transfer_blocked = 0;
+  rx_endpoint_armed = 0;
+  rx_handler_busy = 0;
 
   if( connected ) {
     transfer_possible = 1;
     tx_buffer_busy = 0; // buffer not busy anymore
 
+    // configuration for first transfer
+    USB_MIDI_RxArm();
+
   } else {
     // cable disconnected: disable transfers
     transfer_possible = 0;
@@ -125,25 +341,279 @@ s32 USB_MIDI_CheckAvailable(u8 cable)
 
 
 /////////////////////////////////////////////////////////////////////////////
-//! This function puts a new MIDI package into the Tx buffer
+//! This function returns the number of free slots in the Tx buffer of a cable
+//! (flow control: a cable can't block other cables, each of them has its own buffer)
+//! \param[in] cable number
+//! \return >= 0: number of packages which can be sent without blocking
+//! \return -1: USB not connected or invalid cable
+//! \note Applications shouldn't call this function directly, instead please use \ref MIDI layer functions
+/////////////////////////////////////////////////////////////////////////////
+s32 USB_MIDI_TxBufferFree(u8 cable)
+{
+  if( cable >= USB_MIDI_NUM_PORTS || !transfer_possible )
+    return -1;
+
+  return USB_MIDI_TX_BUFFER_SIZE - (u16)(tx_buffer_reserve[cable] - tx_buffer_tail[cable]);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//! This function returns the stalled host state: the host hasn't read the
+//! IN endpoint for USB_MIDI_TX_STALL_FRAMES frames (e.g. no application uses
+//! the MIDI IN port), all packages are dropped by the send functions.\n
+//! The state is left automatically once the host reads the endpoint again.
+//! \return 1: host stalled, 0: host reads the IN endpoint
+//! \note Applications shouldn't call this function directly, instead please use \ref MIDI layer functions
+/////////////////////////////////////////////////////////////////////////////
+s32 USB_MIDI_TxHostStalled(void)
+{
+  return tx_host_stalled;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//! This function returns the overflow counters of a cable
+//! \param[in] cable number
+//! \param[out] tx_overflows number of send requests which have been rejected
+//!             because the Tx buffer was full (can be NULL)
+//! \param[out] rx_overflows number of OUT transfers which had to be held back
+//!             because the Rx buffer was full (can be NULL)
+//! \return 0: no error
+//! \return -1: invalid cable
+//! \note Applications shouldn't call this function directly, instead please use \ref MIDI layer functions
+/////////////////////////////////////////////////////////////////////////////
+s32 USB_MIDI_OverflowCountersGet(u8 cable, u32 *tx_overflows, u32 *rx_overflows)
+{
+  if( cable >= USB_MIDI_NUM_PORTS )
+    return -1;
+
+  if( tx_overflows )
+    *tx_overflows = tx_overflow_ctr[cable];
+  if( rx_overflows )
+    *rx_overflows = rx_overflow_ctr[cable];
+
+  return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//! This function sets the max. time which the packages of a message class
+//! can wait in the Tx buffer, older packages are dropped instead of being sent
+//! (e.g. after the host hasn't polled the IN endpoint for a while).\n
+//! The age is measured in USB_MIDI_Periodic_mS() ticks from the time the
+//! package has been queued. Packages which have already been handed over to
+//! the IN endpoint are always sent.
+//! \param[in] msg_class USB_MIDI_TX_CLASS_*
+//! \param[in] deadline_ms max. age in mS (0: never dropped)
+//! \return 0: no error
+//! \return -1: not supported (USB_MIDI_TX_DEADLINES == 0) or invalid class
+//! \note Applications shouldn't call this function directly, instead please use \ref MIDI layer functions
+/////////////////////////////////////////////////////////////////////////////
+s32 USB_MIDI_TxDeadlineSet(u8 msg_class, u16 deadline_ms)
+{
+#if USB_MIDI_TX_DEADLINES
+  if( msg_class >= USB_MIDI_TX_CLASSES )
+    return -1;
+
+  tx_deadline_ms[msg_class] = deadline_ms;
+
+  return 0;
+#else
+  (void)msg_class;
+  (void)deadline_ms;
+  return -1;
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//! \param[in] msg_class USB_MIDI_TX_CLASS_*
+//! \return >= 0: deadline of the message class in mS (0: never dropped)
+//! \return -1: not supported (USB_MIDI_TX_DEADLINES == 0) or invalid class
+//! \note Applications shouldn't call this function directly, instead please use \ref MIDI layer functions
+/////////////////////////////////////////////////////////////////////////////
+s32 USB_MIDI_TxDeadlineGet(u8 msg_class)
+{
+#if USB_MIDI_TX_DEADLINES
+  if( msg_class >= USB_MIDI_TX_CLASSES )
+    return -1;
+
+  return tx_deadline_ms[msg_class];
+#else
+  (void)msg_class;
+  return -1;
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//! This function returns the number of packages of a cable which have been
+//! dropped because their deadline has passed
+//! \param[in] cable number
+//! \param[out] dropped number of dropped packages (can be NULL)
+//! \return 0: no error
+//! \return -1: invalid cable
+//! \note Applications shouldn't call this function directly, instead please use \ref MIDI layer functions
+/////////////////////////////////////////////////////////////////////////////
+s32 USB_MIDI_TxDroppedCounterGet(u8 cable, u32 *dropped)
+{
+  if( cable >= USB_MIDI_NUM_PORTS )
+    return -1;
+
+  if( dropped )
+    *dropped = tx_dropped_ctr[cable];
+
+  return 0;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! This function enables the coalescing of continuous controllers:\n
+//! a CC, pitch bend or channel pressure package replaces a still queued
+//! package of the same cable, channel and controller instead of being
+//! appended, so that a slow host gets the latest value with less packages.
+//! The replaced value keeps its position in the Tx buffer.\n
+//! Bank select, data entry, (N)RPN and channel mode messages are never coalesced.
+//! \param[in] enable 1: coalescing enabled, 0: disabled
+//! \return 0: no error
+//! \return -1: not supported (USB_MIDI_TX_COALESCING == 0)
+//! \note Applications shouldn't call this function directly, instead please use \ref MIDI layer functions
+/////////////////////////////////////////////////////////////////////////////
+s32 USB_MIDI_TxCoalescingSet(u8 enable)
+{
+#if USB_MIDI_TX_COALESCING
+  // packages which have been queued while coalescing was disabled aren't indexed
+  if( enable && !tx_coalescing )
+    USB_MIDI_TxCoalescingIndexClear();
+  tx_coalescing = enable ? 1 : 0;
+
+  return 0;
+#else
+  (void)enable;
+  return -1;
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//! \return 1 if the coalescing of continuous controllers is enabled
+//! \note Applications shouldn't call this function directly, instead please use \ref MIDI layer functions
+/////////////////////////////////////////////////////////////////////////////
+s32 USB_MIDI_TxCoalescingGet(void)
+{
+#if USB_MIDI_TX_COALESCING
+  return tx_coalescing;
+#else
+  return 0;
+#endif
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! This function selects when queued packages are sent
+//! \param[in] mode USB_MIDI_TX_FLUSH_SYSTICK, USB_MIDI_TX_FLUSH_SOF,
+//!            USB_MIDI_TX_FLUSH_IMMEDIATE or USB_MIDI_TX_FLUSH_AGGREGATE
+//! \return 0: no error
+//! \return -1: unsupported mode
+//! \note Applications shouldn't call this function directly, instead please use \ref MIDI layer functions
+/////////////////////////////////////////////////////////////////////////////
+s32 USB_MIDI_TxFlushModeSet(u8 mode)
+{
+  u8 cable;
+
+  if( mode > USB_MIDI_TX_FLUSH_AGGREGATE )
+    return -1;
+
+  // nothing is sent before the next start of frame
+  for(cable=0; cable<USB_MIDI_NUM_PORTS; ++cable)
+    tx_flush_head[cable] = tx_buffer_tail[cable];
+  tx_aggregate_waiting = tx_aggregate_due = 0;
+  tx_flush_mode = mode;
+
+  // the send functions don't kick the other modes
+  USB_MIDI_TxBufferHandler();
+
+  return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//! \return the current Tx flush mode (USB_MIDI_TX_FLUSH_*)
+//! \note Applications shouldn't call this function directly, instead please use \ref MIDI layer functions
+/////////////////////////////////////////////////////////////////////////////
+s32 USB_MIDI_TxFlushModeGet(void)
+{
+  return tx_flush_mode;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//! This function sets the max. time which a package waits in the
+//! USB_MIDI_TX_FLUSH_AGGREGATE mode for more packages to fill a max-packet
+//! \param[in] deadline_us deadline in uS (0: send immediately)
+//! \return 0: no error
+//! \note Applications shouldn't call this function directly, instead please use \ref MIDI layer functions
+/////////////////////////////////////////////////////////////////////////////
+s32 USB_MIDI_TxFlushDeadlineSet(u16 deadline_us)
+{
+  tx_flush_deadline = deadline_us;
+
+  // the held back packages might be due already
+  USB_MIDI_TxBufferHandler();
+
+  return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//! \return the deadline of the USB_MIDI_TX_FLUSH_AGGREGATE mode in uS
+//! \note Applications shouldn't call this function directly, instead please use \ref MIDI layer functions
+/////////////////////////////////////////////////////////////////////////////
+s32 USB_MIDI_TxFlushDeadlineGet(void)
+{
+  return tx_flush_deadline;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! This function puts a new MIDI package into the Tx buffer of its cable\n
+//! System realtime messages are put into a separate buffer, they are sent
+//! ahead of all other packages with the next IN transfer\n
+//! The buffers are lock-free: the function can be called from the main loop
+//! and from interrupts of any priority, also for the same cable
 //! \param[in] package MIDI package
 //! \return 0: no error
-//! \return -1: USB not connected
+//! \return -1: USB not connected or invalid cable
 //! \return -2: buffer is full
 //!             caller should retry until buffer is free again
+//! \return -3: host doesn't read the IN endpoint, package has been dropped
+//!             (see USB_MIDI_TxHostStalled())
 //! \note Applications shouldn't call this function directly, instead please use \ref MIDI layer functions
 /////////////////////////////////////////////////////////////////////////////
 s32 USB_MIDI_PackageSend_NonBlocking(midi_package_t package)
 {
+  u8 cable = package.cable;
+
   // device available?
-  if( !transfer_possible )
+  if( !transfer_possible || cable >= USB_MIDI_NUM_PORTS )
     return -1;
 
-  // buffer full?
-  if( tx_buffer_size >= (USB_MIDI_TX_BUFFER_SIZE-1) ) {
+  // fast-drop while the host doesn't read
+  if( tx_host_stalled ) {
+    ++tx_overflow_ctr[cable];
+    return -3;
+  }
+
+  u8 realtime = IS_REALTIME_PACKAGE(package);
+
+#if USB_MIDI_TX_COALESCING
+  // replace the queued value of the same controller
+  s32 key = -1;
+  if( tx_coalescing && !realtime && (key=USB_MIDI_TxCoalescingKey(package)) >= 0 &&
+      USB_MIDI_TxCoalesce(package, key) )
+    return 0;
+#endif
+
+  // reserve a slot, buffer full?
+  u16 pos;
+  if( !(realtime ? USB_MIDI_TxReserve(&tx_rt_buffer_reserve, &tx_rt_buffer_tail, USB_MIDI_TX_RT_BUFFER_SIZE, 1, &pos)
+                 : USB_MIDI_TxReserve(&tx_buffer_reserve[cable], &tx_buffer_tail[cable], USB_MIDI_TX_BUFFER_SIZE, 1, &pos)) ) {
+    ++tx_overflow_ctr[cable];
+
     // call USB handler, so that we are able to get the buffer free again on next execution
     // (this call simplifies polling loops!)
-    USB_MIDI_TxBufferHandler();
+    USB_MIDI_Defer(USB_MIDI_DEFER_TX);
 
     // device still available?
     // (ensures that polling loop terminates if cable has been disconnected)
@@ -154,46 +624,285 @@ s32 USB_MIDI_PackageSend_NonBlocking(midi_package_t package)
     return -2;
   }
 
-  // put package into buffer - this operation should be atomic!
-  IRQ_Disable();
-  tx_buffer[tx_buffer_head++] = package.ALL;
-  if( tx_buffer_head >= USB_MIDI_TX_BUFFER_SIZE )
-    tx_buffer_head = 0;
-  ++tx_buffer_size;
-  IRQ_Enable();
+  // put package into buffer, it's visible to the consumer once the head has been updated
+  if( realtime ) {
+    tx_rt_buffer[pos & TX_RT_BUFFER_MASK] = package.ALL;
+    USB_MIDI_TxPublish(&tx_rt_buffer_head, tx_rt_buffer_seq, TX_RT_BUFFER_MASK, pos, 1);
+    tx_rt_sof = tx_sof_ctr;
+    tx_rt_active = 1;
+
+    // don't wait for the next SysTick if the endpoint is idle
+    USB_MIDI_Defer(USB_MIDI_DEFER_TX);
+  } else {
+    tx_buffer[cable][pos & TX_BUFFER_MASK] = package.ALL;
+#if USB_MIDI_TX_DEADLINES
+    tx_buffer_time[cable][pos & TX_BUFFER_MASK] = tx_time_ms;
+#endif
+#if USB_MIDI_TX_COALESCING
+    if( key >= 0 )
+      tx_coalescing_index[cable][key] = pos;
+#endif
+    USB_MIDI_TxPublish(&tx_buffer_head[cable], tx_buffer_seq[cable], TX_BUFFER_MASK, pos, 1);
+
+    if( tx_flush_mode >= USB_MIDI_TX_FLUSH_IMMEDIATE )
+      USB_MIDI_Defer(USB_MIDI_DEFER_TX);
+  }
+
+  return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//! This function puts multiple MIDI packages into the Tx buffers
+//! The slots are reserved once for each run of packages with the same cable
+//! (lock-free like USB_MIDI_PackageSend_NonBlocking())
+//! \param[in] packages array of MIDI packages
+//! \param[in] num number of packages
+//! \return >= 0: number of packages which have been put into the buffers
+//!                (less than num if the buffer of a cable is full: caller
+//!                should retry with the remaining packages)
+//! \return -1: USB not connected
+//! \return -3: host doesn't read the IN endpoint, all packages have been dropped
+//! \note Applications shouldn't call this function directly, instead please use \ref MIDI layer functions
+/////////////////////////////////////////////////////////////////////////////
+s32 USB_MIDI_PackageSendBatch(const midi_package_t *packages, u32 num)
+{
+#if USB_MIDI_TX_DEADLINES
+  u32 now = tx_time_ms;
+#endif
+  u32 count, run;
+  u16 pos, reserved, i;
+  u8 cable, realtime;
+
+  // device available?
+  if( !transfer_possible )
+    return -1;
+
+  // fast-drop while the host doesn't read
+  if( tx_host_stalled ) {
+    for(count=0; count<num; ++count)
+      if( packages[count].cable < USB_MIDI_NUM_PORTS )
+	++tx_overflow_ctr[packages[count].cable];
+    return -3;
+  }
+
+#if USB_MIDI_TX_COALESCING
+  // each package has to be checked against the queued packages
+  if( tx_coalescing ) {
+    for(count=0; count<num && USB_MIDI_PackageSend_NonBlocking(packages[count]) == 0; ++count);
+    return count;
+  }
+#endif
+
+  // stop at the first package which doesn't fit (or has an invalid cable), so that the order is kept
+  for(count=0; count<num; count+=reserved) {
+    cable = packages[count].cable;
+    if( cable >= USB_MIDI_NUM_PORTS )
+      break;
+    realtime = IS_REALTIME_PACKAGE(packages[count]);
+
+    for(run=1; (count + run) < num && run < 0xffff &&
+	  packages[count + run].cable == cable && IS_REALTIME_PACKAGE(packages[count + run]) == realtime; ++run);
+
+    if( realtime ) {
+      if( !(reserved=USB_MIDI_TxReserve(&tx_rt_buffer_reserve, &tx_rt_buffer_tail, USB_MIDI_TX_RT_BUFFER_SIZE, run, &pos)) )
+	break;
+      for(i=0; i<reserved; ++i)
+	tx_rt_buffer[(u16)(pos + i) & TX_RT_BUFFER_MASK] = packages[count + i].ALL;
+      USB_MIDI_TxPublish(&tx_rt_buffer_head, tx_rt_buffer_seq, TX_RT_BUFFER_MASK, pos, reserved);
+      tx_rt_sof = tx_sof_ctr;
+      tx_rt_active = 1;
+    } else {
+      if( !(reserved=USB_MIDI_TxReserve(&tx_buffer_reserve[cable], &tx_buffer_tail[cable], USB_MIDI_TX_BUFFER_SIZE, run, &pos)) )
+	break;
+      for(i=0; i<reserved; ++i) {
+#if USB_MIDI_TX_DEADLINES
+	tx_buffer_time[cable][(u16)(pos + i) & TX_BUFFER_MASK] = now;
+#endif
+	tx_buffer[cable][(u16)(pos + i) & TX_BUFFER_MASK] = packages[count + i].ALL;
+      }
+      USB_MIDI_TxPublish(&tx_buffer_head[cable], tx_buffer_seq[cable], TX_BUFFER_MASK, pos, reserved);
+    }
+
+    if( reserved < run ) {
+      count += reserved;
+      break;
+    }
+  }
+
+  // buffer full? call USB handler, so that we are able to get the buffer free again on next execution
+  if( count < num ) {
+    if( cable < USB_MIDI_NUM_PORTS )
+      tx_overflow_ctr[cable] += num - count;
+    USB_MIDI_Defer(USB_MIDI_DEFER_TX);
+  } else if( tx_flush_mode >= USB_MIDI_TX_FLUSH_IMMEDIATE ) {
+    USB_MIDI_Defer(USB_MIDI_DEFER_TX);
+  }
+
+  return count;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//! This function reserves free slots in the Tx buffer of a cable, so that
+//! packages can be written directly into the memory the IN transfer is sent from.\n
+//! The reserved slots are contiguous and taken lock-free like the ones of
+//! USB_MIDI_PackageSend_NonBlocking(), other producers (also interrupts) can
+//! send in the meantime. Their packages are queued behind the reserved slots
+//! and become visible once USB_MIDI_PackageSendCommit() has been called, so the
+//! reservation should be committed soon.\n
+//! Only one reservation per cable can be open.\n
+//! System realtime messages written into these slots don't get priority,
+//! they should be sent with USB_MIDI_PackageSend_NonBlocking() instead.
+//! \param[in] cable number (the cable field of the written packages has to match)
+//! \param[out] packages pointer to the first reserved slot
+//! \param[in] num number of requested slots
+//! \return > 0: number of reserved slots (can be less than num)
+//! \return -1: USB not connected, invalid cable or the previous reservation hasn't been committed
+//! \return -2: buffer is full
+//!             caller should retry until buffer is free again
+//! \return -3: host doesn't read the IN endpoint (see USB_MIDI_TxHostStalled())
+//! \note Applications shouldn't call this function directly, instead please use \ref MIDI layer functions
+/////////////////////////////////////////////////////////////////////////////
+s32 USB_MIDI_PackageSendReserve(u8 cable, midi_package_t **packages, u32 num)
+{
+  u32 count, contiguous;
+  u16 head;
+
+  // device available?
+  if( !transfer_possible || cable >= USB_MIDI_NUM_PORTS || tx_zerocopy_num[cable] )
+    return -1;
+
+  // fast-drop while the host doesn't read
+  if( tx_host_stalled ) {
+    ++tx_overflow_ctr[cable];
+    return -3;
+  }
+
+  // like USB_MIDI_TxReserve(), but the slots mustn't wrap around the end of the buffer
+  do {
+    head = ATOMIC_LoadExclusive16(&tx_buffer_reserve[cable]);
+    count = USB_MIDI_TX_BUFFER_SIZE - (u16)(head - tx_buffer_tail[cable]);
+    contiguous = USB_MIDI_TX_BUFFER_SIZE - (head & TX_BUFFER_MASK);
+    if( count > contiguous )
+      count = contiguous;
+    if( count > num )
+      count = num;
+    if( !count ) {
+      ATOMIC_ClearExclusive();
+      break;
+    }
+  } while( ATOMIC_StoreExclusive16(&tx_buffer_reserve[cable], head + count) );
+
+  // buffer full?
+  if( !count ) {
+    ++tx_overflow_ctr[cable];
+
+    // call USB handler, so that we are able to get the buffer free again on next execution
+    USB_MIDI_Defer(USB_MIDI_DEFER_TX);
+
+    return transfer_possible ? -2 : -1;
+  }
+
+  tx_zerocopy_pos[cable] = head;
+  tx_zerocopy_num[cable] = count;
+  *packages = (midi_package_t *)&tx_buffer[cable][head & TX_BUFFER_MASK];
+
+  return count;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//! This function hands over packages which have been written into the
+//! slots returned by USB_MIDI_PackageSendReserve() to the IN endpoint.\n
+//! The first num slots of the reservation are published. The unused slots
+//! behind them can only be given back if no other producer has reserved
+//! slots in the meantime, otherwise all reserved slots have to be written
+//! and committed.
+//! \param[in] cable number
+//! \param[in] num number of written packages (<= number of reserved slots)
+//! \return 0: no error
+//! \return -1: USB not connected, invalid cable, no open reservation or num too large
+//! \return -2: the unused slots can't be given back, the reservation stays open
+//! \note Applications shouldn't call this function directly, instead please use \ref MIDI layer functions
+/////////////////////////////////////////////////////////////////////////////
+s32 USB_MIDI_PackageSendCommit(u8 cable, u32 num)
+{
+  u16 pos, reserved, end;
+
+  if( cable >= USB_MIDI_NUM_PORTS )
+    return -1;
+
+  // only the slots of the open reservation can be committed
+  pos = tx_zerocopy_pos[cable];
+  reserved = tx_zerocopy_num[cable];
+  if( !reserved || num > reserved )
+    return -1;
+
+  // device still available? (the buffers have been cleared on a disconnection)
+  if( !transfer_possible ) {
+    tx_zerocopy_num[cable] = 0;
+    return -1;
+  }
+
+  // give back the unused slots
+  if( num < reserved ) {
+    do {
+      end = ATOMIC_LoadExclusive16(&tx_buffer_reserve[cable]);
+      if( end != (u16)(pos + reserved) ) {
+        ATOMIC_ClearExclusive();
+        return -2;
+      }
+    } while( ATOMIC_StoreExclusive16(&tx_buffer_reserve[cable], pos + num) );
+  }
+
+  tx_zerocopy_num[cable] = 0;
+  if( !num )
+    return 0;
+
+#if USB_MIDI_TX_DEADLINES
+  {
+    u32 now = tx_time_ms;
+    u32 i;
+    for(i=0; i<num; ++i)
+      tx_buffer_time[cable][(u16)(pos + i) & TX_BUFFER_MASK] = now;
+  }
+#endif
+
+  USB_MIDI_TxPublish(&tx_buffer_head[cable], tx_buffer_seq[cable], TX_BUFFER_MASK, pos, num);
+
+  if( tx_flush_mode >= USB_MIDI_TX_FLUSH_IMMEDIATE )
+    USB_MIDI_Defer(USB_MIDI_DEFER_TX);
 
   return 0;
 }
 
 /////////////////////////////////////////////////////////////////////////////
 //! This function puts a new MIDI package into the Tx buffer
-//! (blocking function)
+//! (blocking function)\n
+//! In thread mode it waits max. USB_MIDI_TX_SEND_TIMEOUT_US for free buffer
+//! space. If the host doesn't read the IN endpoint (e.g. windows: no program
+//! uses the MIDI IN port), the stalled host is detected after
+//! USB_MIDI_TX_STALL_FRAMES frames, afterwards all packages are dropped
+//! immediately until the host reads the endpoint again.\n
+//! Called from an interrupt handler it doesn't wait: the IN transfer is
+//! restarted by PendSV (USB_MIDI_DEFERRED) or the USB interrupt, which
+//! can't preempt the caller.
 //! \param[in] package MIDI package
 //! \return 0: no error
 //! \return -1: USB not connected
+//! \return -2: buffer full, package hasn't been queued (retry later)
+//! \return -3: host doesn't read the IN endpoint, package has been dropped
 //! \note Applications shouldn't call this function directly, instead please use \ref MIDI layer functions
 /////////////////////////////////////////////////////////////////////////////
 s32 USB_MIDI_PackageSend(midi_package_t package)
 {
-  static u16 timeout_ctr = 0;
-  // this function could hang up if USB is available, but MIDI port won't be
-  // serviced by the host (e.g. windows: no program uses the MIDI IN port)
-  // Therefore we time out the polling after 10000 tries
-  // Once the timeout value is reached, each new MIDI_PackageSend call will
-  // try to access the USB port only a single time anymore. Once the try
-  // was successfull (MIDI port will be used by host), timeout value is
-  // reset again
-
   s32 error;
+  u32 start;
 
-  while( (error=USB_MIDI_PackageSend_NonBlocking(package)) == -2 ) {
-    if( timeout_ctr >= 10000 )
-      break;
-    ++timeout_ctr;
-  }
+  if( (error=USB_MIDI_PackageSend_NonBlocking(package)) != -2 || IRQ_InHandler() )
+    return error;
 
-  if( error >= 0 ) // no error: reset timeout counter
-    timeout_ctr = 0;
+  start = DELAY_Now_uS();
+  while( (error=USB_MIDI_PackageSend_NonBlocking(package)) == -2 &&
+	 (u32)(DELAY_Now_uS() - start) < USB_MIDI_TX_SEND_TIMEOUT_US );
 
   return error;
 }
@@ -201,28 +910,160 @@ s32 USB_MIDI_PackageSend(midi_package_t package)
 
 /////////////////////////////////////////////////////////////////////////////
 //! This function checks for a new package
+//! The cables are served round robin, so that a flooded cable doesn't delay the others
 //! \param[out] package pointer to MIDI package (received package will be put into the given variable)
 //! \return -1 if no package in buffer
-//! \return >= 0: number of packages which are still in the buffer
+//! \return >= 0: number of packages which are still in the buffers
 //! \note Applications shouldn't call this function directly, instead please use \ref MIDI layer functions
 /////////////////////////////////////////////////////////////////////////////
 s32 USB_MIDI_PackageReceive(midi_package_t *package)
 {
+  u8 cable = rx_cable_next;
+  u16 tail = 0;
+  u16 size = 0;
+  u8 i;
+
+  for(i=0; i<USB_MIDI_NUM_PORTS; ++i) {
+    tail = rx_buffer_tail[cable];
+    if( (size=rx_buffer_head[cable] - tail) )
+      break;
+    if( ++cable >= USB_MIDI_NUM_PORTS )
+      cable = 0;
+  }
+
   // package received?
-  if( !rx_buffer_size )
+  if( !size )
+    return -1;
+
+  // get package, the slot is released to the producer once the tail has been updated
+  package->ALL = rx_buffer[cable][tail & RX_BUFFER_MASK];
+  USB_MIDI_BARRIER();
+  rx_buffer_tail[cable] = tail + 1;
+  rx_cable_next = ((cable + 1) >= USB_MIDI_NUM_PORTS) ? 0 : (cable + 1);
+
+  // continue a receive flow which has been stopped due to a full buffer
+  if( size <= (USB_MIDI_RX_LOW_WATERMARK+1) && (!rx_endpoint_armed || rx_transfer_full[rx_transfer_copy]) )
+    USB_MIDI_RxBufferHandler();
+
+  s32 remaining = size - 1;
+  for(i=0; i<USB_MIDI_NUM_PORTS; ++i)
+    if( i != cable )
+      remaining += (u16)(rx_buffer_head[i] - rx_buffer_tail[i]);
+
+  return remaining;
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! This function gets multiple packages from the Rx buffers
+//! The cable which is read first changes with each call
+//! \param[out] packages array which receives the MIDI packages
+//! \param[in] max maximum number of packages which fit into the array
+//! \return number of received packages (0 if no package in buffer)
+//! \note Applications shouldn't call this function directly, instead please use \ref MIDI layer functions
+/////////////////////////////////////////////////////////////////////////////
+s32 USB_MIDI_PackageReceiveBatch(midi_package_t *packages, u32 max)
+{
+  u8 cable = rx_cable_next;
+  u8 low = 0;
+  u32 count = 0;
+  u8 i;
+
+  rx_cable_next = ((cable + 1) >= USB_MIDI_NUM_PORTS) ? 0 : (cable + 1);
+
+  for(i=0; i<USB_MIDI_NUM_PORTS && count < max; ++i) {
+    u16 tail = rx_buffer_tail[cable];
+    u32 num = (u16)(rx_buffer_head[cable] - tail);
+
+    if( num > (max - count) )
+      num = max - count;
+
+    for(; num; --num)
+      packages[count++].ALL = rx_buffer[cable][tail++ & RX_BUFFER_MASK];
+
+    USB_MIDI_BARRIER();
+    rx_buffer_tail[cable] = tail;
+
+    if( (u16)(rx_buffer_head[cable] - tail) <= USB_MIDI_RX_LOW_WATERMARK )
+      low = 1;
+
+    if( ++cable >= USB_MIDI_NUM_PORTS )
+      cable = 0;
+  }
+
+  // continue a receive flow which has been stopped due to a full buffer
+  if( low && (!rx_endpoint_armed || rx_transfer_full[rx_transfer_copy]) )
+    USB_MIDI_RxBufferHandler();
+
+  return count;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! This function installs a callback which gets the received packages of
+//! a cable and message type directly from the USB interrupt, as soon as the
+//! OUT transfer has been received (e.g. for a MIDI clock follower or a panic
+//! handler which can't wait for the main loop).\n
+//! The callback returns 1 if it has consumed the package, otherwise the
+//! package is passed to the next matching callback and put into the Rx buffer.\n
+//! Callbacks run in interrupt context and should return quickly.
+//! \param[in] cable number or USB_MIDI_RX_CABLE_ALL
+//! \param[in] cin_mask one bit for each Code Index Number (USB_MIDI_RX_CIN_*)
+//! \param[in] callback function
+//! \return 0: no error
+//! \return -1: invalid cable or callback
+//! \return -2: all USB_MIDI_RX_CALLBACKS slots are in use
+//! \note Applications shouldn't call this function directly, instead please use \ref MIDI layer functions
+/////////////////////////////////////////////////////////////////////////////
+s32 USB_MIDI_RxCallbackInstall(u8 cable, u16 cin_mask, usb_midi_rx_callback_t callback)
+{
+  u32 prev;
+  u8 i;
+
+  if( !callback || (cable >= USB_MIDI_NUM_PORTS && cable != USB_MIDI_RX_CABLE_ALL) )
     return -1;
 
-  // get package - this operation should be atomic!
-  IRQ_Disable();
-  package->ALL = rx_buffer[rx_buffer_tail];
-  if( ++rx_buffer_tail >= USB_MIDI_RX_BUFFER_SIZE )
-    rx_buffer_tail = 0;
-  --rx_buffer_size;
-  IRQ_Enable();
+  // atomic operation, the slots are read by the USB interrupt
+  prev = IRQ_USB_Disable();
+  for(i=0; i<USB_MIDI_RX_CALLBACKS; ++i) {
+    if( !rx_callback[i].callback ) {
+      rx_callback[i].cin_mask = cin_mask;
+      rx_callback[i].cable = cable;
+      rx_callback[i].callback = callback;
+      IRQ_USB_Enable(prev);
+      return 0;
+    }
+  }
+  IRQ_USB_Enable(prev);
 
-  return rx_buffer_size;
+  return -2; // no free slot
 }
 
+/////////////////////////////////////////////////////////////////////////////
+//! This function removes all installations of a callback
+//! \param[in] callback function
+//! \return 0: no error
+//! \return -1: callback not installed
+//! \note Applications shouldn't call this function directly, instead please use \ref MIDI layer functions
+/////////////////////////////////////////////////////////////////////////////
+s32 USB_MIDI_RxCallbackDeInstall(usb_midi_rx_callback_t callback)
+{
+  s32 status = -1;
+  u32 prev;
+  u8 i;
+
+  prev = IRQ_USB_Disable();
+  for(i=0; i<USB_MIDI_RX_CALLBACKS; ++i) {
+    if( callback && rx_callback[i].callback == callback ) {
+      rx_callback[i].callback = NULL;
+      status = 0;
+    }
+  }
+  IRQ_USB_Enable(prev);
+
+  return status;
+}
 
 
 /////////////////////////////////////////////////////////////////////////////
@@ -239,21 +1080,153 @@ s32 USB_MIDI_PackageReceive(midi_package_t *package)
 /////////////////////////////////////////////////////////////////////////////
 s32 USB_MIDI_Periodic_mS(void)
 {
+#if USB_MIDI_TX_DEADLINES
+  ++tx_time_ms;
+#endif
 
-  USB_MIDI_RxBufferHandler();
+  // a suspended host doesn't send SOFs, and doesn't read the IN endpoint
+  if( tx_buffer_busy == 1 && transfer_possible &&
+      USB_OTG_dev.dev.device_status == USB_OTG_SUSPENDED )
+    tx_host_stalled = 1;
 
-  // check for packages which should be transmitted
-  USB_MIDI_TxBufferHandler();
+  // check for received packages, and for packages which should be transmitted
+  // (IMMEDIATE: packages which couldn't be sent by the send functions, AGGREGATE: expired deadline)
+  USB_MIDI_Defer(USB_MIDI_DEFER_RX | ((tx_flush_mode != USB_MIDI_TX_FLUSH_SOF) ? USB_MIDI_DEFER_TX : 0));
 
   return 0;
 }
 
 
+/////////////////////////////////////////////////////////////////////////////
+//! Runs the Rx/Tx buffer handlers which have been deferred by the USB
+//! interrupt and by USB_MIDI_Periodic_mS() (bottom half).
+//!
+//! Has to be called from PendSV_Handler() if USB_MIDI_DEFERRED is enabled,
+//! PendSV is configured to the lowest priority by USB_MIDI_Init().
+//! \note Applications shouldn't call this function directly, instead please use \ref MIDI layer functions
+/////////////////////////////////////////////////////////////////////////////
+void USB_MIDI_PendSV_Handler(void)
+{
+#if USB_MIDI_DEFERRED
+  // the flags are cleared before the handlers run: work which is deferred meanwhile pends PendSV again
+  if( deferred_rx ) {
+    deferred_rx = 0;
+    USB_MIDI_BARRIER();
+    USB_MIDI_RxBufferHandler();
+  }
+
+  if( deferred_tx ) {
+    deferred_tx = 0;
+    USB_MIDI_BARRIER();
+    USB_MIDI_TxBufferHandler();
+  }
+#endif
+}
+
+
+#if USB_MIDI_TX_COALESCING
+/////////////////////////////////////////////////////////////////////////////
+//! Returns the coalescing index slot of a package
+//! \return -1 if the package can't be coalesced
+/////////////////////////////////////////////////////////////////////////////
+static s32 USB_MIDI_TxCoalescingKey(midi_package_t package)
+{
+  u32 key;
+
+  switch( package.cin ) {
+  case CC:
+    // the order of bank select, data entry, (N)RPN and channel mode messages matters
+    switch( package.cc_number ) {
+    case 0: case 6: case 32: case 38:
+    case 96: case 97: case 98: case 99: case 100: case 101:
+      return -1;
+    }
+    if( package.cc_number >= 120 )
+      return -1;
+    key = package.evnt0 | ((u32)package.evnt1 << 8);
+    break;
+
+  case PitchBend:
+  case Aftertouch:
+    key = package.evnt0;
+    break;
+
+  default:
+    return -1;
+  }
+
+  return ((key * 2654435761u) >> 16) & TX_BUFFER_MASK;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//! Replaces the last queued package of the same controller, if it hasn't
+//! been handed over to the IN endpoint yet
+//! \return 1 if the package has been replaced
+/////////////////////////////////////////////////////////////////////////////
+static u8 USB_MIDI_TxCoalesce(midi_package_t package, s32 key)
+{
+  u8 cable = package.cable;
+  u8 replaced = 0;
+  u32 prev;
+
+  // atomic operation, the IN endpoint could take the slot in the meantime
+  // (producers above IRQ_USB_PRIORITY which coalesce the same controller aren't serialized)
+  prev = IRQ_USB_Disable();
+  {
+    u16 pos = tx_coalescing_index[cable][key];
+    u16 tail = tx_buffer_tail[cable];
+    u16 offset = pos - tail;
+
+    // the first slots could be part of the current IN transfer
+    // (all slots which could be taken while the transfer is prepared)
+    u16 in_transfer = (tx_buffer_busy == 1) ? tx_transfer_count[cable] : (tx_buffer_busy ? TX_DIRECT_PACKAGES : 0);
+    if( offset >= in_transfer &&
+	offset < (u16)(tx_buffer_head[cable] - tail) ) {
+      midi_package_t queued;
+      queued.ALL = tx_buffer[cable][pos & TX_BUFFER_MASK];
+
+      // hash collisions: the slot has to contain the same controller
+      if( queued.cin_cable == package.cin_cable && queued.evnt0 == package.evnt0 &&
+	  (package.cin != CC || queued.evnt1 == package.evnt1) ) {
+	tx_buffer[cable][pos & TX_BUFFER_MASK] = package.ALL;
+#if USB_MIDI_TX_DEADLINES
+	// the deadline applies to the new value
+	tx_buffer_time[cable][pos & TX_BUFFER_MASK] = tx_time_ms;
+#endif
+	replaced = 1;
+      }
+    }
+  }
+  IRQ_USB_Enable(prev);
+
+  return replaced;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//! Invalidates all entries of the coalescing index
+/////////////////////////////////////////////////////////////////////////////
+static void USB_MIDI_TxCoalescingIndexClear(void)
+{
+  u8 cable;
+  u16 i;
+
+  // the position before the tail is never in the queued range
+  for(cable=0; cable<USB_MIDI_NUM_PORTS; ++cable)
+    for(i=0; i<USB_MIDI_TX_BUFFER_SIZE; ++i)
+      tx_coalescing_index[cable][i] = tx_buffer_tail[cable] - 1;
+}
+#endif
+
+
 /////////////////////////////////////////////////////////////////////////////
 //! USB Device Mode
 //!
 //! This handler sends the new packages through the IN pipe if the buffer 
-//! is not empty
+//! is not empty.\n
+//! Pending system realtime messages are put at the beginning of the transfer.
+//! If packages of multiple cables are pending, they are interleaved round
+//! robin (one package per cable and turn), the cable which is served first
+//! changes with each transfer.
 /////////////////////////////////////////////////////////////////////////////
 static void USB_MIDI_TxBufferHandler(void)
 {
@@ -266,86 +1239,457 @@ static void USB_MIDI_TxBufferHandler(void)
   //   - new packages are in the buffer
   //   - the device is configured
 
-  // atomic operation to avoid conflict with other interrupts
-  IRQ_Disable();
+  // the handler is called from thread and interrupt context (PendSV, or SysTick and USB interrupt without USB_MIDI_DEFERRED):
+  // claim the IN endpoint atomically, the owner is the only consumer of the Tx buffers
+  u8 first, cable, active;
+  u32 queued;
+  u8 realtime;
+  u32 prev;
+  u16 i;
+
+#if USB_MIDI_TX_DEADLINES
+retry:
+#endif
+  first = cable = tx_cable_next;
+  active = 0;
+  queued = 0;
+
+  prev = IRQ_USB_Disable();
+  if( tx_buffer_busy || !transfer_possible ) {
+    IRQ_USB_Enable(prev);
+    return;
+  }
+  realtime = tx_rt_buffer_head != tx_rt_buffer_tail;
+  for(i=0; i<USB_MIDI_NUM_PORTS; ++i) {
+    u16 pending = USB_MIDI_TxPending(cable);
+    if( pending ) {
+      queued += pending;
+      if( !active++ )
+	first = cable;
+    }
+    if( ++cable >= USB_MIDI_NUM_PORTS )
+      cable = 0;
+  }
+  u8 hold = !active && !realtime;
+  // AGGREGATE mode: hold back the packages until they fill a max-packet or the deadline has passed
+  // (realtime messages are never held back)
+  if( !hold && tx_flush_mode == USB_MIDI_TX_FLUSH_AGGREGATE && !realtime && !tx_aggregate_due &&
+      queued < (USB_MIDI_DATA_IN_SIZE/4) ) {
+    u32 now = DELAY_Now_uS();
+    if( !tx_aggregate_waiting ) {
+      tx_aggregate_waiting = 1;
+      tx_aggregate_start = now;
+    }
+    hold = (u32)(now - tx_aggregate_start) < tx_flush_deadline;
+  }
+  if( hold ) {
+    // the last transfer ended with a full max-packet: a zero length packet completes
+    // the transfer on the host side, which would wait for further packets otherwise
+    if( tx_zlp_pending ) {
+      tx_zlp_pending = 0;
+      tx_transfer_len = 0;
+      tx_transfer_pktcnt = 1;
+      tx_transfer_sof = tx_sof_ctr;
+      tx_buffer_busy = 1;
+      DCD_EP_Tx(&USB_OTG_dev, USB_MIDI_DATA_IN_EP, (uint8_t*)tx_transfer_buffer, 0);
+    }
+    IRQ_USB_Enable(prev);
+    return;
+  }
+  tx_aggregate_waiting = 0;
+  tx_zlp_pending = 0; // the next transfer continues the data stream
+  tx_buffer_busy = 2;
+  IRQ_USB_Enable(prev);
+
+  tx_cable_next = ((first + 1) >= USB_MIDI_NUM_PORTS) ? 0 : (first + 1);
+
+  u32 *buf_addr;
+  u16 count;
+  u8 gather = realtime || active > 1;
+  // realtime messages are expected: don't let them wait behind a long transfer
+  u16 direct = tx_rt_active ? TX_TRANSFER_PACKAGES : TX_DIRECT_PACKAGES;
+#if USB_MIDI_TX_DEADLINES
+  u32 now = tx_time_ms;
+
+  // stale packages can't be skipped if the transfer is sent directly from the buffer
+  if( !gather ) {
+    u16 tail = tx_buffer_tail[first];
+    u16 pending = USB_MIDI_TxPending(first);
+    if( pending > direct )
+      pending = direct;
+    for(i=0; i<pending && !gather; ++i)
+      gather = USB_MIDI_TxStale(first, tail + i, now);
+  }
+#endif
+
+  if( gather ) {
+    // realtime messages first, then interleave the cables in the transfer buffer
+    // stale packages are skipped, their slots are released with the transfer
+    // (max. TX_TRANSFER_PACKAGES slots of each cable, so that the coalescing window holds)
+    u16 tail[USB_MIDI_NUM_PORTS];
+    u16 head[USB_MIDI_NUM_PORTS];
+    u16 rt_tail = tx_rt_buffer_tail;
+    u16 rt_head = tx_rt_buffer_head;
+    u8 pending;
+
+    for(cable=0; cable<USB_MIDI_NUM_PORTS; ++cable) {
+      u16 num = USB_MIDI_TxPending(cable);
+      tail[cable] = tx_buffer_tail[cable];
+      head[cable] = tail[cable] + ((num > TX_TRANSFER_PACKAGES) ? TX_TRANSFER_PACKAGES : num);
+    }
+    USB_MIDI_BARRIER();
+
+    count = 0;
+    while( rt_tail != rt_head && count < TX_TRANSFER_PACKAGES )
+      tx_transfer_buffer[count++] = tx_rt_buffer[rt_tail++ & TX_RT_BUFFER_MASK];
+    tx_rt_transfer_count = count;
+
+    do {
+      pending = 0;
+      cable = first;
+      for(i=0; i<USB_MIDI_NUM_PORTS && count < TX_TRANSFER_PACKAGES; ++i) {
+	if( tail[cable] != head[cable] ) {
+#if USB_MIDI_TX_DEADLINES
+	  if( USB_MIDI_TxStale(cable, tail[cable], now) )
+	    ++tx_dropped_ctr[cable];
+	  else
+#endif
+	    tx_transfer_buffer[count++] = tx_buffer[cable][tail[cable] & TX_BUFFER_MASK];
+	  ++tail[cable];
+	  ++tx_transfer_count[cable];
+	  pending |= (tail[cable] != head[cable]);
+	}
+	if( ++cable >= USB_MIDI_NUM_PORTS )
+	  cable = 0;
+      }
+    } while( pending && count < TX_TRANSFER_PACKAGES );
+
+    buf_addr = tx_transfer_buffer;
+
+#if USB_MIDI_TX_DEADLINES
+    if( !count ) {
+      // all packages were stale: release the slots without a transfer and continue with the next ones
+      // (each pass releases at least one slot, no recursion: the stack stays bounded with large buffers)
+      for(cable=0; cable<USB_MIDI_NUM_PORTS; ++cable) {
+	tx_buffer_tail[cable] += tx_transfer_count[cable];
+	tx_transfer_count[cable] = 0;
+      }
+      USB_MIDI_BARRIER();
+      tx_buffer_busy = 0;
+      EVENT_Set(EVENT_USB_MIDI_TX);
+
+      goto retry;
+    }
+#endif
+  } else {
+    // only one cable: send the packages directly from the buffer, up to the end of the buffer memory
+    // (multi-packet transfer, the driver refills the endpoint FIFO)
+    u16 tail = tx_buffer_tail[first];
+    count = USB_MIDI_TxPending(first);
+    if( count > direct )
+      count = direct;
+    if( count > (USB_MIDI_TX_BUFFER_SIZE - (tail & TX_BUFFER_MASK)) )
+      count = USB_MIDI_TX_BUFFER_SIZE - (tail & TX_BUFFER_MASK);
+    tx_transfer_count[first] = count;
+
+    buf_addr = &tx_buffer[first][tail & TX_BUFFER_MASK];
+  }
 
-  if( !tx_buffer_busy && tx_buffer_size && transfer_possible ) {
-    s16 count = (tx_buffer_size > (USB_MIDI_DATA_IN_SIZE/4)) ? (USB_MIDI_DATA_IN_SIZE/4) : tx_buffer_size;
+  // packages which were due but didn't fit into the transfer (or wrapped around) follow without delay
+  tx_aggregate_due = (u32)(count - tx_rt_transfer_count) < queued;
+
+  u16 mps = USB_OTG_dev.dev.in_ep[USB_MIDI_DATA_IN_EP & 0x7f].maxpacket;
+  tx_transfer_len = count*4;
+  tx_transfer_pktcnt = (tx_transfer_len + mps - 1) / mps;
+  tx_transfer_sof = tx_sof_ctr;
+  USB_MIDI_BARRIER();
+  tx_buffer_busy = 1;
+
+  // send to IN pipe
+  // atomic operation, DIEPEMPMSK is modified by the USB interrupt as well
+  prev = IRQ_USB_Disable();
+  DCD_EP_Tx(&USB_OTG_dev, USB_MIDI_DATA_IN_EP, (uint8_t*)buf_addr, count*4);
+  IRQ_USB_Enable(prev);
+}
 
-    // notify that new package is sent
-    tx_buffer_busy = 1;
 
-    // send to IN pipe
-    tx_buffer_size -= count;
+#if USB_MIDI_TX_DEADLINES
+/////////////////////////////////////////////////////////////////////////////
+//! Checks if a queued package has passed the deadline of its message class
+//! \return 1 if the package should be dropped
+/////////////////////////////////////////////////////////////////////////////
+static u8 USB_MIDI_TxStale(u8 cable, u16 pos, u32 now)
+{
+  midi_package_t package;
+  package.ALL = tx_buffer[cable][pos & TX_BUFFER_MASK];
+  u16 deadline = tx_deadline_ms[tx_deadline_class[package.cin]];
+
+  return deadline && (u32)(now - tx_buffer_time[cable][pos & TX_BUFFER_MASK]) >= deadline;
+}
+#endif
 
-    u32 *buf_addr = (u32 *)USB_tx_buffer;
-    int i;
-    for(i=0; i<count; ++i) {
-      *(buf_addr++) = tx_buffer[tx_buffer_tail];
-      if( ++tx_buffer_tail >= USB_MIDI_TX_BUFFER_SIZE )
-	tx_buffer_tail = 0;
+
+/////////////////////////////////////////////////////////////////////////////
+//! Reserves up to num slots of a Tx buffer (lock-free)
+//! \param[out] pos position of the first reserved slot
+//! \return number of reserved slots (0: buffer full)
+/////////////////////////////////////////////////////////////////////////////
+static u16 USB_MIDI_TxReserve(volatile u16 *reserve, volatile u16 *tail, u16 size, u16 num, u16 *pos)
+{
+  u16 first, count;
+
+  do {
+    first = ATOMIC_LoadExclusive16(reserve);
+    count = size - (u16)(first - *tail);
+    if( count > num )
+      count = num;
+    if( !count ) {
+      ATOMIC_ClearExclusive();
+      return 0;
     }
+  } while( ATOMIC_StoreExclusive16(reserve, first + count) );
+
+  *pos = first;
+  return count;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//! Marks reserved slots as written and hands them over to the consumer.\n
+//! The head is advanced over all consecutive written slots: a producer which
+//! has been preempted between reservation and publishing publishes the
+//! slots of the preempting producers behind its own ones as well.
+/////////////////////////////////////////////////////////////////////////////
+static void USB_MIDI_TxPublish(volatile u16 *head, volatile u16 *seq, u16 mask, u16 pos, u16 num)
+{
+  u16 h;
+
+  USB_MIDI_BARRIER();
+  for(; num; --num, ++pos)
+    seq[pos & mask] = pos;
+  USB_MIDI_BARRIER();
+
+  for(;;) {
+    h = ATOMIC_LoadExclusive16(head);
+    if( seq[h & mask] != h ) {
+      ATOMIC_ClearExclusive();
+      return;
+    }
+    while( seq[(u16)(h + 1) & mask] == (u16)(h + 1) )
+      ++h;
+    ATOMIC_StoreExclusive16(head, h + 1);
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! Returns the number of packages of a cable which can be sent now
+//! (in SOF mode only the packages which have been queued before the last start of frame)
+/////////////////////////////////////////////////////////////////////////////
+static u16 USB_MIDI_TxPending(u8 cable)
+{
+  u16 tail = tx_buffer_tail[cable];
+  u16 queued = tx_buffer_head[cable] - tail;
 
-    DCD_EP_Tx(&USB_OTG_dev, USB_MIDI_DATA_IN_EP, (uint8_t*)&USB_tx_buffer, count*4);
+  if( tx_flush_mode == USB_MIDI_TX_FLUSH_SOF ) {
+    // the flush head is behind the tail if the mode has been changed during a transfer
+    u16 flush = tx_flush_head[cable] - tail;
+    queued = (flush <= queued) ? flush : 0;
   }
 
-  IRQ_Enable();
+  return queued;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! Arms the OUT endpoint with the next free transfer buffer, unless an
+//! Rx buffer is filled above the high watermark (the host gets NAKs then)
+//! \note has to be called with interrupts disabled or from the USB interrupt
+/////////////////////////////////////////////////////////////////////////////
+static void USB_MIDI_RxArm(void)
+{
+  u8 ix = rx_transfer_arm;
+  u8 cable;
+
+  if( rx_endpoint_armed || rx_transfer_full[ix] )
+    return;
+
+  for(cable=0; cable<USB_MIDI_NUM_PORTS; ++cable)
+    if( (u16)(rx_buffer_head[cable] - rx_buffer_tail[cable]) > USB_MIDI_RX_HIGH_WATERMARK )
+      return;
+
+  rx_endpoint_armed = 1;
+  rx_transfer_arm = ix ^ 1;
+  // max-packets of the enumerated speed: a high speed device which runs at full speed
+  // doesn't wait for 16 packets until the transfer is completed
+  DCD_EP_PrepareRx(&USB_OTG_dev,
+		   USB_MIDI_DATA_OUT_EP,
+		   (uint8_t*)(rx_transfer_buffer[ix]),
+		   USB_MIDI_RX_PACKETS_PER_TRANSFER*USB_OTG_dev.dev.out_ep[USB_MIDI_DATA_OUT_EP & 0x7f].maxpacket);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! Passes the packages of a received transfer to the installed callbacks
+//! and marks the consumed ones
+//! \note called from the USB interrupt
+/////////////////////////////////////////////////////////////////////////////
+static void USB_MIDI_RxCallbacks(u8 ix)
+{
+  u32 *buf_addr = rx_transfer_buffer[ix];
+  u16 count = rx_transfer_count[ix];
+  u16 i;
+  u8 cb;
+
+  for(i=0; i<(RX_TRANSFER_PACKAGES+31)/32; ++i)
+    rx_transfer_consumed[ix][i] = 0;
+
+  for(cb=0; cb<USB_MIDI_RX_CALLBACKS && !rx_callback[cb].callback; ++cb);
+  if( cb >= USB_MIDI_RX_CALLBACKS )
+    return; // no callback installed
+
+  for(i=0; i<count; ++i) {
+    midi_package_t package;
+    package.ALL = buf_addr[i];
+    if( package.cable >= USB_MIDI_NUM_PORTS )
+      continue;
+
+    for(cb=0; cb<USB_MIDI_RX_CALLBACKS; ++cb) {
+      rx_callback_entry_t *entry = &rx_callback[cb];
+      if( entry->callback && (entry->cin_mask & (1 << package.cin)) &&
+	  (entry->cable == USB_MIDI_RX_CABLE_ALL || entry->cable == package.cable) &&
+	  entry->callback(package) > 0 ) {
+	rx_transfer_consumed[ix][i >> 5] |= 1 << (i & 31);
+	break;
+      }
+    }
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! Runs the buffer handlers from interrupt context: with USB_MIDI_DEFERRED
+//! only the work is noted and PendSV is pended (top half), the handlers
+//! are executed by USB_MIDI_PendSV_Handler()
+//! \param[in] work USB_MIDI_DEFER_RX and/or USB_MIDI_DEFER_TX
+/////////////////////////////////////////////////////////////////////////////
+static void USB_MIDI_Defer(u8 work)
+{
+#if USB_MIDI_DEFERRED
+  // byte stores, no masking required
+  if( work & USB_MIDI_DEFER_RX )
+    deferred_rx = 1;
+  if( work & USB_MIDI_DEFER_TX )
+    deferred_tx = 1;
+  IRQ_PendSV_Set();
+#else
+  if( work & USB_MIDI_DEFER_RX )
+    USB_MIDI_RxBufferHandler();
+  if( work & USB_MIDI_DEFER_TX )
+    USB_MIDI_TxBufferHandler();
+#endif
 }
 
 
 /////////////////////////////////////////////////////////////////////////////
 //! USB Device Mode
 //!
-//! This handler receives new packages if the Tx buffer is not full
+//! This handler copies received transfers into the Rx buffers of the cables
+//! (in the order of reception, as long as they fit) and re-arms the OUT endpoint.\n
+//! Packages for cables which don't exist are dropped.
 /////////////////////////////////////////////////////////////////////////////
 static void USB_MIDI_RxBufferHandler(void)
 {
-  s16 count;
+  u32 prev;
 
   // before using the handle: ensure that device (and class) already configured
   if( USB_OTG_dev.dev.class_cb == NULL ) {
     return;
   }
 
-  // atomic operation to avoid conflict with other interrupts
-  IRQ_Disable();
-
-  // check if we can receive new data and get packages to be received from OUT pipe
-  u32 ep_num = USB_MIDI_DATA_OUT_EP & 0x7f;
-  USB_OTG_EP *ep = &USB_OTG_dev.dev.out_ep[ep_num];
-  if( rx_buffer_new_data && (count=ep->xfer_count>>2) ) {
-    // check if buffer is free
-    if( count < (USB_MIDI_RX_BUFFER_SIZE-rx_buffer_size) ) {
-      u32 *buf_addr = (u32 *)USB_rx_buffer;
+  // the handler is called from thread and interrupt context (PendSV, or SysTick and USB interrupt without USB_MIDI_DEFERRED):
+  // the owner is the only producer of the Rx buffers, other callers let it run again
+  prev = IRQ_USB_Disable();
+  if( rx_handler_busy ) {
+    rx_handler_retrigger = 1;
+    IRQ_USB_Enable(prev);
+    return;
+  }
+  rx_handler_busy = 1;
+  IRQ_USB_Enable(prev);
+
+  do {
+    rx_handler_retrigger = 0;
+
+    // copy received packages into receive buffers
+    u8 ix;
+    while( rx_transfer_full[ix=rx_transfer_copy] ) {
+      u16 head[USB_MIDI_NUM_PORTS];
+      u16 space[USB_MIDI_NUM_PORTS];
+      u32 *buf_addr = rx_transfer_buffer[ix];
+      u16 count = rx_transfer_count[ix];
+      u16 i;
+      u8 cable;
+
+      for(cable=0; cable<USB_MIDI_NUM_PORTS; ++cable) {
+	head[cable] = rx_buffer_head[cable];
+	space[cable] = USB_MIDI_RX_BUFFER_SIZE - (u16)(head[cable] - rx_buffer_tail[cable]);
+      }
+
+      // check if buffers are free (the packages consumed by callbacks don't need space)
+      for(i=0; i<count; ++i) {
+	midi_package_t package;
+	package.ALL = buf_addr[i];
+	if( rx_transfer_consumed[ix][i >> 5] & (1 << (i & 31)) )
+	  continue;
+	if( package.cable < USB_MIDI_NUM_PORTS ) {
+	  if( !space[package.cable] )
+	    break;
+	  --space[package.cable];
+	}
+      }
+      if( i < count ) {
+	// the transfer is held back until the cable has been drained
+	if( !rx_transfer_blocked ) {
+	  midi_package_t package;
+	  package.ALL = buf_addr[i];
+	  rx_transfer_blocked = 1;
+	  ++rx_overflow_ctr[package.cable];
+	}
+	break;
+      }
+      rx_transfer_blocked = 0;
 
-      // copy received packages into receive buffer
-      // this operation should be atomic
-      do {
+      for(i=0; i<count; ++i) {
 	midi_package_t package;
-	package.ALL = *buf_addr++;
+	package.ALL = buf_addr[i];
 
-	//if( MIDI_SendPackageToRxCallback(USB0 + package.cable, package) == 0 ) 
+	if( package.cable < USB_MIDI_NUM_PORTS &&
+	    !(rx_transfer_consumed[ix][i >> 5] & (1 << (i & 31))) )
 	{
-	  rx_buffer[rx_buffer_head] = package.ALL;
-
-	  if( ++rx_buffer_head >= USB_MIDI_RX_BUFFER_SIZE )
-	    rx_buffer_head = 0;
-	  ++rx_buffer_size;
+	  rx_buffer[package.cable][head[package.cable]++ & RX_BUFFER_MASK] = package.ALL;
 	}
-      } while( --count > 0 );
+      }
 
       // notify, that data has been put into buffer
-      rx_buffer_new_data = 0;
+      USB_MIDI_BARRIER();
+      for(cable=0; cable<USB_MIDI_NUM_PORTS; ++cable)
+	rx_buffer_head[cable] = head[cable];
+
+      rx_transfer_copy = ix ^ 1;
+      rx_transfer_full[ix] = 0;
 
-      // configuration for next transfer
-      DCD_EP_PrepareRx(&USB_OTG_dev,
-		       USB_MIDI_DATA_OUT_EP,
-		       (uint8_t*)(USB_rx_buffer),
-		       USB_MIDI_DATA_OUT_SIZE);
+      // wake up the main loop
+      EVENT_Set(EVENT_USB_MIDI_RX);
     }
-  }
 
-  IRQ_Enable();
+    // configuration for next transfer
+    // atomic operation, the endpoint state is changed by the USB interrupt as well
+    prev = IRQ_USB_Disable();
+    USB_MIDI_RxArm();
+    if( !rx_handler_retrigger )
+      rx_handler_busy = 0;
+    IRQ_USB_Enable(prev);
+  } while( rx_handler_busy );
 }
 
 
@@ -356,11 +1700,69 @@ static void USB_MIDI_RxBufferHandler(void)
 /////////////////////////////////////////////////////////////////////////////
 void USB_MIDI_EP1_IN_Callback(u8 bEP __attribute__((__unused__)), u8 bEPStatus __attribute__((__unused__)))
 {
-  // package has been sent
+  u8 cable;
+
+  // package has been sent: release the slots to the producers
+  for(cable=0; cable<USB_MIDI_NUM_PORTS; ++cable) {
+    tx_buffer_tail[cable] += tx_transfer_count[cable];
+    tx_transfer_count[cable] = 0;
+  }
+  tx_rt_buffer_tail += tx_rt_transfer_count;
+  tx_rt_transfer_count = 0;
+  // terminated with a short packet? Otherwise a zero length packet follows if no packages are pending
+  tx_zlp_pending = tx_transfer_len && !(tx_transfer_len % USB_OTG_dev.dev.in_ep[USB_MIDI_DATA_IN_EP & 0x7f].maxpacket);
+  USB_MIDI_BARRIER();
   tx_buffer_busy = 0;
 
+  // the host reads the endpoint (again)
+  tx_host_stalled = 0;
+
+  // notify producers which are waiting for free buffer space
+  EVENT_Set(EVENT_USB_MIDI_TX);
+
   // check for next package
-  USB_MIDI_TxBufferHandler();
+  USB_MIDI_Defer(USB_MIDI_DEFER_TX);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//! Called by STM32 USB Device driver on each start of frame
+//! \note Applications shouldn't call this function directly, instead please use \ref MIDI layer functions
+/////////////////////////////////////////////////////////////////////////////
+void USB_MIDI_SOF_Callback(void)
+{
+  // stalled host: the current IN transfer hasn't been completed for USB_MIDI_TX_STALL_FRAMES frames
+  // (at high speed a SOF is sent in each of the 8 microframes)
+  u16 stall_sofs = (USB_OTG_dev.cfg.speed == USB_OTG_SPEED_HIGH) ? 8*USB_MIDI_TX_STALL_FRAMES : USB_MIDI_TX_STALL_FRAMES;
+  u16 rt_sofs = (USB_OTG_dev.cfg.speed == USB_OTG_SPEED_HIGH) ? 8*USB_MIDI_TX_RT_SHORT_TRANSFER_FRAMES : USB_MIDI_TX_RT_SHORT_TRANSFER_FRAMES;
+  ++tx_sof_ctr;
+
+  // no realtime messages for a while: long direct transfers again
+  if( tx_rt_active && (u16)(tx_sof_ctr - tx_rt_sof) >= rt_sofs )
+    tx_rt_active = 0;
+  if( tx_buffer_busy == 1 && transfer_possible &&
+      (u16)(tx_sof_ctr - tx_transfer_sof) >= stall_sofs ) {
+    // a multi-packet transfer can take longer on a busy bus: restart the timeout
+    // as long as the host reads packets of it
+    USB_OTG_DEPXFRSIZ_TypeDef deptsiz;
+    deptsiz.d32 = USB_OTG_READ_REG32(&USB_OTG_dev.regs.INEP_REGS[USB_MIDI_DATA_IN_EP & 0x7f]->DIEPTSIZ);
+    if( deptsiz.b.pktcnt != tx_transfer_pktcnt ) {
+      tx_transfer_pktcnt = deptsiz.b.pktcnt;
+      tx_transfer_sof = tx_sof_ctr;
+    } else
+      tx_host_stalled = 1;
+  }
+
+  // send the packages which have been queued during the last frame
+  // (the IN transfer complete callback continues with them, but not with newer ones)
+  if( tx_flush_mode == USB_MIDI_TX_FLUSH_SOF ) {
+    u8 cable;
+    for(cable=0; cable<USB_MIDI_NUM_PORTS; ++cable)
+      tx_flush_head[cable] = tx_buffer_head[cable];
+    USB_MIDI_Defer(USB_MIDI_DEFER_TX);
+  } else if( tx_flush_mode == USB_MIDI_TX_FLUSH_AGGREGATE ) {
+    // check the deadline of the held back packages
+    USB_MIDI_Defer(USB_MIDI_DEFER_TX);
+  }
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -368,11 +1770,26 @@ void USB_MIDI_EP1_IN_Callback(u8 bEP __attribute__((__unused__)), u8 bEPStatus _
 //! \note Applications shouldn't call this function directly, instead please use \ref MIDI layer functions
 //! \note also: bEP, bEPStatus only relevant for LPC17xx port
 /////////////////////////////////////////////////////////////////////////////
+#ifdef USB_OTG_HS_DEDICATED_EP1_ENABLED
+void USB_MIDI_EP1_OUT_Callback(u8 bEP __attribute__((__unused__)), u8 bEPStatus __attribute__((__unused__)))
+#else
 void USB_MIDI_EP2_OUT_Callback(u8 bEP __attribute__((__unused__)), u8 bEPStatus __attribute__((__unused__)))
+#endif
 {
-  // put package into buffer
-  rx_buffer_new_data = 1;
-  USB_MIDI_RxBufferHandler();
+  USB_OTG_EP *ep = &USB_OTG_dev.dev.out_ep[USB_MIDI_DATA_OUT_EP & 0x7f];
+
+  // the transfer has been received into the buffer which was armed last, switch to the other one immediately
+  u8 ix = rx_transfer_arm ^ 1;
+  rx_transfer_count[ix] = ep->xfer_count >> 2;
+  rx_endpoint_armed = 0;
+  USB_MIDI_RxArm();
+
+  // callbacks get the packages right away, also if the transfer has to wait for free space in the Rx buffers
+  USB_MIDI_RxCallbacks(ix);
+  rx_transfer_full[ix] = 1;
+
+  // put packages into buffer
+  USB_MIDI_Defer(USB_MIDI_DEFER_RX);
 }
 
 
@@ -15,6 +15,7 @@
 #define _USB_MIDI_H
 
 #include "midi.h"
+#include "usb_conf.h"
 
 /////////////////////////////////////////////////////////////////////////////
 // Global definitions
@@ -30,27 +31,216 @@
 #define USB_MIDI_NUM_PORTS 1
 #endif
 
-// buffer size (should be at least >= USB_MIDI_DESC_DATA_*_SIZE/4)
+// buffer size per cable (should be at least >= USB_MIDI_DESC_DATA_*_SIZE/4, has to be a power of two)
+// each cable has its own Rx and Tx buffer, so that a flooded port doesn't block the others
+// (scaled with the max-packet size of the high speed endpoints)
 #ifndef USB_MIDI_RX_BUFFER_SIZE
+#ifdef USE_USB_OTG_HS
+#define USB_MIDI_RX_BUFFER_SIZE  512 // packages
+#else
 #define USB_MIDI_RX_BUFFER_SIZE   64 // packages
 #endif
+#endif
 
 #ifndef USB_MIDI_TX_BUFFER_SIZE
+#ifdef USE_USB_OTG_HS
+#define USB_MIDI_TX_BUFFER_SIZE  512 // packages
+#else
 #define USB_MIDI_TX_BUFFER_SIZE   64 // packages
 #endif
+#endif
+
+// system realtime messages (CIN 0xf, 0xf8..0xff) of all cables are queued separately
+// and sent ahead of the cable buffers with the next IN transfer (has to be a power of two)
+#ifndef USB_MIDI_TX_RT_BUFFER_SIZE
+#define USB_MIDI_TX_RT_BUFFER_SIZE 16 // packages
+#endif
+
+
+// 1: continuous controllers (CC, pitch bend, channel pressure) can be coalesced in the
+// Tx buffers, enabled with USB_MIDI_TxCoalescingSet() (costs 2*USB_MIDI_TX_BUFFER_SIZE bytes per cable)
+#ifndef USB_MIDI_TX_COALESCING
+#define USB_MIDI_TX_COALESCING 0
+#endif
+
+
+// 1: the USB interrupt and USB_MIDI_Periodic_mS() only acknowledge the transfers and pend
+// PendSV, the Rx/Tx buffer handlers run in USB_MIDI_PendSV_Handler() at the lowest priority
+// (has to be called from PendSV_Handler()), so that they don't delay other interrupts.
+// The send functions only pend PendSV as well, they can be called from interrupts above
+// IRQ_USB_PRIORITY (the critical sections of this layer only mask up to IRQ_USB_PRIORITY)
+#ifndef USB_MIDI_DEFERRED
+#define USB_MIDI_DEFERRED 1
+#endif
+
+
+// 1: queued packages get a timestamp (USB_MIDI_Periodic_mS() ticks), the Tx handler drops
+// packages which have been queued longer than the deadline of their message class
+// (costs 4*USB_MIDI_TX_BUFFER_SIZE bytes per cable)
+#ifndef USB_MIDI_TX_DEADLINES
+#define USB_MIDI_TX_DEADLINES 0
+#endif
+
+// message classes (USB_MIDI_TxDeadlineSet())
+#define USB_MIDI_TX_CLASS_NOTE   0 // note off/on, poly pressure
+#define USB_MIDI_TX_CLASS_CC     1 // CC, program change, channel pressure, pitch bend
+#define USB_MIDI_TX_CLASS_SYSEX  2 // SysEx (dropping a part corrupts the whole message)
+#define USB_MIDI_TX_CLASS_COMMON 3 // system common and single byte messages
+#define USB_MIDI_TX_CLASSES      4
+
+// default deadlines in mS (0: never dropped)
+#ifndef USB_MIDI_TX_DEADLINE_NOTE_MS
+#define USB_MIDI_TX_DEADLINE_NOTE_MS   20
+#endif
+#ifndef USB_MIDI_TX_DEADLINE_CC_MS
+#define USB_MIDI_TX_DEADLINE_CC_MS     50
+#endif
+#ifndef USB_MIDI_TX_DEADLINE_SYSEX_MS
+#define USB_MIDI_TX_DEADLINE_SYSEX_MS  0
+#endif
+#ifndef USB_MIDI_TX_DEADLINE_COMMON_MS
+#define USB_MIDI_TX_DEADLINE_COMMON_MS 0
+#endif
 
 
 // size of IN/OUT pipe
+// with USE_USB_OTG_HS these are the high speed sizes, the endpoints are opened
+// with USB_MIDI_DATA_FS_SIZE if the device has been enumerated at full speed
+#ifdef USE_USB_OTG_HS
+#ifndef USB_MIDI_DATA_IN_SIZE
+#define USB_MIDI_DATA_IN_SIZE           512
+#endif
+#ifndef USB_MIDI_DATA_OUT_SIZE
+#define USB_MIDI_DATA_OUT_SIZE          512
+#endif
+#else
 #ifndef USB_MIDI_DATA_IN_SIZE
 #define USB_MIDI_DATA_IN_SIZE           64
 #endif
 #ifndef USB_MIDI_DATA_OUT_SIZE
 #define USB_MIDI_DATA_OUT_SIZE          64
 #endif
+#endif
+
+// max. packet size of full speed bulk endpoints
+#define USB_MIDI_DATA_FS_SIZE           64
+
+
+// number of max-packets per IN transfer which is gathered in the transfer buffer
+// (realtime messages or multiple cables pending)
+// 2: ping-pong, the next packet is already in the endpoint FIFO while the
+// current one is read by the host, DCD_EP_Tx is re-armed from the transfer
+// complete callback (the Tx FIFO of the endpoint has to hold both packets)
+#ifndef USB_MIDI_TX_PACKETS_PER_TRANSFER
+#define USB_MIDI_TX_PACKETS_PER_TRANSFER 2
+#endif
+
+// max. size of an IN transfer (in bytes) which is sent directly from the Tx buffer
+// of a cable (only this cable pending), limited by the end of the buffer memory:
+// the driver refills the endpoint FIFO with max-packets while the transfer is
+// running, so that a SysEx dump only costs one transfer complete interrupt per
+// transfer. Transfers which end with a full max-packet are terminated with a zero
+// length packet if no further packages are pending.
+// Default: half of the Tx buffer, the producers fill the other half while a transfer
+// is running (e.g. 4 kB transfers with USB_MIDI_TX_BUFFER_SIZE 2048).
+// Latency: realtime messages and the packages of other cables can't be put in front of
+// a running transfer, they wait until the host has read it. A transfer of more max-packets
+// than the host reads per frame breaks the one frame bound of the realtime messages, e.g.
+// 64 packets of a 4 kB transfer take 32 frames if the host reads 2 packets per frame on
+// a busy full speed bus. The packages of other cables always pay this cost.
+#ifndef USB_MIDI_TX_DIRECT_TRANSFER_SIZE
+#define USB_MIDI_TX_DIRECT_TRANSFER_SIZE (2*USB_MIDI_TX_BUFFER_SIZE)
+#endif
+
+// for the realtime messages the direct transfers are limited to USB_MIDI_TX_PACKETS_PER_TRANSFER
+// max-packets (like a gathered transfer) for this number of frames after one has been queued:
+// a running MIDI clock keeps its one frame bound, a SysEx dump without clock gets the long transfers
+#ifndef USB_MIDI_TX_RT_SHORT_TRANSFER_FRAMES
+#define USB_MIDI_TX_RT_SHORT_TRANSFER_FRAMES 100
+#endif
+
+
+// number of max-packets per OUT transfer
+// the OUT endpoint is armed alternately with two transfer buffers of this size
+#ifndef USB_MIDI_RX_PACKETS_PER_TRANSFER
+#define USB_MIDI_RX_PACKETS_PER_TRANSFER 2
+#endif
+
+// OUT endpoint flow control (in packages): the endpoint isn't re-armed while the
+// Rx buffer of any cable holds more packages than the high watermark, USB_MIDI_PackageReceive()
+// re-arms it once the buffer has been drained to the low watermark (has to be below the high watermark,
+// the gap is the hysteresis which avoids to stop and re-arm the endpoint with each package)
+#ifndef USB_MIDI_RX_HIGH_WATERMARK
+#define USB_MIDI_RX_HIGH_WATERMARK (USB_MIDI_RX_BUFFER_SIZE - USB_MIDI_RX_PACKETS_PER_TRANSFER*USB_MIDI_DATA_OUT_SIZE/4)
+#endif
+#ifndef USB_MIDI_RX_LOW_WATERMARK
+#define USB_MIDI_RX_LOW_WATERMARK (USB_MIDI_RX_HIGH_WATERMARK/2)
+#endif
+
+
+// max. number of Rx callbacks (USB_MIDI_RxCallbackInstall()), they are called from the
+// USB interrupt when an OUT transfer has been received, before the packages are put into the Rx buffers
+#ifndef USB_MIDI_RX_CALLBACKS
+#define USB_MIDI_RX_CALLBACKS 4
+#endif
+
+// cable of USB_MIDI_RxCallbackInstall(): all cables
+#define USB_MIDI_RX_CABLE_ALL 0xff
+
+// CIN masks of USB_MIDI_RxCallbackInstall()
+#define USB_MIDI_RX_CIN_NOTES       ((1 << 0x8) | (1 << 0x9) | (1 << 0xa))              // note off/on, poly pressure
+#define USB_MIDI_RX_CIN_CONTROLLERS ((1 << 0xb) | (1 << 0xc) | (1 << 0xd) | (1 << 0xe)) // CC, program change, channel pressure, pitch bend
+#define USB_MIDI_RX_CIN_SYSEX       ((1 << 0x4) | (1 << 0x5) | (1 << 0x6) | (1 << 0x7))
+#define USB_MIDI_RX_CIN_SINGLE_BYTE (1 << 0xf)                                          // includes the system realtime messages
+#define USB_MIDI_RX_CIN_ALL         0xffff
+
+// returns 1 if the package has been consumed, 0 if it should be put into the Rx buffer
+typedef s32 (*usb_midi_rx_callback_t)(midi_package_t package);
+
+
+// Tx flush modes (USB_MIDI_TxFlushModeSet())
+// SYSTICK:   queued packages are sent by USB_MIDI_Periodic_mS()
+// SOF:       queued packages are sent right after each start of frame, so that
+//            the latency is aligned to the USB frames
+// IMMEDIATE: the send functions start the transfer if the IN endpoint is idle
+// AGGREGATE: the transfer is started once a max-packet can be filled, or when the
+//            oldest package has waited for the deadline (USB_MIDI_TxFlushDeadlineSet()).
+//            The deadline is checked by the send functions, on each start of frame
+//            and by USB_MIDI_Periodic_mS()
+// in all modes the IN transfer complete callback continues with the remaining packages
+// (SOF: only with the packages which have been queued before the start of frame)
+#define USB_MIDI_TX_FLUSH_SYSTICK   0
+#define USB_MIDI_TX_FLUSH_SOF       1
+#define USB_MIDI_TX_FLUSH_IMMEDIATE 2
+#define USB_MIDI_TX_FLUSH_AGGREGATE 3
+
+// default deadline of the AGGREGATE mode
+#ifndef USB_MIDI_TX_FLUSH_DEADLINE_US
+#define USB_MIDI_TX_FLUSH_DEADLINE_US 1000
+#endif
+
+
+// the host is considered to have stopped reading the IN endpoint if a transfer hasn't been
+// completed within this number of frames (or while the bus is suspended), the send functions
+// drop all packages immediately then (-3) until the host reads the endpoint again
+#ifndef USB_MIDI_TX_STALL_FRAMES
+#define USB_MIDI_TX_STALL_FRAMES 10
+#endif
+
+// max. time USB_MIDI_PackageSend() waits for free buffer space in thread mode
+// (less than a frame, so that the first host stall doesn't block the caller for frames)
+#ifndef USB_MIDI_TX_SEND_TIMEOUT_US
+#define USB_MIDI_TX_SEND_TIMEOUT_US 500
+#endif
 
 
 // endpoint assignments (don't change!)
+#ifdef USB_OTG_HS_DEDICATED_EP1_ENABLED
+// OTG_HS: both data endpoints are on EP1, which has dedicated interrupt vectors
+#define USB_MIDI_DATA_OUT_EP 0x01
+#else
 #define USB_MIDI_DATA_OUT_EP 0x02
+#endif
 #define USB_MIDI_DATA_IN_EP  0x81
 
 
@@ -62,15 +252,40 @@ extern s32 USB_MIDI_Init(u32 mode);
 
 extern s32 USB_MIDI_ChangeConnectionState(u8 connected);
 extern void USB_MIDI_EP1_IN_Callback(u8 bEP, u8 bEPStatus);
+#ifdef USB_OTG_HS_DEDICATED_EP1_ENABLED
+extern void USB_MIDI_EP1_OUT_Callback(u8 bEP, u8 bEPStatus);
+#else
 extern void USB_MIDI_EP2_OUT_Callback(u8 bEP, u8 bEPStatus);
+#endif
+extern void USB_MIDI_SOF_Callback(void);
 
 extern s32 USB_MIDI_CheckAvailable(u8 cable);
+extern s32 USB_MIDI_TxBufferFree(u8 cable);
+extern s32 USB_MIDI_TxHostStalled(void);
+extern s32 USB_MIDI_OverflowCountersGet(u8 cable, u32 *tx_overflows, u32 *rx_overflows);
+extern s32 USB_MIDI_TxCoalescingSet(u8 enable);
+extern s32 USB_MIDI_TxCoalescingGet(void);
+extern s32 USB_MIDI_TxFlushModeSet(u8 mode);
+extern s32 USB_MIDI_TxFlushModeGet(void);
+extern s32 USB_MIDI_TxFlushDeadlineSet(u16 deadline_us);
+extern s32 USB_MIDI_TxFlushDeadlineGet(void);
+extern s32 USB_MIDI_TxDeadlineSet(u8 msg_class, u16 deadline_ms);
+extern s32 USB_MIDI_TxDeadlineGet(u8 msg_class);
+extern s32 USB_MIDI_TxDroppedCounterGet(u8 cable, u32 *dropped);
 
 extern s32 USB_MIDI_PackageSend_NonBlocking(midi_package_t package);
 extern s32 USB_MIDI_PackageSend(midi_package_t package);
+extern s32 USB_MIDI_PackageSendBatch(const midi_package_t *packages, u32 num);
+extern s32 USB_MIDI_PackageSendReserve(u8 cable, midi_package_t **packages, u32 num);
+extern s32 USB_MIDI_PackageSendCommit(u8 cable, u32 num);
 extern s32 USB_MIDI_PackageReceive(midi_package_t *package);
+extern s32 USB_MIDI_PackageReceiveBatch(midi_package_t *packages, u32 max);
+
+extern s32 USB_MIDI_RxCallbackInstall(u8 cable, u16 cin_mask, usb_midi_rx_callback_t callback);
+extern s32 USB_MIDI_RxCallbackDeInstall(usb_midi_rx_callback_t callback);
 
 extern s32 USB_MIDI_Periodic_mS(void);
+extern void USB_MIDI_PendSV_Handler(void);
 
 
 /////////////////////////////////////////////////////////////////////////////
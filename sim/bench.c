@@ -0,0 +1,1833 @@
+//! \defgroup BENCH
+//!
+//! Throughput benchmark of the USB MIDI layer on the simulated OTG core
+//!
+//! The host side is modelled as a full speed host which issues up to
+//! BENCH_SLOTS_PER_FRAME bulk transactions per 1 mS frame.
+//! USB_MIDI_Periodic_mS() is called once per frame, as from SysTick_Handler
+//! in main.c. All packages carry a sequence number which is checked on the
+//! receiving side.
+//!
+//! The "lat" column is the interrupt latency of the device in bus
+//! transactions: with 1 the host already issues the next token before the
+//! transfer complete interrupt of the previous one has been serviced.
+//!
+//! The "txr" run sends a MIDI clock once per frame while the Tx buffer
+//! is flooded and the host only issues BENCH_BUSY_IN_SLOTS IN tokens per
+//! frame (bus shared with other devices).
+//! The "txp"/"rxp" runs use all USB_MIDI_NUM_PORTS cables: cable 0 is
+//! flooded, the other cables carry one package per frame (Tx) or per
+//! packet (Rx). The worst case latency of these packages is reported
+//! below the table.
+//!
+//! The "txf" runs move BENCH_FADERS faders on a busy bus, a new position
+//! of each fader is sent in each bus slot and dropped if the Tx buffer is
+//! full. They are run without and with coalescing (USB_MIDI_TX_COALESCING)
+//! and report the number of packages which had to be transferred and the
+//! faders whose last position didn't arrive at the host.
+//!
+//! The "rxm"/"rxe" runs receive one package per frame at varying bus
+//! slots. "rxm" polls the Rx buffer once per mS (the former main loop),
+//! "rxe" whenever EVENT_USB_MIDI_RX has been set (EVENT_Wait() wakeup).
+//!
+//! The "ect"/"ecs" runs echo a package which the host sends at the start
+//! of each frame, with the Tx flush mode SYSTICK and SOF. The SysTick
+//! drifts against the USB frames by one bus slot every BENCH_SYSTICK_DRIFT
+//! frames (about 100 ppm).
+//!
+//! The "fsys"/"fsof"/"fimm"/"fagg" runs send one package in each bus slot
+//! with the Tx flush modes SYSTICK, SOF, IMMEDIATE and AGGREGATE (deadline
+//! BENCH_FLUSH_DEADLINE_US), and report the latency to the host and the
+//! number of packages per IN data packet.
+//!
+//! The "tdo"/"tdd" runs send one note per frame while the host stops
+//! polling the IN endpoint for BENCH_STALL_FRAMES of every
+//! BENCH_STALL_PERIOD frames, without and with the Tx deadlines
+//! (USB_MIDI_TX_DEADLINES). They report the notes which arrived later than
+//! USB_MIDI_TX_DEADLINE_NOTE_MS and the dropped ones.
+//!
+//! The "hst" run sends one package per bus slot with the same host stalls
+//! and reports how many frames it takes to detect the stalled host and to
+//! leave the fast-drop mode again, and the costs of the send calls which
+//! were rejected with -2 (buffer full, retry) and -3 (dropped). Once the
+//! stall has been detected the blocking USB_MIDI_PackageSend() is used.
+//!
+//! The "mpsc" run sends from three producers into the Tx buffer of cable 0:
+//! the main loop (one package per bus slot), an "ADC interrupt" and a
+//! "timer interrupt" with higher priority which also sends a MIDI clock.
+//! The interrupts are taken at random between the exclusive load and store
+//! of the interrupted producer (SIM_BSP_PreemptHookSet()). Each producer
+//! uses its own MIDI channel and sequence, all accepted packages have to
+//! arrive in the order of their producer.
+//!
+//! The "rxc0"/"rxc1" runs flood cable 0 from the host and insert a MIDI
+//! clock into the first packet of each frame, while the application only
+//! reads BENCH_SLOW_PACKAGES per bus slot. "rxc0" takes the clocks from the
+//! Rx buffer, "rxc1" installs a clock callback (USB_MIDI_RxCallbackInstall())
+//! which gets them from the USB interrupt. The clock latency is reported.
+//!
+//! The "twh" run drives USB_MIDI_Periodic_mS(), a 96 PPQN clock at 300 BPM
+//! with swing (re-armed at absolute times with TIMER_StartAt(), one MIDI
+//! clock each 4 ticks) and BENCH_TIMER_JOBS random one-shot and periodic
+//! jobs on all levels from the timer wheel (libs/timer.c), without a tick.
+//! The simulated compare interrupt is taken exactly at the programmed time,
+//! so each callback has to run at the expiry time of its job.
+//!
+//! The interrupt handler times (OTG interrupt and SysTick, including the
+//! time of nested handlers) are reported for the tx/rx/txp/rxp runs, with
+//! USB_MIDI_DEFERRED the buffer handlers run in PendSV instead.
+//!
+//! For the IN transfer completions of the "tx" run the dispatch path is
+//! measured from the entry of the interrupt handler to the DataIn stage of
+//! the device library, which calls USB_MIDI_EP1_IN_Callback() (host time and
+//! OTG register accesses). With USB_OTG_HS_DEDICATED_EP1_ENABLED the "tx"
+//! run is repeated with the EP1 interrupts routed through the OTG_HS
+//! interrupt (DAINTMSK instead of DEACHMSK) for comparison.
+//!
+//! Built with ISR_STATS=1 (USB_OTG_ISR_STATS), the calls and the time of
+//! each OTG interrupt source are listed for the tx/rx/txp/rxp runs.
+//!
+//! The high speed build (usb_midi_bench_hs, USE_USB_OTG_HS) runs the
+//! OTG_HS core with internal DMA and 512 byte bulk packets. The host issues
+//! BENCH_SLOTS_PER_FRAME transactions in the 8 microframes of a frame. Before
+//! the runs the speed dependent descriptors (device qualifier, other speed
+//! configuration, max. packet sizes of the bulk endpoints) and the first IN
+//! packet are checked at high speed and after an enumeration at full speed.
+//!
+//! Usage: usb_midi_bench [frames]
+//!
+//! \{
+
+/////////////////////////////////////////////////////////////////////////////
+// Include files
+/////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include <usb.h>
+#include <usb_midi.h>
+#include <usb_regs.h>
+#include <usb_dcd_int.h>
+
+#include "libs/delay.h"
+#include "libs/event.h"
+#include "libs/timer.h"
+
+#include "otg_sim.h"
+#include "sim_bsp.h"
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Local definitions
+/////////////////////////////////////////////////////////////////////////////
+
+#ifdef USE_USB_OTG_HS
+// max. number of 512 byte bulk transactions in the 8 microframes of a high speed frame
+#define BENCH_SLOTS_PER_FRAME  104
+#define BENCH_MICROFRAMES      8
+#define BENCH_CORE_BASE_ADDR   USB_OTG_HS_BASE_ADDR
+#define BENCH_CORE_NAME        "OTG_HS (high speed, DMA)"
+#else
+// max. number of 64 byte bulk transactions in a full speed frame
+#define BENCH_SLOTS_PER_FRAME  19
+#define BENCH_MICROFRAMES      1
+#define BENCH_CORE_BASE_ADDR   USB_OTG_FS_BASE_ADDR
+#define BENCH_CORE_NAME        "OTG_FS"
+#endif
+
+#define BENCH_DEFAULT_FRAMES   20000
+
+// packages per USB_MIDI_PackageSendBatch/ReceiveBatch call
+#define BENCH_BATCH_SIZE       16
+
+// application side API used by the Tx/Rx streams
+#define BENCH_MODE_SINGLE      0
+#define BENCH_MODE_BATCH       1
+#define BENCH_MODE_ZEROCOPY    2
+#define BENCH_MODE_SLOW        3 // application handles only BENCH_SLOW_PACKAGES per bus transaction
+
+#define BENCH_SLOW_PACKAGES    8
+
+// send slots of the packages in flight on the sparse cables (multi cable runs)
+#define BENCH_LATENCY_HISTORY  256
+
+// IN tokens per frame for the device when the bus is busy
+#define BENCH_BUSY_IN_SLOTS    2
+
+// frames after which the SysTick phase moves by one bus slot (echo runs)
+#define BENCH_SYSTICK_DRIFT    500
+
+// number of faders (CC 16.. on channel 1) of the coalescing runs
+#define BENCH_FADERS           8
+
+// deadline of the AGGREGATE flush run
+#define BENCH_FLUSH_DEADLINE_US 500
+
+// host stalls of the deadline runs (frames)
+#define BENCH_STALL_PERIOD     1000
+#define BENCH_STALL_FRAMES     200
+
+// producers of the MPSC run (main loop, ADC interrupt, timer interrupt)
+#define BENCH_PRODUCERS        3
+
+// clock of the timer wheel run: 96 PPQN at 300 BPM, one tick each 6250/3 uS
+#define BENCH_CLOCK_PPQN       96
+#define BENCH_CLOCK_TICK_NUM   6250
+#define BENCH_CLOCK_TICK_DEN   3
+#define BENCH_CLOCK_SWING_US   300
+
+// random background jobs of the timer wheel run
+#define BENCH_TIMER_JOBS       64
+#define BENCH_TIMER_MIN_PERIOD_US 250
+
+typedef struct {
+  const char *name;
+  u8 latency;
+  u32 frames;
+  u32 packages;
+  uint64_t host_ns;
+  sim_otg_stats_t otg;
+  sim_bsp_stats_t bsp;
+  u32 max_latency;     // bus slots (multi cable runs)
+  u32 offered;         // packages generated by the faders
+  u32 stale;           // faders whose last position didn't arrive
+  uint64_t latency_sum; // bus slots (event runs)
+  u32 wakeups;         // main loop iterations (event runs)
+  u32 min_latency;     // bus slots (echo runs)
+  u32 late;            // packages which missed their deadline (deadline runs)
+  u32 dropped;         // packages dropped by the Tx handler (deadline runs)
+  u32 stalls;          // host stalls (stall run)
+  u32 detect_frames;   // frames until the stalled host has been detected (sum)
+  u32 recover_frames;  // frames until the fast-drop mode has been left (sum)
+  u32 retries;         // send calls which returned -2
+  uint64_t retry_ns;
+  u32 drops;           // send calls which returned -3
+  uint64_t drop_ns;
+  u32 produced[BENCH_PRODUCERS + 1]; // accepted packages of each producer + clocks (MPSC run)
+  u32 tx_overflows[USB_MIDI_NUM_PORTS];
+  u32 rx_overflows[USB_MIDI_NUM_PORTS];
+  u32 in_completions;  // IN transfer completions of the MIDI endpoint
+  u32 in_dedicated;    // ... which have been dispatched by the OTG_HS_EP1_IN vector
+  uint64_t in_dispatch_ns;  // interrupt entry -> DataIn stage (sum)
+  uint64_t in_dispatch_regs;
+#if USB_OTG_ISR_STATS
+  USB_OTG_ISR_STATS_TypeDef isr_sources[USB_OTG_ISR_STATS_NUM];
+#endif
+} bench_result_t;
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Local Variables
+/////////////////////////////////////////////////////////////////////////////
+
+static u32 seq_errors;
+
+// dispatch path of the IN transfer completions (see BENCH_DataInStage())
+static USBD_DCD_INT_cb_TypeDef bench_dcd_int_cb;
+static USBD_DCD_INT_cb_TypeDef *bench_dcd_int_fops;
+static u32 in_completions;
+static u32 in_dedicated;
+static uint64_t in_dispatch_ns;
+static uint64_t in_dispatch_regs;
+
+#ifdef USB_OTG_HS_DEDICATED_EP1_ENABLED
+extern USB_OTG_CORE_HANDLE  USB_OTG_dev;
+
+// route the EP1 interrupts through the OTG interrupt, as without USB_OTG_HS_DEDICATED_EP1_ENABLED
+static u8 bench_ep1_generic;
+#endif
+
+// speed of the next enumeration (the high speed build can also enumerate at full speed)
+#ifdef USE_USB_OTG_HS
+static u8 bench_high_speed = 1;
+#else
+static u8 bench_high_speed = 0;
+#endif
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Helpers
+/////////////////////////////////////////////////////////////////////////////
+
+static midi_package_t BENCH_Package(u32 seq)
+{
+  midi_package_t p;
+
+  p.ALL = 0;
+  p.type = CC;
+  p.evnt0 = 0xb0 | ((seq >> 14) & 0x0f);
+  p.evnt1 = seq & 0x7f;
+  p.evnt2 = (seq >> 7) & 0x7f;
+
+  return p;
+}
+
+static midi_package_t BENCH_PackageCable(u8 cable, u32 seq)
+{
+  midi_package_t p = BENCH_Package(seq);
+
+  p.cable = cable;
+
+  return p;
+}
+
+static void BENCH_CheckCable(midi_package_t p, u8 cable, u32 *expected)
+{
+  if( p.ALL != BENCH_PackageCable(cable, *expected).ALL ) {
+    if( seq_errors++ < 10 )
+      fprintf(stderr, "sequence error: expected %08x, got %08x\n", (unsigned)BENCH_PackageCable(cable, *expected).ALL, (unsigned)p.ALL);
+  }
+  ++*expected;
+}
+
+static void BENCH_Check(midi_package_t p, u32 *expected)
+{
+  BENCH_CheckCable(p, 0, expected);
+}
+
+static s32 BENCH_Enumerate(void);
+
+static void BENCH_Start(bench_result_t *r, const char *name, u32 frames, u8 latency)
+{
+  s32 status;
+  u8 cable;
+
+  // each run starts with a freshly enumerated device and empty buffers
+  if( (status=BENCH_Enumerate()) < 0 ) {
+    fprintf(stderr, "enumeration failed (%d)\n", (int)status);
+    exit(1);
+  }
+
+  memset(r, 0, sizeof(*r));
+  for(cable=0; cable<USB_MIDI_NUM_PORTS; ++cable)
+    USB_MIDI_OverflowCountersGet(cable, &r->tx_overflows[cable], &r->rx_overflows[cable]);
+  r->name = name;
+  r->latency = latency;
+  r->frames = frames;
+  SIM_OTG_SetIrqLatency(latency);
+  memset(&sim_otg_stats, 0, sizeof(sim_otg_stats));
+  memset(&sim_bsp_stats, 0, sizeof(sim_bsp_stats));
+  in_completions = in_dedicated = 0;
+  in_dispatch_ns = in_dispatch_regs = 0;
+#if USB_OTG_ISR_STATS
+  USBD_OTG_ISR_StatsReset();
+#endif
+  r->host_ns = SIM_BSP_HostTime_nS();
+}
+
+static void BENCH_Stop(bench_result_t *r, u32 packages)
+{
+  u8 cable;
+
+  r->host_ns = SIM_BSP_HostTime_nS() - r->host_ns;
+  SIM_OTG_SetIrqLatency(0);
+  r->packages = packages;
+  r->otg = sim_otg_stats;
+  r->bsp = sim_bsp_stats;
+  r->in_completions = in_completions;
+  r->in_dedicated = in_dedicated;
+  r->in_dispatch_ns = in_dispatch_ns;
+  r->in_dispatch_regs = in_dispatch_regs;
+#if USB_OTG_ISR_STATS
+  memcpy(r->isr_sources, USBD_OTG_ISR_Stats, sizeof(r->isr_sources));
+#endif
+  // the overflow counters aren't cleared on re-enumeration
+  for(cable=0; cable<USB_MIDI_NUM_PORTS; ++cable) {
+    u32 tx, rx;
+    USB_MIDI_OverflowCountersGet(cable, &tx, &rx);
+    r->tx_overflows[cable] = tx - r->tx_overflows[cable];
+    r->rx_overflows[cable] = rx - r->rx_overflows[cable];
+  }
+}
+
+static void BENCH_SysTick(void)
+{
+  uint64_t enter_ns = SIM_BSP_ExceptionEnter();
+
+  USB_MIDI_Periodic_mS();
+
+  SIM_BSP_ExceptionExit(enter_ns);
+}
+
+static void BENCH_Frame(void)
+{
+  u8 i;
+
+  for(i=0; i<BENCH_MICROFRAMES; ++i) {
+    SIM_OTG_StartOfFrame();
+    SIM_BSP_AdvanceTime_uS(1000 / BENCH_MICROFRAMES);
+  }
+
+  BENCH_SysTick();
+}
+
+// deferred work of the USB interrupt and of the SysTick (core/stm32fxxx_it.c on the target)
+void PendSV_Handler(void)
+{
+  USB_MIDI_PendSV_Handler();
+}
+
+static void BENCH_Print(const bench_result_t *r)
+{
+  double n = r->packages ? (double)r->packages : 1.0;
+
+  printf("%-4s %3u %9u %11.0f %9.1f %9.2f %8.3f %10.3f %10.1f %8u %8u\n",
+	 r->name,
+	 r->latency,
+	 (unsigned)r->packages,
+	 r->packages / (r->frames / 1000.0),
+	 r->host_ns / n,
+	 (r->otg.reg_reads + r->otg.reg_writes) / n,
+	 r->otg.isr_calls / n,
+	 r->bsp.irq_disable_calls / n,
+	 r->bsp.irq_masked_ns / n,
+	 (unsigned)(r->otg.in_naks + r->otg.out_naks),
+	 (unsigned)r->otg.errors);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Enumeration
+/////////////////////////////////////////////////////////////////////////////
+
+static s32 BENCH_Enumerate(void)
+{
+  const u8 get_dev_desc[8] = { 0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 0x12, 0x00 };
+  const u8 get_dev_mps[8]  = { 0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 0x40, 0x00 };
+  const u8 set_address[8]  = { 0x00, 0x05, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00 };
+  const u8 get_cfg_desc[8] = { 0x80, 0x06, 0x00, 0x02, 0x00, 0x00, 0xff, 0x00 };
+  const u8 set_config[8]   = { 0x00, 0x09, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00 };
+  u8 desc[256];
+
+  SIM_OTG_BusReset(bench_high_speed);
+
+  // the device only returns the first 8 bytes before the address is set
+  if( SIM_OTG_ControlTransfer(get_dev_mps, desc, sizeof(desc)) != 8 || desc[7] != USB_OTG_MAX_EP0_SIZE )
+    return -1;
+  if( SIM_OTG_ControlTransfer(set_address, NULL, 0) < 0 )
+    return -2;
+  if( SIM_OTG_ControlTransfer(get_dev_desc, desc, sizeof(desc)) != 18 || desc[1] != 0x01 )
+    return -1;
+  if( SIM_OTG_ControlTransfer(get_cfg_desc, desc, sizeof(desc)) < 9 || desc[1] != 0x02 )
+    return -3;
+  if( SIM_OTG_ControlTransfer(set_config, NULL, 0) < 0 )
+    return -4;
+
+#ifdef USB_OTG_HS_DEDICATED_EP1_ENABLED
+  // the endpoints have been activated by the SET_CONFIGURATION request
+  if( bench_ep1_generic ) {
+    u32 msk = USB_OTG_READ_REG32(&USB_OTG_dev.regs.DREGS->DEACHMSK);
+    USB_OTG_MODIFY_REG32(&USB_OTG_dev.regs.DREGS->DEACHMSK, msk, 0);
+    USB_OTG_MODIFY_REG32(&USB_OTG_dev.regs.DREGS->DAINTMSK, 0, msk);
+  }
+#endif
+
+  return USB_MIDI_CheckAvailable(0) ? 0 : -5;
+}
+
+// interposed into the DCD interrupt callbacks: measures the path from the
+// interrupt entry to the DataIn stage (-> USB_MIDI_EP1_IN_Callback())
+static uint8_t BENCH_DataInStage(USB_OTG_CORE_HANDLE *pdev, uint8_t epnum)
+{
+  if( epnum == (USB_MIDI_DATA_IN_EP & 0x7f) ) {
+    uint64_t enter_ns;
+    u32 enter_regs;
+
+    if( SIM_OTG_IsrEntry(&enter_ns, &enter_regs) != SIM_OTG_IRQ_OTG )
+      ++in_dedicated;
+    ++in_completions;
+    in_dispatch_ns += SIM_BSP_HostTime_nS() - enter_ns;
+    in_dispatch_regs += sim_otg_stats.reg_reads + sim_otg_stats.reg_writes - enter_regs;
+  }
+
+  return bench_dcd_int_fops->DataInStage(pdev, epnum);
+}
+
+#ifdef USE_USB_OTG_HS
+// returns the max. packet size of both bulk endpoints of a configuration descriptor, 0 if they differ
+static u16 BENCH_BulkPacketSize(const u8 *desc, s32 len)
+{
+  u16 mps = 0;
+  s32 ofs;
+
+  for(ofs=0; (ofs+1) < len && desc[ofs]; ofs += desc[ofs]) {
+    // standard endpoint descriptors, the class specific ones use type 0x25
+    if( desc[ofs+1] == 0x05 ) {
+      u16 size = desc[ofs+4] | (desc[ofs+5] << 8);
+      if( mps && size != mps )
+	return 0;
+      mps = size;
+    }
+  }
+
+  return mps;
+}
+
+// enumerates at high or full speed and checks the speed dependent descriptors
+// and the size of the first IN packet
+static s32 BENCH_CheckSpeed(u8 high_speed)
+{
+  const u8 get_cfg_desc[8]   = { 0x80, 0x06, 0x00, 0x02, 0x00, 0x00, 0xff, 0x00 };
+  const u8 get_qualifier[8]  = { 0x80, 0x06, 0x00, 0x06, 0x00, 0x00, 0x0a, 0x00 };
+  const u8 get_other_cfg[8]  = { 0x80, 0x06, 0x00, 0x07, 0x00, 0x00, 0xff, 0x00 };
+  const u8 clear_config[8]   = { 0x00, 0x09, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+  u16 mps = high_speed ? USB_MIDI_DATA_IN_SIZE : USB_MIDI_DATA_FS_SIZE;
+  u16 other_mps = high_speed ? USB_MIDI_DATA_FS_SIZE : USB_MIDI_DATA_IN_SIZE;
+  u8 buffer[USB_MIDI_DATA_IN_SIZE];
+  u8 desc[256];
+  s32 len, status;
+  u32 seq;
+
+  bench_high_speed = high_speed;
+  status = BENCH_Enumerate();
+  bench_high_speed = 1;
+  if( status < 0 )
+    return status;
+
+  if( (len=SIM_OTG_ControlTransfer(get_cfg_desc, desc, sizeof(desc))) < 9 || desc[1] != 0x02 ||
+      BENCH_BulkPacketSize(desc, len) != mps )
+    return -6;
+  if( (len=SIM_OTG_ControlTransfer(get_other_cfg, desc, sizeof(desc))) < 9 || desc[1] != 0x07 ||
+      BENCH_BulkPacketSize(desc, len) != other_mps )
+    return -7;
+  if( SIM_OTG_ControlTransfer(get_qualifier, desc, sizeof(desc)) != 10 || desc[1] != 0x06 ||
+      desc[7] != USB_OTG_MAX_EP0_SIZE || desc[8] != 1 )
+    return -8;
+
+  // the endpoints have been opened with the packet size of the enumerated speed
+  for(seq=0; seq<(mps/4 + 1u); ++seq)
+    if( USB_MIDI_PackageSend_NonBlocking(BENCH_Package(seq)) < 0 )
+      return -9;
+  BENCH_Frame();
+  if( SIM_OTG_HostIn(USB_MIDI_DATA_IN_EP & 0x7f, buffer, sizeof(buffer)) != mps ||
+      SIM_OTG_HostIn(USB_MIDI_DATA_IN_EP & 0x7f, buffer, sizeof(buffer)) != 4 )
+    return -10;
+
+  // the speed only changes with a reconnection, which closes the endpoints
+  // (they keep their packet size over a bus reset)
+  if( SIM_OTG_ControlTransfer(clear_config, NULL, 0) < 0 )
+    return -11;
+
+  return 0;
+}
+#endif
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Device -> Host: application sends as fast as possible
+/////////////////////////////////////////////////////////////////////////////
+
+static void BENCH_Tx(bench_result_t *r, const char *name, u32 frames, u8 mode, u8 latency)
+{
+  u32 seq = 0;
+  u32 expected = 0;
+  u32 frame, slot;
+
+  BENCH_Start(r, name, frames, latency);
+
+  for(frame=0; frame<frames; ++frame) {
+    BENCH_Frame();
+
+    for(slot=0; slot<BENCH_SLOTS_PER_FRAME; ++slot) {
+      u8 buffer[USB_MIDI_DATA_IN_SIZE];
+      s32 len, i;
+
+      // application: fill the Tx buffer
+      if( mode == BENCH_MODE_ZEROCOPY ) {
+	midi_package_t *p;
+	s32 reserved;
+	while( (reserved=USB_MIDI_PackageSendReserve(0, &p, BENCH_BATCH_SIZE)) > 0 ) {
+	  for(i=0; i<reserved; ++i)
+	    p[i] = BENCH_Package(seq++);
+	  USB_MIDI_PackageSendCommit(0, reserved);
+	}
+      } else if( mode == BENCH_MODE_BATCH ) {
+	midi_package_t p[BENCH_BATCH_SIZE];
+	s32 sent;
+	do {
+	  for(i=0; i<BENCH_BATCH_SIZE; ++i)
+	    p[i] = BENCH_Package(seq + i);
+	  sent = USB_MIDI_PackageSendBatch(p, BENCH_BATCH_SIZE);
+	  if( sent > 0 )
+	    seq += sent;
+	} while( sent == BENCH_BATCH_SIZE );
+      } else {
+	while( USB_MIDI_PackageSend_NonBlocking(BENCH_Package(seq)) == 0 )
+	  ++seq;
+      }
+
+      // host: IN token
+      if( (len=SIM_OTG_HostIn(USB_MIDI_DATA_IN_EP & 0x7f, buffer, sizeof(buffer))) > 0 ) {
+	for(i=0; i<len; i+=4) {
+	  midi_package_t p;
+	  memcpy(&p.ALL, buffer + i, 4);
+	  BENCH_Check(p, &expected);
+	}
+      }
+    }
+  }
+
+  BENCH_Stop(r, expected);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Host -> Device: host sends full packets, application polls
+/////////////////////////////////////////////////////////////////////////////
+
+static void BENCH_Rx(bench_result_t *r, const char *name, u32 frames, u8 mode, u8 latency)
+{
+  u32 seq = 0;
+  u32 expected = 0;
+  u32 frame, slot;
+
+  BENCH_Start(r, name, frames, latency);
+
+  for(frame=0; frame<frames; ++frame) {
+    BENCH_Frame();
+
+    for(slot=0; slot<BENCH_SLOTS_PER_FRAME; ++slot) {
+      u8 buffer[USB_MIDI_DATA_OUT_SIZE];
+      midi_package_t p;
+      int i;
+
+      // host: OUT token, the same packet is retried after a NAK
+      for(i=0; i<USB_MIDI_DATA_OUT_SIZE/4; ++i) {
+	p = BENCH_Package(seq + i);
+	memcpy(buffer + 4*i, &p.ALL, 4);
+      }
+      if( SIM_OTG_HostOut(USB_MIDI_DATA_OUT_EP, buffer, sizeof(buffer)) >= 0 )
+	seq += USB_MIDI_DATA_OUT_SIZE/4;
+
+      // application: drain the Rx buffer
+      if( mode == BENCH_MODE_BATCH ) {
+	midi_package_t pb[BENCH_BATCH_SIZE];
+	s32 received;
+	while( (received=USB_MIDI_PackageReceiveBatch(pb, BENCH_BATCH_SIZE)) > 0 )
+	  for(i=0; i<received; ++i)
+	    BENCH_Check(pb[i], &expected);
+      } else if( mode == BENCH_MODE_SLOW ) {
+	for(i=0; i<BENCH_SLOW_PACKAGES && USB_MIDI_PackageReceive(&p) >= 0; ++i)
+	  BENCH_Check(p, &expected);
+      } else {
+	while( USB_MIDI_PackageReceive(&p) >= 0 )
+	  BENCH_Check(p, &expected);
+      }
+    }
+  }
+
+  BENCH_Stop(r, expected);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Device -> Host: the Tx buffer is flooded, a MIDI clock is sent once per frame
+/////////////////////////////////////////////////////////////////////////////
+
+static void BENCH_TxRealtime(bench_result_t *r, const char *name, u32 frames, u8 latency)
+{
+  u32 sent_slot[BENCH_LATENCY_HISTORY];
+  u32 seq = 0, expected = 0;
+  u32 clocks = 0, clocks_received = 0;
+  u32 frame, slot, now = 0;
+  u8 clock_pending = 0;
+  midi_package_t clock;
+  u16 deadline = USB_MIDI_TxDeadlineGet(USB_MIDI_TX_CLASS_CC);
+
+  BENCH_Start(r, name, frames, latency);
+  // the flood has to arrive completely, also with a Tx buffer which holds more than the deadline
+  USB_MIDI_TxDeadlineSet(USB_MIDI_TX_CLASS_CC, 0);
+
+  clock.ALL = 0;
+  clock.cin = 0xf;
+  clock.evnt0 = 0xf8;
+
+  for(frame=0; frame<frames; ++frame) {
+    BENCH_Frame();
+
+    // the latency is measured from the start of the frame, also if the clock has to be retried
+    if( !clock_pending ) {
+      clock_pending = 1;
+      sent_slot[clocks % BENCH_LATENCY_HISTORY] = now;
+    }
+
+    for(slot=0; slot<BENCH_SLOTS_PER_FRAME; ++slot, ++now) {
+      u8 buffer[USB_MIDI_DATA_IN_SIZE];
+      s32 len, i;
+
+      if( clock_pending && USB_MIDI_PackageSend_NonBlocking(clock) == 0 ) {
+	clock_pending = 0;
+	++clocks;
+      }
+
+      while( USB_MIDI_PackageSend_NonBlocking(BENCH_Package(seq)) == 0 )
+	++seq;
+
+      if( slot < BENCH_BUSY_IN_SLOTS &&
+	  (len=SIM_OTG_HostIn(USB_MIDI_DATA_IN_EP & 0x7f, buffer, sizeof(buffer))) > 0 ) {
+	for(i=0; i<len; i+=4) {
+	  midi_package_t p;
+	  memcpy(&p.ALL, buffer + i, 4);
+	  if( p.ALL == clock.ALL ) {
+	    if( (now - sent_slot[clocks_received % BENCH_LATENCY_HISTORY]) > r->max_latency )
+	      r->max_latency = now - sent_slot[clocks_received % BENCH_LATENCY_HISTORY];
+	    ++clocks_received;
+	  } else
+	    BENCH_Check(p, &expected);
+	}
+      }
+    }
+  }
+
+  if( clocks_received + 1 < clocks ) {
+    ++seq_errors;
+    fprintf(stderr, "%s: only %u of %u clocks received\n", name, (unsigned)clocks_received, (unsigned)clocks);
+  }
+
+  BENCH_Stop(r, expected + clocks_received);
+  USB_MIDI_TxDeadlineSet(USB_MIDI_TX_CLASS_CC, deadline);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Device -> Host: faders on a busy bus
+/////////////////////////////////////////////////////////////////////////////
+
+static midi_package_t BENCH_Fader(u8 fader, u8 value)
+{
+  midi_package_t p;
+
+  p.ALL = 0;
+  p.type = CC;
+  p.evnt0 = 0xb0;
+  p.cc_number = 16 + fader;
+  p.value = value;
+
+  return p;
+}
+
+static void BENCH_TxFaders(bench_result_t *r, const char *name, u32 frames, u8 coalescing)
+{
+  u8 position[BENCH_FADERS];
+  u8 received[BENCH_FADERS];
+  u32 frame, slot;
+  u8 fader;
+
+  BENCH_Start(r, name, frames, 0);
+  USB_MIDI_TxCoalescingSet(coalescing);
+  memset(received, 0xff, sizeof(received));
+
+  // the faders stop after the given number of frames, the host gets some more frames to drain the buffer
+  for(frame=0; frame<frames+10; ++frame) {
+    BENCH_Frame();
+
+    for(slot=0; slot<BENCH_SLOTS_PER_FRAME; ++slot) {
+      u8 buffer[USB_MIDI_DATA_IN_SIZE];
+      s32 len, i;
+
+      if( frame < frames ) {
+	for(fader=0; fader<BENCH_FADERS; ++fader) {
+	  position[fader] = (frame*BENCH_SLOTS_PER_FRAME + slot + fader) & 0x7f;
+	  USB_MIDI_PackageSend_NonBlocking(BENCH_Fader(fader, position[fader]));
+	  ++r->offered;
+	}
+      }
+
+      if( (slot < BENCH_BUSY_IN_SLOTS || frame >= frames) &&
+	  (len=SIM_OTG_HostIn(USB_MIDI_DATA_IN_EP & 0x7f, buffer, sizeof(buffer))) > 0 ) {
+	for(i=0; i<len; i+=4) {
+	  midi_package_t p;
+	  memcpy(&p.ALL, buffer + i, 4);
+	  fader = p.cc_number - 16;
+	  if( fader >= BENCH_FADERS || p.ALL != BENCH_Fader(fader, p.value).ALL ) {
+	    if( seq_errors++ < 10 )
+	      fprintf(stderr, "%s: unexpected package %08x\n", name, (unsigned)p.ALL);
+	  } else
+	    received[fader] = p.value;
+	  ++r->packages;
+	}
+      }
+    }
+  }
+
+  for(fader=0; fader<BENCH_FADERS; ++fader)
+    if( received[fader] != position[fader] )
+      ++r->stale;
+
+  USB_MIDI_TxCoalescingSet(0);
+  BENCH_Stop(r, r->packages);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Host -> Device: one package per frame, the application polls once per mS
+// or waits for EVENT_USB_MIDI_RX
+/////////////////////////////////////////////////////////////////////////////
+
+static void BENCH_RxEvents(bench_result_t *r, const char *name, u32 frames, u8 event_driven)
+{
+  u32 seq = 0, expected = 0;
+  u32 frame, slot, sent_slot = 0, now = 0;
+
+  BENCH_Start(r, name, frames, 0);
+  EVENT_Get(~0);
+
+  for(frame=0; frame<frames; ++frame) {
+    BENCH_Frame();
+
+    for(slot=0; slot<BENCH_SLOTS_PER_FRAME; ++slot, ++now) {
+      midi_package_t p;
+
+      // host: a single package at a varying position in the frame
+      if( slot == (frame*7) % BENCH_SLOTS_PER_FRAME ) {
+	p = BENCH_Package(seq);
+	if( SIM_OTG_HostOut(USB_MIDI_DATA_OUT_EP, (u8 *)&p.ALL, 4) >= 0 ) {
+	  ++seq;
+	  sent_slot = now;
+	}
+      }
+
+      // application: the former main loop polled once per mS
+      if( event_driven ? (EVENT_Get(EVENT_USB_MIDI_RX) != 0) : (slot == 0) ) {
+	++r->wakeups;
+	while( USB_MIDI_PackageReceive(&p) >= 0 ) {
+	  BENCH_Check(p, &expected);
+	  r->latency_sum += now - sent_slot;
+	  if( (now - sent_slot) > r->max_latency )
+	    r->max_latency = now - sent_slot;
+	}
+      }
+    }
+  }
+
+  BENCH_Stop(r, expected);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Host -> Device -> Host: the application echoes the packages which the
+// host sends at the start of each frame
+/////////////////////////////////////////////////////////////////////////////
+
+static void BENCH_Echo(bench_result_t *r, const char *name, u32 frames, u8 flush_mode)
+{
+  u32 sent_slot[BENCH_LATENCY_HISTORY];
+  u32 seq = 0, expected = 0;
+  u32 frame, slot, now = 0;
+
+  BENCH_Start(r, name, frames, 0);
+  USB_MIDI_TxFlushModeSet(flush_mode);
+  EVENT_Get(~0);
+  r->min_latency = ~0;
+
+  for(frame=0; frame<frames; ++frame) {
+    // the SysTick isn't synchronized to the USB frames
+    u32 tick_slot = (frame / BENCH_SYSTICK_DRIFT) % BENCH_SLOTS_PER_FRAME;
+
+    SIM_OTG_StartOfFrame();
+    SIM_BSP_AdvanceTime_uS(1000);
+
+    for(slot=0; slot<BENCH_SLOTS_PER_FRAME; ++slot, ++now) {
+      u8 buffer[USB_MIDI_DATA_IN_SIZE];
+      midi_package_t p;
+      s32 len, i;
+
+      if( slot == tick_slot )
+	BENCH_SysTick();
+
+      // host: OUT
+      if( slot == 0 ) {
+	p = BENCH_Package(seq);
+	if( SIM_OTG_HostOut(USB_MIDI_DATA_OUT_EP, (u8 *)&p.ALL, 4) >= 0 )
+	  sent_slot[seq++ % BENCH_LATENCY_HISTORY] = now;
+      }
+
+      // application: echo
+      if( EVENT_Get(EVENT_USB_MIDI_RX) )
+	while( USB_MIDI_PackageReceive(&p) >= 0 )
+	  USB_MIDI_PackageSend_NonBlocking(p);
+
+      // host: IN
+      if( (len=SIM_OTG_HostIn(USB_MIDI_DATA_IN_EP & 0x7f, buffer, sizeof(buffer))) > 0 ) {
+	for(i=0; i<len; i+=4) {
+	  u32 latency = now - sent_slot[expected % BENCH_LATENCY_HISTORY];
+	  memcpy(&p.ALL, buffer + i, 4);
+	  BENCH_Check(p, &expected);
+	  r->latency_sum += latency;
+	  if( latency > r->max_latency )
+	    r->max_latency = latency;
+	  if( latency < r->min_latency )
+	    r->min_latency = latency;
+	}
+      }
+    }
+  }
+
+  USB_MIDI_TxFlushModeSet(USB_MIDI_TX_FLUSH_SYSTICK);
+  BENCH_Stop(r, expected);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Device -> Host, one package per bus slot with the given Tx flush mode
+// the simulated time advances with each bus slot, so that the deadline of
+// the AGGREGATE mode can expire within a frame
+/////////////////////////////////////////////////////////////////////////////
+
+static void BENCH_TxFlush(bench_result_t *r, const char *name, u32 frames, u8 flush_mode)
+{
+  u32 sent_slot[BENCH_LATENCY_HISTORY];
+  u32 seq = 0, expected = 0;
+  u32 frame, slot, now = 0;
+  u32 slot_us = 1000 / BENCH_SLOTS_PER_FRAME;
+
+  BENCH_Start(r, name, frames, 0);
+  USB_MIDI_TxFlushModeSet(flush_mode);
+  USB_MIDI_TxFlushDeadlineSet(BENCH_FLUSH_DEADLINE_US);
+
+  for(frame=0; frame<frames; ++frame) {
+    SIM_OTG_StartOfFrame();
+    SIM_BSP_AdvanceTime_uS(1000 - slot_us*BENCH_SLOTS_PER_FRAME);
+
+    BENCH_SysTick();
+
+    for(slot=0; slot<BENCH_SLOTS_PER_FRAME; ++slot, ++now) {
+      u8 buffer[USB_MIDI_DATA_IN_SIZE];
+      midi_package_t p;
+      s32 len, i;
+
+      SIM_BSP_AdvanceTime_uS(slot_us);
+
+      // application
+      if( USB_MIDI_PackageSend_NonBlocking(BENCH_Package(seq)) >= 0 )
+	sent_slot[seq++ % BENCH_LATENCY_HISTORY] = now;
+
+      // host: IN
+      if( (len=SIM_OTG_HostIn(USB_MIDI_DATA_IN_EP & 0x7f, buffer, sizeof(buffer))) > 0 ) {
+	for(i=0; i<len; i+=4) {
+	  u32 latency = now - sent_slot[expected % BENCH_LATENCY_HISTORY];
+	  memcpy(&p.ALL, buffer + i, 4);
+	  BENCH_Check(p, &expected);
+	  r->latency_sum += latency;
+	  if( latency > r->max_latency )
+	    r->max_latency = latency;
+	}
+      }
+    }
+  }
+
+  USB_MIDI_TxFlushModeSet(USB_MIDI_TX_FLUSH_SYSTICK);
+  USB_MIDI_TxFlushDeadlineSet(USB_MIDI_TX_FLUSH_DEADLINE_US);
+  BENCH_Stop(r, expected);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Device -> Host, one note per frame, the host stalls periodically
+/////////////////////////////////////////////////////////////////////////////
+
+static midi_package_t BENCH_Note(u32 seq)
+{
+  midi_package_t p;
+
+  p.ALL = 0;
+  p.type = NoteOn;
+  p.evnt0 = 0x90 | ((seq >> 14) & 0x0f);
+  p.evnt1 = seq & 0x7f;
+  p.evnt2 = (seq >> 7) & 0x7f;
+
+  return p;
+}
+
+static void BENCH_TxStall(bench_result_t *r, const char *name, u32 frames, u8 deadlines)
+{
+  u32 sent_frame[BENCH_LATENCY_HISTORY];
+  u16 deadline = USB_MIDI_TxDeadlineGet(USB_MIDI_TX_CLASS_NOTE);
+  u32 seq = 0, next = 0;
+  u32 frame, slot;
+  u32 dropped;
+
+  BENCH_Start(r, name, frames, 0);
+  if( !deadlines )
+    USB_MIDI_TxDeadlineSet(USB_MIDI_TX_CLASS_NOTE, 0);
+  USB_MIDI_TxDroppedCounterGet(0, &dropped);
+
+  for(frame=0; frame<frames; ++frame) {
+    u8 stalled = (frame % BENCH_STALL_PERIOD) >= (BENCH_STALL_PERIOD - BENCH_STALL_FRAMES);
+
+    BENCH_Frame();
+
+    if( USB_MIDI_PackageSend_NonBlocking(BENCH_Note(seq)) >= 0 )
+      sent_frame[seq++ % BENCH_LATENCY_HISTORY] = frame;
+
+    for(slot=0; slot<BENCH_SLOTS_PER_FRAME && !stalled; ++slot) {
+      u8 buffer[USB_MIDI_DATA_IN_SIZE];
+      s32 len, i;
+
+      if( (len=SIM_OTG_HostIn(USB_MIDI_DATA_IN_EP & 0x7f, buffer, sizeof(buffer))) > 0 ) {
+	for(i=0; i<len; i+=4) {
+	  midi_package_t p;
+	  u32 received, latency;
+	  memcpy(&p.ALL, buffer + i, 4);
+	  received = p.evnt1 | ((u32)p.evnt2 << 7) | ((u32)(p.evnt0 & 0x0f) << 14);
+
+	  // dropped packages are allowed, but the order has to be kept
+	  if( p.ALL != BENCH_Note(received).ALL || received < next || received >= seq ) {
+	    if( seq_errors++ < 10 )
+	      fprintf(stderr, "%s: unexpected package %08x\n", name, (unsigned)p.ALL);
+	    continue;
+	  }
+	  next = received + 1;
+
+	  latency = frame - sent_frame[received % BENCH_LATENCY_HISTORY];
+	  if( latency > deadline )
+	    ++r->late;
+	  if( latency > r->max_latency )
+	    r->max_latency = latency;
+	  ++r->packages;
+	}
+      }
+    }
+  }
+
+  r->dropped = dropped;
+  USB_MIDI_TxDroppedCounterGet(0, &dropped);
+  r->dropped = dropped - r->dropped;
+  r->offered = seq;
+
+  USB_MIDI_TxDeadlineSet(USB_MIDI_TX_CLASS_NOTE, deadline);
+  BENCH_Stop(r, r->packages);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Device -> Host, one package per bus slot, the host stalls periodically
+/////////////////////////////////////////////////////////////////////////////
+
+static void BENCH_TxHostStall(bench_result_t *r, const char *name, u32 frames)
+{
+  u32 seq = 0, expected = 0;
+  u32 frame, slot;
+  u32 stall_start = 0, stall_end = 0;
+  u8 detected = 0, recovered = 1;
+  u16 deadline = USB_MIDI_TxDeadlineGet(USB_MIDI_TX_CLASS_CC);
+
+  BENCH_Start(r, name, frames, 0);
+  // all packages which have been queued have to arrive
+  USB_MIDI_TxDeadlineSet(USB_MIDI_TX_CLASS_CC, 0);
+
+  for(frame=0; frame<frames; ++frame) {
+    u8 stalled = (frame % BENCH_STALL_PERIOD) >= (BENCH_STALL_PERIOD - BENCH_STALL_FRAMES);
+
+    if( stalled && (frame % BENCH_STALL_PERIOD) == (BENCH_STALL_PERIOD - BENCH_STALL_FRAMES) ) {
+      ++r->stalls;
+      stall_start = frame;
+      detected = 0;
+    }
+    if( !stalled && (frame % BENCH_STALL_PERIOD) == 0 && r->stalls ) {
+      stall_end = frame;
+      recovered = 0;
+    }
+
+    BENCH_Frame();
+
+    if( !detected && r->stalls && USB_MIDI_TxHostStalled() ) {
+      detected = 1;
+      r->detect_frames += frame - stall_start;
+    }
+    if( !recovered && !USB_MIDI_TxHostStalled() ) {
+      recovered = 1;
+      r->recover_frames += frame - stall_end;
+    }
+
+    for(slot=0; slot<BENCH_SLOTS_PER_FRAME; ++slot) {
+      u8 buffer[USB_MIDI_DATA_IN_SIZE];
+      uint64_t t = SIM_BSP_HostTime_nS();
+      s32 status, len, i;
+
+      // application (the blocking send would wait for SOFs before the stall has been detected)
+      if( USB_MIDI_TxHostStalled() )
+	status = USB_MIDI_PackageSend(BENCH_Package(seq));
+      else
+	status = USB_MIDI_PackageSend_NonBlocking(BENCH_Package(seq));
+      t = SIM_BSP_HostTime_nS() - t;
+
+      if( status >= 0 ) {
+	++seq;
+      } else if( status == -2 ) {
+	++r->retries;
+	r->retry_ns += t;
+      } else if( status == -3 ) {
+	++r->drops;
+	r->drop_ns += t;
+      }
+
+      // host: IN
+      if( !stalled && (len=SIM_OTG_HostIn(USB_MIDI_DATA_IN_EP & 0x7f, buffer, sizeof(buffer))) > 0 ) {
+	for(i=0; i<len; i+=4) {
+	  midi_package_t p;
+	  memcpy(&p.ALL, buffer + i, 4);
+	  BENCH_Check(p, &expected);
+	}
+      }
+    }
+  }
+
+  USB_MIDI_TxDeadlineSet(USB_MIDI_TX_CLASS_CC, deadline);
+  BENCH_Stop(r, expected);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Device -> Host, multiple producers which preempt each other
+/////////////////////////////////////////////////////////////////////////////
+
+static bench_result_t *mpsc_result;
+static u32 mpsc_random = 1;
+static u8 mpsc_priority; // producer which is running
+
+static u32 BENCH_Random(void)
+{
+  mpsc_random = mpsc_random * 1103515245 + 12345;
+  return mpsc_random >> 16;
+}
+
+static midi_package_t BENCH_ProducerPackage(u8 producer, u32 seq)
+{
+  midi_package_t p;
+
+  p.ALL = 0;
+  p.type = CC;
+  p.evnt0 = 0xb0 | producer;
+  p.evnt1 = seq & 0x7f;
+  p.evnt2 = (seq >> 7) & 0x7f;
+
+  return p;
+}
+
+static void BENCH_Produce(u8 producer)
+{
+  bench_result_t *r = mpsc_result;
+
+  if( USB_MIDI_PackageSend_NonBlocking(BENCH_ProducerPackage(producer, r->produced[producer])) == 0 )
+    ++r->produced[producer];
+
+  // the timer interrupt sends a MIDI clock each 8th time
+  if( producer == 2 && (BENCH_Random() & 7) == 0 ) {
+    midi_package_t clock;
+    clock.ALL = 0;
+    clock.type = 0xf;
+    clock.evnt0 = 0xf8;
+    if( USB_MIDI_PackageSend_NonBlocking(clock) == 0 )
+      ++r->produced[BENCH_PRODUCERS];
+  }
+}
+
+// takes an interrupt of higher priority than the running producer at random
+static u8 BENCH_Preempt(void)
+{
+  u8 priority = mpsc_priority;
+  u8 producer;
+
+  if( priority >= (BENCH_PRODUCERS - 1) || (BENCH_Random() % 3) )
+    return 0;
+
+  producer = priority + 1 + (BENCH_Random() % (BENCH_PRODUCERS - 1 - priority));
+  mpsc_priority = producer;
+  {
+    uint64_t enter_ns = SIM_BSP_ExceptionEnter();
+    BENCH_Produce(producer);
+    SIM_BSP_ExceptionExit(enter_ns);
+  }
+  mpsc_priority = priority;
+
+  return 1;
+}
+
+static void BENCH_TxProducers(bench_result_t *r, const char *name, u32 frames)
+{
+  u32 expected[BENCH_PRODUCERS + 1];
+  u32 frame, slot;
+
+  BENCH_Start(r, name, frames, 0);
+  memset(expected, 0, sizeof(expected));
+  mpsc_result = r;
+  mpsc_priority = 0;
+  SIM_BSP_PreemptHookSet(BENCH_Preempt);
+
+  // the producers stop after the given number of frames, the host gets some more frames to drain the buffer
+  for(frame=0; frame<frames+10; ++frame) {
+    BENCH_Frame();
+
+    for(slot=0; slot<BENCH_SLOTS_PER_FRAME; ++slot) {
+      u8 buffer[USB_MIDI_DATA_IN_SIZE];
+      s32 len, i;
+
+      if( frame == frames )
+	SIM_BSP_PreemptHookSet(NULL);
+      if( frame < frames )
+	BENCH_Produce(0);
+
+      if( (len=SIM_OTG_HostIn(USB_MIDI_DATA_IN_EP & 0x7f, buffer, sizeof(buffer))) > 0 ) {
+	for(i=0; i<len; i+=4) {
+	  midi_package_t p;
+	  u8 producer;
+	  memcpy(&p.ALL, buffer + i, 4);
+
+	  if( p.cin == 0xf && p.evnt0 == 0xf8 ) {
+	    ++expected[BENCH_PRODUCERS];
+	    continue;
+	  }
+
+	  producer = p.evnt0 & 0x0f;
+	  if( producer >= BENCH_PRODUCERS || p.ALL != BENCH_ProducerPackage(producer, expected[producer]).ALL ) {
+	    if( seq_errors++ < 10 )
+	      fprintf(stderr, "%s: unexpected package %08x\n", name, (unsigned)p.ALL);
+	  }
+	  ++expected[producer < BENCH_PRODUCERS ? producer : 0];
+	}
+      }
+    }
+  }
+
+  for(slot=0; slot<=BENCH_PRODUCERS; ++slot) {
+    if( expected[slot] != r->produced[slot] ) {
+      if( seq_errors++ < 10 )
+	fprintf(stderr, "%s: producer %u: %u packages sent, %u received\n", name,
+		(unsigned)slot, (unsigned)r->produced[slot], (unsigned)expected[slot]);
+    }
+    r->packages += expected[slot];
+  }
+
+  BENCH_Stop(r, r->packages);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Device -> Host, multiple cables: cable 0 floods the Tx buffer, the other
+// cables send one package per frame
+/////////////////////////////////////////////////////////////////////////////
+
+static void BENCH_TxPorts(bench_result_t *r, const char *name, u32 frames, u8 latency)
+{
+  u32 seq[USB_MIDI_NUM_PORTS];
+  u32 expected[USB_MIDI_NUM_PORTS];
+  u32 sent_slot[USB_MIDI_NUM_PORTS][BENCH_LATENCY_HISTORY];
+  u32 frame, slot, now = 0, total = 0;
+  u8 cable;
+
+  BENCH_Start(r, name, frames, latency);
+  memset(seq, 0, sizeof(seq));
+  memset(expected, 0, sizeof(expected));
+
+  for(frame=0; frame<frames; ++frame) {
+    BENCH_Frame();
+
+    // the previous package of a sparse cable has always been received within a frame
+    for(cable=1; cable<USB_MIDI_NUM_PORTS; ++cable) {
+      if( expected[cable] == seq[cable] &&
+	  USB_MIDI_PackageSend_NonBlocking(BENCH_PackageCable(cable, seq[cable])) == 0 ) {
+	sent_slot[cable][seq[cable]++ % BENCH_LATENCY_HISTORY] = now;
+      }
+    }
+
+    for(slot=0; slot<BENCH_SLOTS_PER_FRAME; ++slot, ++now) {
+      u8 buffer[USB_MIDI_DATA_IN_SIZE];
+      s32 len, i;
+
+      while( USB_MIDI_PackageSend_NonBlocking(BENCH_PackageCable(0, seq[0])) == 0 )
+	++seq[0];
+
+      if( (len=SIM_OTG_HostIn(USB_MIDI_DATA_IN_EP & 0x7f, buffer, sizeof(buffer))) > 0 ) {
+	for(i=0; i<len; i+=4) {
+	  midi_package_t p;
+	  memcpy(&p.ALL, buffer + i, 4);
+	  cable = (p.cable < USB_MIDI_NUM_PORTS) ? p.cable : 0;
+	  if( cable && (now - sent_slot[cable][expected[cable] % BENCH_LATENCY_HISTORY]) > r->max_latency )
+	    r->max_latency = now - sent_slot[cable][expected[cable] % BENCH_LATENCY_HISTORY];
+	  BENCH_CheckCable(p, cable, &expected[cable]);
+	}
+      }
+    }
+  }
+
+  for(cable=0; cable<USB_MIDI_NUM_PORTS; ++cable)
+    total += expected[cable];
+  BENCH_Stop(r, total);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Host -> Device, multiple cables: each packet carries one package for a
+// sparse cable, the others are for cable 0. The application is slow, so
+// that the Rx flow control is active.
+/////////////////////////////////////////////////////////////////////////////
+
+static void BENCH_RxPorts(bench_result_t *r, const char *name, u32 frames, u8 latency)
+{
+  u32 seq[USB_MIDI_NUM_PORTS];
+  u32 expected[USB_MIDI_NUM_PORTS];
+  u32 sent_slot[USB_MIDI_NUM_PORTS][BENCH_LATENCY_HISTORY];
+  u32 frame, slot, now = 0, packets = 0, total = 0;
+  u8 cable;
+
+  BENCH_Start(r, name, frames, latency);
+  memset(seq, 0, sizeof(seq));
+  memset(expected, 0, sizeof(expected));
+
+  for(frame=0; frame<frames; ++frame) {
+    BENCH_Frame();
+
+    for(slot=0; slot<BENCH_SLOTS_PER_FRAME; ++slot, ++now) {
+      u8 buffer[USB_MIDI_DATA_OUT_SIZE];
+      u32 next[USB_MIDI_NUM_PORTS];
+      u8 sparse = (USB_MIDI_NUM_PORTS > 1) ? (1 + packets % (USB_MIDI_NUM_PORTS-1)) : 0;
+      midi_package_t p;
+      int i;
+
+      // host: OUT token, the same packet is retried after a NAK
+      memcpy(next, seq, sizeof(next));
+      for(i=0; i<USB_MIDI_DATA_OUT_SIZE/4; ++i) {
+	cable = (i == (USB_MIDI_DATA_OUT_SIZE/4-1)) ? sparse : 0;
+	p = BENCH_PackageCable(cable, next[cable]++);
+	memcpy(buffer + 4*i, &p.ALL, 4);
+      }
+      if( SIM_OTG_HostOut(USB_MIDI_DATA_OUT_EP, buffer, sizeof(buffer)) >= 0 ) {
+	sent_slot[sparse][seq[sparse] % BENCH_LATENCY_HISTORY] = now;
+	memcpy(seq, next, sizeof(seq));
+	++packets;
+      }
+
+      // application: slowly drain the Rx buffers
+      for(i=0; i<BENCH_SLOW_PACKAGES && USB_MIDI_PackageReceive(&p) >= 0; ++i) {
+	cable = (p.cable < USB_MIDI_NUM_PORTS) ? p.cable : 0;
+	if( cable && (now - sent_slot[cable][expected[cable] % BENCH_LATENCY_HISTORY]) > r->max_latency )
+	  r->max_latency = now - sent_slot[cable][expected[cable] % BENCH_LATENCY_HISTORY];
+	BENCH_CheckCable(p, cable, &expected[cable]);
+      }
+    }
+  }
+
+  for(cable=0; cable<USB_MIDI_NUM_PORTS; ++cable)
+    total += expected[cable];
+  BENCH_Stop(r, total);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Host -> Device: cable 0 is flooded, a MIDI clock is inserted once per frame
+/////////////////////////////////////////////////////////////////////////////
+
+static bench_result_t *rxc_result;
+static u32 rxc_sent_slot[BENCH_LATENCY_HISTORY];
+static u32 rxc_now;
+
+static void BENCH_RxClockReceived(bench_result_t *r)
+{
+  u32 latency = rxc_now - rxc_sent_slot[r->offered++ % BENCH_LATENCY_HISTORY];
+
+  r->latency_sum += latency;
+  if( latency > r->max_latency )
+    r->max_latency = latency;
+}
+
+static s32 BENCH_RxClockCallback(midi_package_t package)
+{
+  if( package.evnt0 != 0xf8 )
+    return 0; // not consumed
+
+  BENCH_RxClockReceived(rxc_result);
+  return 1;
+}
+
+static void BENCH_RxClock(bench_result_t *r, const char *name, u32 frames, u8 callback)
+{
+  u32 seq = 0;
+  u32 expected = 0;
+  u32 clocks = 0;
+  u32 frame, slot;
+
+  BENCH_Start(r, name, frames, 0);
+  rxc_result = r;
+  rxc_now = 0;
+  if( callback && USB_MIDI_RxCallbackInstall(0, USB_MIDI_RX_CIN_SINGLE_BYTE, BENCH_RxClockCallback) < 0 ) {
+    fprintf(stderr, "failed to install the Rx callback\n");
+    exit(1);
+  }
+
+  for(frame=0; frame<frames; ++frame) {
+    BENCH_Frame();
+
+    for(slot=0; slot<BENCH_SLOTS_PER_FRAME; ++slot, ++rxc_now) {
+      u8 buffer[USB_MIDI_DATA_OUT_SIZE];
+      u8 clock = clocks < frame + 1; // until the clock of this frame has been accepted
+      u32 next = seq;
+      midi_package_t p;
+      int i;
+
+      // host: OUT token, the same packet is retried after a NAK
+      for(i=0; i<USB_MIDI_DATA_OUT_SIZE/4; ++i) {
+	if( clock && i == (USB_MIDI_DATA_OUT_SIZE/4-1) ) {
+	  p.ALL = 0;
+	  p.type = 0xf;
+	  p.evnt0 = 0xf8;
+	} else
+	  p = BENCH_Package(next++);
+	memcpy(buffer + 4*i, &p.ALL, 4);
+      }
+      // (the callback is already invoked from SIM_OTG_HostOut())
+      if( clock )
+	rxc_sent_slot[clocks % BENCH_LATENCY_HISTORY] = rxc_now;
+      if( SIM_OTG_HostOut(USB_MIDI_DATA_OUT_EP, buffer, sizeof(buffer)) >= 0 ) {
+	clocks += clock;
+	seq = next;
+      }
+
+      // application: slowly drain the Rx buffer
+      for(i=0; i<BENCH_SLOW_PACKAGES && USB_MIDI_PackageReceive(&p) >= 0; ++i) {
+	if( p.evnt0 == 0xf8 )
+	  BENCH_RxClockReceived(r);
+	else
+	  BENCH_Check(p, &expected);
+      }
+    }
+  }
+
+  if( callback )
+    USB_MIDI_RxCallbackDeInstall(BENCH_RxClockCallback);
+  BENCH_Stop(r, expected + r->offered);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Tickless timer jobs: MIDI clock with swing and random background jobs
+/////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+  timer_job_t job;
+  u32 expected;        // DELAY_Now_uS() of the next callback
+  u32 period;
+} bench_timer_t;
+
+static bench_result_t *twh_result;
+static bench_timer_t twh_clock;
+static bench_timer_t twh_usb;
+static bench_timer_t twh_jobs[BENCH_TIMER_JOBS];
+static u32 twh_start;
+
+// random delay of one of the wheel levels
+static u32 BENCH_TimerDelay(void)
+{
+  u8 level = BENCH_Random() % TIMER_LEVELS;
+  u32 range = 1u << (TIMER_SLOT_SHIFT + level*TIMER_LEVEL_BITS);
+
+  return ((BENCH_Random() << 16) | BENCH_Random()) % range;
+}
+
+static void BENCH_TimerCheck(bench_timer_t *t)
+{
+  s32 error = (s32)(DELAY_Now_uS() - t->expected);
+
+  if( error ) {
+    ++twh_result->late;
+    if( (u32)abs(error) > twh_result->max_latency )
+      twh_result->max_latency = abs(error);
+  }
+}
+
+// clock tick n at n*BENCH_CLOCK_TICK_NUM/BENCH_CLOCK_TICK_DEN uS, the ticks of every second 16th note are delayed
+static u32 BENCH_ClockTickTime(u32 tick)
+{
+  u32 at = twh_start + (u32)(((uint64_t)tick * BENCH_CLOCK_TICK_NUM) / BENCH_CLOCK_TICK_DEN);
+
+  if( (tick / (BENCH_CLOCK_PPQN/4)) & 1 )
+    at += BENCH_CLOCK_SWING_US;
+
+  return at;
+}
+
+static void BENCH_ClockTick(void *arg)
+{
+  bench_timer_t *t = (bench_timer_t *)arg;
+  u32 tick = twh_result->offered++;
+
+  BENCH_TimerCheck(t);
+
+  // MIDI clock with 24 PPQN
+  if( (tick % (BENCH_CLOCK_PPQN/24)) == 0 ) {
+    midi_package_t clock;
+
+    clock.ALL = 0;
+    clock.cin = 0xf;
+    clock.evnt0 = 0xf8;
+    if( USB_MIDI_PackageSend_NonBlocking(clock) < 0 )
+      ++twh_result->dropped;
+  }
+
+  // one-shot which is re-armed at the absolute time of the next tick: no drift from the callback latency
+  t->expected = BENCH_ClockTickTime(tick + 1);
+  TIMER_StartAt(&t->job, t->expected, 0);
+}
+
+static void BENCH_TimerUsb(void *arg)
+{
+  bench_timer_t *t = (bench_timer_t *)arg;
+
+  BENCH_TimerCheck(t);
+  t->expected += t->period;
+
+  USB_MIDI_Periodic_mS();
+}
+
+static void BENCH_TimerJob(void *arg)
+{
+  bench_timer_t *t = (bench_timer_t *)arg;
+
+  BENCH_TimerCheck(t);
+  ++twh_result->wakeups;
+
+  // one-shot jobs are restarted with a new delay
+  if( t->period )
+    t->expected += t->period;
+  else {
+    u32 delay = BENCH_TimerDelay();
+    t->expected = DELAY_Now_uS() + delay;
+    TIMER_Start(&t->job, delay, 0);
+  }
+}
+
+static void BENCH_TimerStart(bench_timer_t *t, u32 delay, u32 period)
+{
+  t->expected = DELAY_Now_uS() + delay;
+  t->period = period;
+  TIMER_Start(&t->job, delay, period);
+}
+
+static void BENCH_TimerWheel(bench_result_t *r, const char *name, u32 frames)
+{
+  u32 frame, i;
+  u32 expected = 0;
+
+  BENCH_Start(r, name, frames, 0);
+  twh_result = r;
+
+  TIMER_Init();
+  twh_start = DELAY_Now_uS() + 1000;
+
+  // USB_MIDI_Periodic_mS() as a 1 mS job instead of BENCH_SysTick()
+  TIMER_JobInit(&twh_usb.job, BENCH_TimerUsb, &twh_usb);
+  BENCH_TimerStart(&twh_usb, 1000, 1000);
+
+  TIMER_JobInit(&twh_clock.job, BENCH_ClockTick, &twh_clock);
+  twh_clock.expected = BENCH_ClockTickTime(0);
+  TIMER_StartAt(&twh_clock.job, twh_clock.expected, 0);
+
+  // half of the background jobs are periodic
+  for(i=0; i<BENCH_TIMER_JOBS; ++i) {
+    TIMER_JobInit(&twh_jobs[i].job, BENCH_TimerJob, &twh_jobs[i]);
+    BENCH_TimerStart(&twh_jobs[i], BENCH_TimerDelay(), (i & 1) ? (BENCH_TIMER_MIN_PERIOD_US + BENCH_TimerDelay()) : 0);
+  }
+
+  for(frame=0; frame<frames; ++frame) {
+    u8 buffer[USB_MIDI_DATA_IN_SIZE];
+    s32 len;
+
+    SIM_OTG_StartOfFrame();
+
+    // the jobs are taken at their time while the clock advances
+    SIM_BSP_AdvanceTime_uS(1000);
+
+    // the application restarts (or stops) a random job
+    i = BENCH_Random() % BENCH_TIMER_JOBS;
+    if( BENCH_Random() & 1 )
+      BENCH_TimerStart(&twh_jobs[i], BENCH_TimerDelay(), (i & 1) ? (BENCH_TIMER_MIN_PERIOD_US + BENCH_TimerDelay()) : 0);
+    else if( TIMER_Stop(&twh_jobs[i].job) == 0 )
+      BENCH_TimerStart(&twh_jobs[i], BENCH_TimerDelay(), twh_jobs[i].period);
+
+    if( (len=SIM_OTG_HostIn(USB_MIDI_DATA_IN_EP & 0x7f, buffer, sizeof(buffer))) > 0 ) {
+      for(i=0; i<(u32)len; i+=4) {
+	midi_package_t p;
+	memcpy(&p.ALL, buffer + i, 4);
+	if( p.evnt0 == 0xf8 )
+	  ++expected;
+      }
+    }
+  }
+
+  TIMER_Stop(&twh_usb.job);
+  TIMER_Stop(&twh_clock.job);
+  for(i=0; i<BENCH_TIMER_JOBS; ++i)
+    TIMER_Stop(&twh_jobs[i].job);
+
+  if( r->late ) {
+    ++seq_errors;
+    fprintf(stderr, "%s: %u timer callbacks not at their time (max. %u uS)\n", name, (unsigned)r->late, (unsigned)r->max_latency);
+  }
+
+  BENCH_Stop(r, expected);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Main
+/////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char *argv[])
+{
+  bench_result_t results[28];
+#ifdef USB_OTG_HS_DEDICATED_EP1_ENABLED
+  bench_result_t ep1_generic;
+#endif
+  u32 frames = (argc > 1) ? strtoul(argv[1], NULL, 0) : BENCH_DEFAULT_FRAMES;
+  u32 i, failed = 0;
+  uint64_t init_wait_us;
+
+  if( SIM_OTG_Init(BENCH_CORE_BASE_ADDR) < 0 ) {
+    fprintf(stderr, "failed to map the OTG register window\n");
+    return 1;
+  }
+
+  DELAY_Init();
+  USB_Init(0);
+  init_wait_us = sim_bsp_stats.wait_us;
+
+  bench_dcd_int_fops = USBD_DCD_INT_fops;
+  bench_dcd_int_cb = *USBD_DCD_INT_fops;
+  bench_dcd_int_cb.DataInStage = BENCH_DataInStage;
+  USBD_DCD_INT_fops = &bench_dcd_int_cb;
+
+#ifdef USE_USB_OTG_HS
+  {
+    s32 status;
+    if( (status=BENCH_CheckSpeed(1)) < 0 || (status=BENCH_CheckSpeed(0)) < 0 ) {
+      fprintf(stderr, "speed dependent descriptors/packet sizes wrong (%d)\n", (int)status);
+      return 1;
+    }
+  }
+#endif
+
+  BENCH_Tx(&results[0], "tx", frames, BENCH_MODE_SINGLE, 0);
+  BENCH_Tx(&results[1], "txb", frames, BENCH_MODE_BATCH, 0);
+  BENCH_Tx(&results[2], "txz", frames, BENCH_MODE_ZEROCOPY, 0);
+  BENCH_Tx(&results[3], "tx", frames, BENCH_MODE_SINGLE, 1);
+  BENCH_Rx(&results[4], "rx", frames, BENCH_MODE_SINGLE, 0);
+  BENCH_Rx(&results[5], "rxb", frames, BENCH_MODE_BATCH, 0);
+  BENCH_Rx(&results[6], "rx", frames, BENCH_MODE_SINGLE, 1);
+  BENCH_Rx(&results[7], "rxs", frames, BENCH_MODE_SLOW, 0);
+  BENCH_TxRealtime(&results[8], "txr", frames, 0);
+  BENCH_TxPorts(&results[9], "txp", frames, 0);
+  BENCH_RxPorts(&results[10], "rxp", frames, 0);
+  BENCH_TxFaders(&results[11], "txf", frames, 0);
+  BENCH_TxFaders(&results[12], "txf", frames, 1);
+  BENCH_RxEvents(&results[13], "rxm", frames, 0);
+  BENCH_RxEvents(&results[14], "rxe", frames, 1);
+  BENCH_Echo(&results[15], "ect", frames, USB_MIDI_TX_FLUSH_SYSTICK);
+  BENCH_Echo(&results[16], "ecs", frames, USB_MIDI_TX_FLUSH_SOF);
+  BENCH_TxFlush(&results[17], "fsys", frames, USB_MIDI_TX_FLUSH_SYSTICK);
+  BENCH_TxFlush(&results[18], "fsof", frames, USB_MIDI_TX_FLUSH_SOF);
+  BENCH_TxFlush(&results[19], "fimm", frames, USB_MIDI_TX_FLUSH_IMMEDIATE);
+  BENCH_TxFlush(&results[20], "fagg", frames, USB_MIDI_TX_FLUSH_AGGREGATE);
+  BENCH_TxStall(&results[21], "tdo", frames, 0);
+  BENCH_TxStall(&results[22], "tdd", frames, 1);
+  BENCH_TxHostStall(&results[23], "hst", frames);
+  BENCH_TxProducers(&results[24], "mpsc", frames);
+  BENCH_RxClock(&results[25], "rxc0", frames, 0);
+  BENCH_RxClock(&results[26], "rxc1", frames, 1);
+  BENCH_TimerWheel(&results[27], "twh", frames);
+#ifdef USB_OTG_HS_DEDICATED_EP1_ENABLED
+  bench_ep1_generic = 1;
+  BENCH_Tx(&ep1_generic, "tx", frames, BENCH_MODE_SINGLE, 0);
+  bench_ep1_generic = 0;
+#endif
+
+  printf("USB MIDI benchmark: simulated %s, %u frames, %d bulk slots/frame\n", BENCH_CORE_NAME, (unsigned)frames, BENCH_SLOTS_PER_FRAME);
+  printf("USB_Init() waited %.1f mS (USB_OTG_BSP_mDelay/uDelay)\n", init_wait_us / 1000.0);
+#ifdef USE_USB_OTG_HS
+  printf("Descriptors ok at high and full speed (bulk packets %d/%d bytes), tx: %.1f DMA bytes, %.2f FIFO words per package\n",
+	 USB_MIDI_DATA_IN_SIZE, USB_MIDI_DATA_FS_SIZE,
+	 results[0].packages ? (double)results[0].otg.dma_bytes / results[0].packages : 0.0,
+	 results[0].packages ? (double)results[0].otg.fifo_words_in / results[0].packages : 0.0);
+#endif
+  printf("%-4s %3s %9s %11s %9s %9s %8s %10s %10s %8s %8s\n",
+	 "path", "lat", "packages", "pkg/s", "ns/pkg", "regs/pkg", "isr/pkg", "irqoff/pkg", "masked-ns", "naks", "errors");
+  for(i=0; i<sizeof(results)/sizeof(results[0]); ++i) {
+    BENCH_Print(&results[i]);
+    if( results[i].otg.errors || !results[i].packages )
+      ++failed;
+  }
+
+  printf("\n%d cables, worst case latency of the clock (txr) and of the sparse cables (txp/rxp):\n", USB_MIDI_NUM_PORTS);
+  for(i=8; i<11; ++i) {
+    u8 cable;
+    printf("%-4s %5u bus slots, overflows tx/rx:", results[i].name, (unsigned)results[i].max_latency);
+    for(cable=0; cable<USB_MIDI_NUM_PORTS; ++cable)
+      printf(" %u/%u", (unsigned)results[i].tx_overflows[cable], (unsigned)results[i].rx_overflows[cable]);
+    printf("\n");
+  }
+
+  printf("\n%d faders on a busy bus, without/with coalescing:\n", BENCH_FADERS);
+  for(i=11; i<13; ++i)
+    printf("%-4s %9u packages offered, %8u transferred, %u of %d faders stale\n",
+	   results[i].name, (unsigned)results[i].offered, (unsigned)results[i].packages,
+	   (unsigned)results[i].stale, BENCH_FADERS);
+
+  printf("\nRx to application latency, one package per frame (%.1f uS per bus slot):\n", 1000.0 / BENCH_SLOTS_PER_FRAME);
+  for(i=13; i<15; ++i) {
+    double n = results[i].packages ? (double)results[i].packages : 1.0;
+    printf("%-4s avg %6.1f uS, max %6.1f uS (0: same bus slot), %u main loop wakeups\n", results[i].name,
+	   results[i].latency_sum / n * 1000.0 / BENCH_SLOTS_PER_FRAME,
+	   results[i].max_latency * 1000.0 / BENCH_SLOTS_PER_FRAME,
+	   (unsigned)results[i].wakeups);
+  }
+
+  printf("\nEcho latency (host OUT -> application -> host IN), Tx flush on SysTick/SOF:\n");
+  for(i=15; i<17; ++i) {
+    double n = results[i].packages ? (double)results[i].packages : 1.0;
+    printf("%-4s min %6.1f uS, avg %6.1f uS, max %6.1f uS\n", results[i].name,
+	   results[i].min_latency * 1000.0 / BENCH_SLOTS_PER_FRAME,
+	   results[i].latency_sum / n * 1000.0 / BENCH_SLOTS_PER_FRAME,
+	   results[i].max_latency * 1000.0 / BENCH_SLOTS_PER_FRAME);
+  }
+
+  printf("\nTx flush modes, one package per bus slot (AGGREGATE deadline %d uS):\n", BENCH_FLUSH_DEADLINE_US);
+  for(i=17; i<21; ++i) {
+    double n = results[i].packages ? (double)results[i].packages : 1.0;
+    printf("%-4s avg %6.1f uS, max %6.1f uS, %5.2f packages per IN packet\n", results[i].name,
+	   results[i].latency_sum / n * 1000.0 / BENCH_SLOTS_PER_FRAME,
+	   results[i].max_latency * 1000.0 / BENCH_SLOTS_PER_FRAME,
+	   n / (results[i].otg.in_packets ? results[i].otg.in_packets : 1));
+  }
+
+  printf("\nOne note per frame, host stalls for %d of %d frames, without/with Tx deadlines (notes: %d mS):\n",
+	 BENCH_STALL_FRAMES, BENCH_STALL_PERIOD, USB_MIDI_TX_DEADLINE_NOTE_MS);
+  for(i=21; i<23; ++i)
+    printf("%-4s %6u notes queued, %6u received, %5u late, %5u dropped, max %4u mS\n", results[i].name,
+	   (unsigned)results[i].offered, (unsigned)results[i].packages, (unsigned)results[i].late,
+	   (unsigned)results[i].dropped, (unsigned)results[i].max_latency);
+
+  printf("\nStalled host detection (%d frames), host stalls for %d of %d frames:\n",
+	 USB_MIDI_TX_STALL_FRAMES, BENCH_STALL_FRAMES, BENCH_STALL_PERIOD);
+  {
+    const bench_result_t *r = &results[23];
+    u32 stalls = r->stalls ? r->stalls : 1;
+    printf("%-4s detected after %.1f frames, left after %.1f frames, %u retries (-2) %.1f ns, %u drops (-3) %.1f ns\n",
+	   r->name, (double)r->detect_frames / stalls, (double)r->recover_frames / stalls,
+	   (unsigned)r->retries, r->retries ? (double)r->retry_ns / r->retries : 0.0,
+	   (unsigned)r->drops, r->drops ? (double)r->drop_ns / r->drops : 0.0);
+  }
+
+  printf("\nLock-free Tx buffer, %d producers preempting each other on cable 0:\n", BENCH_PRODUCERS);
+  {
+    const bench_result_t *r = &results[24];
+    printf("%-4s main %u, adc %u, timer %u + %u clocks, %u preemptions, %u of %u exclusive stores retried\n",
+	   r->name, (unsigned)r->produced[0], (unsigned)r->produced[1], (unsigned)r->produced[2],
+	   (unsigned)r->produced[BENCH_PRODUCERS], (unsigned)r->bsp.preemptions,
+	   (unsigned)r->bsp.exclusive_fails, (unsigned)r->bsp.exclusive_loads);
+  }
+
+  printf("\nMIDI clock on a flooded cable, Rx buffer/callback (%.1f uS per bus slot):\n", 1000.0 / BENCH_SLOTS_PER_FRAME);
+  for(i=25; i<27; ++i) {
+    double n = results[i].offered ? (double)results[i].offered : 1.0;
+    printf("%-4s avg %8.1f uS, max %8.1f uS, %u clocks\n", results[i].name,
+	   results[i].latency_sum / n * 1000.0 / BENCH_SLOTS_PER_FRAME,
+	   results[i].max_latency * 1000.0 / BENCH_SLOTS_PER_FRAME,
+	   (unsigned)results[i].offered);
+  }
+
+  printf("\nTimer jobs, %d PPQN clock at 300 BPM with %d uS swing and %d random jobs:\n",
+	 BENCH_CLOCK_PPQN, BENCH_CLOCK_SWING_US, BENCH_TIMER_JOBS);
+  {
+    const bench_result_t *r = &results[27];
+    printf("%-4s %u ticks, %u MIDI clocks received, %u dropped, %u background callbacks, %u off time (max %u uS), %u compare interrupts in %u mS\n",
+	   r->name, (unsigned)r->offered, (unsigned)r->packages, (unsigned)r->dropped, (unsigned)r->wakeups,
+	   (unsigned)r->late, (unsigned)r->max_latency, (unsigned)r->bsp.compare_irqs, (unsigned)r->frames);
+  }
+
+  printf("\nCritical sections per package, all interrupts (IRQ_Disable) and up to the USB priority (IRQ_USB_Disable):\n");
+  for(i=0; i<sizeof(results)/sizeof(results[0]); ++i) {
+    const bench_result_t *r = &results[i];
+    double n = r->packages ? (double)r->packages : 1.0;
+    if( i != 0 && i != 4 && i != 9 && i != 10 && i != 24 )
+      continue;
+    printf("%-4s irq %6.3f calls %7.1f ns, usb %6.3f calls %7.1f ns\n", r->name,
+	   r->bsp.irq_disable_calls / n, r->bsp.irq_masked_ns / n,
+	   r->bsp.usb_disable_calls / n, r->bsp.usb_masked_ns / n);
+  }
+
+  printf("\nInterrupt handlers (USB, SysTick) and deferred work (PendSV, USB_MIDI_DEFERRED=%d):\n", USB_MIDI_DEFERRED);
+  for(i=0; i<sizeof(results)/sizeof(results[0]); ++i) {
+    const bench_result_t *r = &results[i];
+    if( i != 0 && i != 4 && i != 9 && i != 10 )
+      continue;
+    printf("%-4s %8u handlers avg %6.1f ns, 99%% %5u ns, 99.9%% %5u ns, %8u PendSV avg %6.1f ns\n", r->name,
+	   (unsigned)r->bsp.isr_calls, r->bsp.isr_calls ? (double)r->bsp.isr_ns / r->bsp.isr_calls : 0.0,
+	   (unsigned)SIM_BSP_IsrPercentile_nS(&r->bsp, 990), (unsigned)SIM_BSP_IsrPercentile_nS(&r->bsp, 999),
+	   (unsigned)r->bsp.pendsv_calls, r->bsp.pendsv_calls ? (double)r->bsp.pendsv_ns / r->bsp.pendsv_calls : 0.0);
+  }
+
+  {
+    const bench_result_t *dispatch[2];
+    const char *path[2];
+    u32 n = 0;
+
+    dispatch[n] = &results[0];
+#ifdef USB_OTG_HS_DEDICATED_EP1_ENABLED
+    path[n++] = "OTG_HS_EP1_IN";
+    dispatch[n] = &ep1_generic;
+#endif
+#ifdef USE_USB_OTG_HS
+    path[n++] = "OTG_HS";
+#else
+    path[n++] = "OTG_FS";
+#endif
+
+    printf("\nIN completion, interrupt entry -> DataIn stage (USB_MIDI_EP1_IN_Callback):\n");
+    for(i=0; i<n; ++i) {
+      const bench_result_t *r = dispatch[i];
+      printf("%-13s %8u completions (%u dedicated) avg %6.1f ns, %5.1f register accesses, handlers avg %6.1f ns\n", path[i],
+	     (unsigned)r->in_completions, (unsigned)r->in_dedicated,
+	     r->in_completions ? (double)r->in_dispatch_ns / r->in_completions : 0.0,
+	     r->in_completions ? (double)r->in_dispatch_regs / r->in_completions : 0.0,
+	     r->bsp.isr_calls ? (double)r->bsp.isr_ns / r->bsp.isr_calls : 0.0);
+    }
+  }
+
+#if USB_OTG_ISR_STATS
+  {
+    // GINTSTS bits, see DCD_ISR_Table[] in usb_dcd_int.c
+    static const char *source_names[USB_OTG_ISR_STATS_NUM] = {
+      [1] = "modemis", [3] = "sof", [4] = "rxflvl", [11] = "susp", [12] = "reset", [13] = "enum",
+      [18] = "iep", [19] = "oep", [20] = "iisoin", [21] = "iisoout", [31] = "wkup",
+      [USB_OTG_ISR_STATS_EP1OUT] = "ep1out", [USB_OTG_ISR_STATS_EP1IN] = "ep1in",
+    };
+
+    printf("\nOTG interrupt sources (USB_OTG_ISR_STATS), calls per package and avg ns per call:\n");
+    for(i=0; i<sizeof(results)/sizeof(results[0]); ++i) {
+      const bench_result_t *r = &results[i];
+      u32 src;
+      if( i != 0 && i != 4 && i != 9 && i != 10 )
+	continue;
+      printf("%-4s", r->name);
+      for(src=0; src<USB_OTG_ISR_STATS_NUM; ++src) {
+	const USB_OTG_ISR_STATS_TypeDef *s = &r->isr_sources[src];
+	if( s->calls )
+	  printf(" %s %.3f/%.1f", source_names[src] ? source_names[src] : "?",
+		 r->packages ? (double)s->calls / r->packages : 0.0, (double)s->cycles / s->calls);
+      }
+      printf("\n");
+    }
+  }
+#endif
+
+  if( seq_errors || failed ) {
+    fprintf(stderr, "FAILED: %u sequence errors\n", (unsigned)seq_errors);
+    return 1;
+  }
+
+  return 0;
+}
+
+//! \}
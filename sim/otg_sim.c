@@ -0,0 +1,971 @@
+//! \defgroup SIM_OTG
+//!
+//! Simulated STM32 OTG_FS/OTG_HS core for the host build
+//!
+//! The register window of the selected core is mapped at its real base
+//! address, so that the pointers computed by USB_OTG_SelectCore() can be
+//! used unchanged. All accesses done through USB_OTG_READ_REG32() and
+//! USB_OTG_WRITE_REG32() are routed to SIM_OTG_ReadReg()/SIM_OTG_WriteReg(),
+//! which implement the side effects of the registers used by the device
+//! driver (W1C interrupt flags, Tx/Rx FIFOs, status queue, endpoint enable).
+//!
+//! The bus side is driven by the host functions at the end of this file.
+//! If the internal DMA is enabled (GAHBCFG.dmaenable, OTG_HS build) the
+//! packets are copied from/to the memory addresses in DIEPDMA/DOEPDMA
+//! instead of the FIFOs, and OUT transfers and SETUP packets are completed
+//! without Rx status entries, as done by the DMA of the real core.
+//!
+//! Interrupts are delivered by calling USBD_OTG_ISR_Handler() directly
+//! whenever the OTG interrupt is pending, enabled in the NVIC model and not
+//! masked via IRQ_Disable() or IRQ_USB_Disable(). The EP1 interrupts which
+//! are enabled in DEACHMSK (USB_OTG_HS_DEDICATED_EP1_ENABLED) are delivered
+//! to USBD_OTG_EP1OUT_ISR_Handler()/USBD_OTG_EP1IN_ISR_Handler() instead,
+//! in the order of the NVIC (EP1_OUT, EP1_IN, OTG_HS at the same priority).
+//!
+//! \{
+
+/////////////////////////////////////////////////////////////////////////////
+// Include files
+/////////////////////////////////////////////////////////////////////////////
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <usb_core.h>
+#include <usb_dcd_int.h>
+
+#include "otg_sim.h"
+#include "sim_bsp.h"
+
+
+// imported from usb.c
+extern USB_OTG_CORE_HANDLE  USB_OTG_dev;
+
+#ifdef USB_OTG_HS_DEDICATED_EP1_ENABLED
+// imported from usb_dcd_int.c (core/stm32fxxx_it.c on the target)
+extern uint32_t USBD_OTG_EP1IN_ISR_Handler (USB_OTG_CORE_HANDLE *pdev);
+extern uint32_t USBD_OTG_EP1OUT_ISR_Handler (USB_OTG_CORE_HANDLE *pdev);
+#endif
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Local definitions
+/////////////////////////////////////////////////////////////////////////////
+
+#define OFS_GREGS(reg)  (USB_OTG_CORE_GLOBAL_REGS_OFFSET + offsetof(USB_OTG_GREGS, reg))
+#define OFS_DREGS(reg)  (USB_OTG_DEV_GLOBAL_REG_OFFSET + offsetof(USB_OTG_DREGS, reg))
+#define OFS_INEP(ep, reg)  (USB_OTG_DEV_IN_EP_REG_OFFSET + (ep)*USB_OTG_EP_REG_OFFSET + offsetof(USB_OTG_INEPREGS, reg))
+#define OFS_OUTEP(ep, reg) (USB_OTG_DEV_OUT_EP_REG_OFFSET + (ep)*USB_OTG_EP_REG_OFFSET + offsetof(USB_OTG_OUTEPREGS, reg))
+
+#define SIM_OTG_TXFIFO_WORDS   1024 // per IN endpoint
+#define SIM_OTG_RXFIFO_WORDS   1024
+#define SIM_OTG_RXSTS_ENTRIES  256
+
+// ISR re-entries allowed per dispatch before an interrupt storm is reported
+#define SIM_OTG_MAX_ISR_LOOPS  1000
+
+#define REG(ofs) (*(volatile uint32_t *)(core + (ofs)))
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Local Variables
+/////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+  uint32_t fifo[SIM_OTG_TXFIFO_WORDS];
+  uint16_t fifo_head;
+  uint16_t fifo_count;
+  uint32_t xfer_rem;   // bytes which still have to be sent
+  uint32_t pkt_rem;    // packets which still have to be sent
+  uint8_t  active;
+} sim_in_ep_t;
+
+typedef struct {
+  uint32_t xfer_rem;
+  uint32_t pkt_rem;
+  uint8_t  active;
+} sim_out_ep_t;
+
+static uint8_t *core;
+static uint32_t core_base;
+static uint8_t windows_mapped;
+
+static sim_in_ep_t in_ep[SIM_OTG_NUM_EPS];
+static sim_out_ep_t out_ep[SIM_OTG_NUM_EPS];
+
+// Rx FIFO: status queue and data words
+static uint32_t rx_sts[SIM_OTG_RXSTS_ENTRIES];
+static uint16_t rx_sts_head;
+static uint16_t rx_sts_count;
+static uint32_t rx_data[SIM_OTG_RXFIFO_WORDS];
+static uint16_t rx_data_head;
+static uint16_t rx_data_count;
+static uint16_t rx_words_unread; // data words of the last popped status entry
+
+static uint8_t nvic_enabled; // SIM_OTG_IRQ_* vectors
+static uint8_t in_isr;
+
+// state at the entry of the last interrupt handler
+static uint8_t isr_vector;
+static uint64_t isr_enter_ns;
+static uint32_t isr_enter_regs;
+
+// interrupt latency in bus transactions: an interrupt raised by a host token
+// becomes visible to the CPU only after irq_latency further tokens
+static uint8_t irq_latency;
+static uint8_t irq_hold;
+static uint32_t frame_number;
+
+sim_otg_stats_t sim_otg_stats;
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Register model helpers
+/////////////////////////////////////////////////////////////////////////////
+
+static uint32_t SIM_OTG_InMaxPacket(uint8_t ep)
+{
+  USB_OTG_DEPCTL_TypeDef depctl;
+  depctl.d32 = REG(OFS_INEP(ep, DIEPCTL));
+
+  // EP0 uses an encoded MPS field
+  return ep ? depctl.b.mps : (64 >> (depctl.b.mps & 3));
+}
+
+static uint32_t SIM_OTG_OutMaxPacket(uint8_t ep)
+{
+  USB_OTG_DEPCTL_TypeDef depctl;
+  depctl.d32 = REG(OFS_OUTEP(ep, DOEPCTL));
+
+  return ep ? depctl.b.mps : (64 >> (depctl.b.mps & 3));
+}
+
+static uint8_t SIM_OTG_DmaEnabled(void)
+{
+  return (REG(OFS_GREGS(GAHBCFG)) >> 5) & 1; // dmaenable
+}
+
+// DMA mode: the core counts the transfer size registers down, the driver reads them on completion
+static void SIM_OTG_OutUpdateSize(uint8_t ep)
+{
+  uint32_t *tsiz = (uint32_t *)(core + OFS_OUTEP(ep, DOEPTSIZ));
+
+  if( ep == 0 ) {
+    USB_OTG_DEP0XFRSIZ_TypeDef deptsiz;
+    deptsiz.d32 = *tsiz;
+    deptsiz.b.xfersize = out_ep[ep].xfer_rem;
+    deptsiz.b.pktcnt = out_ep[ep].pkt_rem;
+    *tsiz = deptsiz.d32;
+  } else {
+    USB_OTG_DEPXFRSIZ_TypeDef deptsiz;
+    deptsiz.d32 = *tsiz;
+    deptsiz.b.xfersize = out_ep[ep].xfer_rem;
+    deptsiz.b.pktcnt = out_ep[ep].pkt_rem;
+    *tsiz = deptsiz.d32;
+  }
+}
+
+// the core counts the packet count of an IN transfer down when a packet has been sent
+// (the driver can follow the progress of a multi-packet transfer)
+static void SIM_OTG_InUpdatePktCnt(uint8_t ep)
+{
+  uint32_t *tsiz = (uint32_t *)(core + OFS_INEP(ep, DIEPTSIZ));
+
+  if( ep == 0 ) {
+    USB_OTG_DEP0XFRSIZ_TypeDef deptsiz;
+    deptsiz.d32 = *tsiz;
+    deptsiz.b.pktcnt = in_ep[ep].pkt_rem;
+    *tsiz = deptsiz.d32;
+  } else {
+    USB_OTG_DEPXFRSIZ_TypeDef deptsiz;
+    deptsiz.d32 = *tsiz;
+    deptsiz.b.pktcnt = in_ep[ep].pkt_rem;
+    *tsiz = deptsiz.d32;
+  }
+}
+
+static uint32_t SIM_OTG_TxFifoDepth(uint8_t ep)
+{
+  uint32_t depth = ep ? (REG(OFS_GREGS(DIEPTXF[ep-1])) >> 16) : (REG(OFS_GREGS(DIEPTXF0_HNPTXFSIZ)) >> 16);
+  return (depth > SIM_OTG_TXFIFO_WORDS) ? SIM_OTG_TXFIFO_WORDS : depth;
+}
+
+static uint32_t SIM_OTG_RxFifoFree(void)
+{
+  uint32_t depth = REG(OFS_GREGS(GRXFSIZ)) & 0xffff;
+  uint32_t used = rx_data_count + rx_sts_count;
+
+  if( depth > SIM_OTG_RXFIFO_WORDS )
+    depth = SIM_OTG_RXFIFO_WORDS;
+  return (used >= depth) ? 0 : (depth - used);
+}
+
+static void SIM_OTG_FlushTx(uint8_t ep)
+{
+  in_ep[ep].fifo_head = in_ep[ep].fifo_count = 0;
+}
+
+static void SIM_OTG_FlushRx(void)
+{
+  rx_sts_head = rx_sts_count = 0;
+  rx_data_head = rx_data_count = 0;
+  rx_words_unread = 0;
+}
+
+static void SIM_OTG_PushRxStatus(uint8_t ep, uint8_t pktsts, uint16_t bcnt, const uint8_t *data)
+{
+  USB_OTG_DRXSTS_TypeDef sts;
+  uint32_t words = (bcnt + 3) / 4;
+  uint32_t i;
+
+  sts.d32 = 0;
+  sts.b.epnum = ep;
+  sts.b.bcnt = bcnt;
+  sts.b.pktsts = pktsts;
+  rx_sts[(rx_sts_head + rx_sts_count++) % SIM_OTG_RXSTS_ENTRIES] = sts.d32;
+
+  for(i=0; i<words; ++i) {
+    uint32_t word = 0;
+    uint32_t n = bcnt - 4*i;
+    memcpy(&word, data + 4*i, (n > 4) ? 4 : n);
+    rx_data[(rx_data_head + rx_data_count++) % SIM_OTG_RXFIFO_WORDS] = word;
+  }
+}
+
+static uint32_t SIM_OTG_PopRxStatus(void)
+{
+  USB_OTG_DRXSTS_TypeDef sts;
+
+  if( !rx_sts_count ) {
+    ++sim_otg_stats.errors; // status popped from empty queue
+    return 0;
+  }
+
+  // data of the previous entry must have been read completely
+  if( rx_words_unread ) {
+    ++sim_otg_stats.errors;
+    rx_data_head = (rx_data_head + rx_words_unread) % SIM_OTG_RXFIFO_WORDS;
+    rx_data_count -= rx_words_unread;
+    rx_words_unread = 0;
+  }
+
+  sts.d32 = rx_sts[rx_sts_head];
+  rx_sts_head = (rx_sts_head + 1) % SIM_OTG_RXSTS_ENTRIES;
+  --rx_sts_count;
+
+  switch( sts.b.pktsts ) {
+  case STS_DATA_UPDT:
+  case STS_SETUP_UPDT:
+    rx_words_unread = (sts.b.bcnt + 3) / 4;
+    break;
+  case STS_XFER_COMP:
+    REG(OFS_OUTEP(sts.b.epnum, DOEPINT)) |= (1 << 0); // xfercompl
+    break;
+  case STS_SETUP_COMP:
+    REG(OFS_OUTEP(0, DOEPINT)) |= (1 << 3); // setup
+    break;
+  }
+
+  return sts.d32;
+}
+
+static uint32_t SIM_OTG_PopRxData(void)
+{
+  uint32_t word;
+
+  if( !rx_words_unread ) {
+    ++sim_otg_stats.errors; // read beyond the packet
+    return 0;
+  }
+
+  word = rx_data[rx_data_head];
+  rx_data_head = (rx_data_head + 1) % SIM_OTG_RXFIFO_WORDS;
+  --rx_data_count;
+  --rx_words_unread;
+  ++sim_otg_stats.fifo_words_out;
+
+  return word;
+}
+
+static uint32_t SIM_OTG_InEpIntr(uint8_t ep)
+{
+  uint32_t v = REG(OFS_INEP(ep, DIEPINT));
+
+  // TXFE is a level: set while the Tx FIFO of an enabled endpoint is empty
+  if( in_ep[ep].active && !in_ep[ep].fifo_count )
+    v |= (1 << 7);
+
+  return v;
+}
+
+static uint32_t SIM_OTG_AllEpIntr(void)
+{
+  uint32_t diepmsk = REG(OFS_DREGS(DIEPMSK));
+  uint32_t doepmsk = REG(OFS_DREGS(DOEPMSK));
+  uint32_t empmsk = REG(OFS_DREGS(DIEPEMPMSK));
+  uint32_t v = 0;
+  uint8_t ep;
+
+  for(ep=0; ep<SIM_OTG_NUM_EPS; ++ep) {
+    if( SIM_OTG_InEpIntr(ep) & (diepmsk | (((empmsk >> ep) & 1) << 7)) )
+      v |= (1 << ep);
+    if( REG(OFS_OUTEP(ep, DOEPINT)) & doepmsk )
+      v |= (1 << (16+ep));
+  }
+
+  return v;
+}
+
+// EP1 interrupts which are routed to the dedicated vectors (DEACHINT layout)
+static uint32_t SIM_OTG_Ep1Intr(void)
+{
+  uint32_t empmsk = REG(OFS_DREGS(DIEPEMPMSK));
+  uint32_t v = 0;
+
+  if( SIM_OTG_InEpIntr(1) & (REG(OFS_DREGS(DINEP1MSK)) | (((empmsk >> 1) & 1) << 7)) )
+    v |= (1 << 1);
+  if( REG(OFS_OUTEP(1, DOEPINT)) & REG(OFS_DREGS(DOUTEP1MSK)) )
+    v |= (1 << 17);
+
+  return v & REG(OFS_DREGS(DEACHMSK));
+}
+
+static uint32_t SIM_OTG_CoreIntr(void)
+{
+  USB_OTG_GINTSTS_TypeDef gintsts;
+  uint32_t daint = SIM_OTG_AllEpIntr() & REG(OFS_DREGS(DAINTMSK));
+
+  gintsts.d32 = REG(OFS_GREGS(GINTSTS));
+  gintsts.b.curmode = 0; // device mode
+  gintsts.b.rxstsqlvl = rx_sts_count ? 1 : 0;
+  gintsts.b.inepint = (daint & 0xffff) ? 1 : 0;
+  gintsts.b.outepintr = (daint >> 16) ? 1 : 0;
+
+  return gintsts.d32;
+}
+
+// returns the pending vectors which are enabled in the NVIC model
+static uint8_t SIM_OTG_IrqPending(void)
+{
+  uint8_t pending = 0;
+  uint32_t ep1;
+
+  if( !(REG(OFS_GREGS(GAHBCFG)) & 1) ) // glblintrmsk
+    return 0;
+
+  if( SIM_OTG_CoreIntr() & REG(OFS_GREGS(GINTMSK)) )
+    pending |= SIM_OTG_IRQ_OTG;
+  ep1 = SIM_OTG_Ep1Intr();
+  if( ep1 & (1 << 17) )
+    pending |= SIM_OTG_IRQ_EP1_OUT;
+  if( ep1 & (1 << 1) )
+    pending |= SIM_OTG_IRQ_EP1_IN;
+
+  return pending & nvic_enabled;
+}
+
+static void SIM_OTG_InStart(uint8_t ep)
+{
+  uint32_t tsiz = REG(OFS_INEP(ep, DIEPTSIZ));
+
+  if( ep == 0 ) {
+    USB_OTG_DEP0XFRSIZ_TypeDef deptsiz;
+    deptsiz.d32 = tsiz;
+    in_ep[ep].xfer_rem = deptsiz.b.xfersize;
+    in_ep[ep].pkt_rem = deptsiz.b.pktcnt;
+  } else {
+    USB_OTG_DEPXFRSIZ_TypeDef deptsiz;
+    deptsiz.d32 = tsiz;
+    in_ep[ep].xfer_rem = deptsiz.b.xfersize;
+    in_ep[ep].pkt_rem = deptsiz.b.pktcnt;
+  }
+  in_ep[ep].active = in_ep[ep].pkt_rem ? 1 : 0;
+}
+
+static void SIM_OTG_OutStart(uint8_t ep)
+{
+  uint32_t tsiz = REG(OFS_OUTEP(ep, DOEPTSIZ));
+
+  if( ep == 0 ) {
+    USB_OTG_DEP0XFRSIZ_TypeDef deptsiz;
+    deptsiz.d32 = tsiz;
+    out_ep[ep].xfer_rem = deptsiz.b.xfersize;
+    out_ep[ep].pkt_rem = deptsiz.b.pktcnt ? deptsiz.b.pktcnt : 1;
+  } else {
+    USB_OTG_DEPXFRSIZ_TypeDef deptsiz;
+    deptsiz.d32 = tsiz;
+    out_ep[ep].xfer_rem = deptsiz.b.xfersize;
+    out_ep[ep].pkt_rem = deptsiz.b.pktcnt;
+  }
+  out_ep[ep].active = out_ep[ep].pkt_rem ? 1 : 0;
+}
+
+static void SIM_OTG_WriteEpCtl(volatile uint32_t *reg, uint8_t ep, uint8_t is_in, uint32_t value)
+{
+  USB_OTG_DEPCTL_TypeDef cur, depctl;
+
+  cur.d32 = *reg;
+  depctl.d32 = value;
+
+  if( depctl.b.snak )
+    depctl.b.naksts = 1;
+  else if( depctl.b.cnak )
+    depctl.b.naksts = 0;
+  else
+    depctl.b.naksts = cur.b.naksts;
+
+  if( depctl.b.epdis && cur.b.epena ) {
+    depctl.b.epena = 0;
+    if( is_in ) {
+      in_ep[ep].active = 0;
+      REG(OFS_INEP(ep, DIEPINT)) |= (1 << 1); // epdisabled
+    } else {
+      out_ep[ep].active = 0;
+      REG(OFS_OUTEP(ep, DOEPINT)) |= (1 << 1);
+    }
+  }
+
+  // write-only bits
+  depctl.b.cnak = depctl.b.snak = 0;
+  depctl.b.setd0pid = depctl.b.setd1pid = 0;
+  depctl.b.epdis = 0;
+  *reg = depctl.d32;
+
+  if( depctl.b.epena ) {
+    if( is_in )
+      SIM_OTG_InStart(ep);
+    else
+      SIM_OTG_OutStart(ep);
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! Register read access of the USB OTG driver
+/////////////////////////////////////////////////////////////////////////////
+uint32_t SIM_OTG_ReadReg(volatile uint32_t *reg)
+{
+  uintptr_t addr = (uintptr_t)reg;
+  uint32_t ofs;
+
+  // everything outside of the simulated core is plain memory
+  if( !core || addr < (uintptr_t)core || addr >= (uintptr_t)core + SIM_OTG_WINDOW_SIZE )
+    return *reg;
+
+  ++sim_otg_stats.reg_reads;
+  ofs = addr - (uintptr_t)core;
+
+  if( ofs >= USB_OTG_DATA_FIFO_OFFSET )
+    return SIM_OTG_PopRxData();
+
+  if( ofs >= USB_OTG_DEV_IN_EP_REG_OFFSET && ofs < USB_OTG_DEV_OUT_EP_REG_OFFSET ) {
+    uint8_t ep = (ofs - USB_OTG_DEV_IN_EP_REG_OFFSET) / USB_OTG_EP_REG_OFFSET;
+    uint32_t reg_ofs = (ofs - USB_OTG_DEV_IN_EP_REG_OFFSET) % USB_OTG_EP_REG_OFFSET;
+
+    if( ep < SIM_OTG_NUM_EPS ) {
+      if( reg_ofs == offsetof(USB_OTG_INEPREGS, DIEPINT) )
+	return SIM_OTG_InEpIntr(ep);
+      if( reg_ofs == offsetof(USB_OTG_INEPREGS, DTXFSTS) )
+	return SIM_OTG_TxFifoDepth(ep) - in_ep[ep].fifo_count;
+    }
+    return *reg;
+  }
+
+  switch( ofs ) {
+  case OFS_GREGS(GINTSTS):
+    return SIM_OTG_CoreIntr();
+  case OFS_GREGS(GRSTCTL):
+    return *reg | (1UL << 31); // AHB always idle
+  case OFS_GREGS(GRXSTSR):
+    return rx_sts_count ? rx_sts[rx_sts_head] : 0;
+  case OFS_GREGS(GRXSTSP):
+    return SIM_OTG_PopRxStatus();
+  case OFS_DREGS(DAINT):
+    return SIM_OTG_AllEpIntr();
+  case OFS_DREGS(DEACHINT):
+    return SIM_OTG_Ep1Intr();
+  }
+
+  return *reg;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! Register write access of the USB OTG driver
+/////////////////////////////////////////////////////////////////////////////
+void SIM_OTG_WriteReg(volatile uint32_t *reg, uint32_t value)
+{
+  uintptr_t addr = (uintptr_t)reg;
+  uint32_t ofs;
+
+  if( !core || addr < (uintptr_t)core || addr >= (uintptr_t)core + SIM_OTG_WINDOW_SIZE ) {
+    *reg = value;
+    return;
+  }
+
+  ++sim_otg_stats.reg_writes;
+  ofs = addr - (uintptr_t)core;
+
+  if( ofs >= USB_OTG_DATA_FIFO_OFFSET ) {
+    uint8_t ep = (ofs - USB_OTG_DATA_FIFO_OFFSET) / USB_OTG_DATA_FIFO_SIZE;
+    sim_in_ep_t *e;
+
+    if( ep >= SIM_OTG_NUM_EPS ) {
+      ++sim_otg_stats.errors;
+      return;
+    }
+
+    e = &in_ep[ep];
+    if( e->fifo_count >= SIM_OTG_TxFifoDepth(ep) ) {
+      ++sim_otg_stats.errors; // Tx FIFO overrun
+      return;
+    }
+    e->fifo[(e->fifo_head + e->fifo_count++) % SIM_OTG_TXFIFO_WORDS] = value;
+    ++sim_otg_stats.fifo_words_in;
+  } else if( ofs >= USB_OTG_DEV_IN_EP_REG_OFFSET && ofs < USB_OTG_DEV_OUT_EP_REG_OFFSET + SIM_OTG_NUM_EPS*USB_OTG_EP_REG_OFFSET ) {
+    uint8_t is_in = ofs < USB_OTG_DEV_OUT_EP_REG_OFFSET;
+    uint32_t base = is_in ? USB_OTG_DEV_IN_EP_REG_OFFSET : USB_OTG_DEV_OUT_EP_REG_OFFSET;
+    uint8_t ep = (ofs - base) / USB_OTG_EP_REG_OFFSET;
+    uint32_t reg_ofs = (ofs - base) % USB_OTG_EP_REG_OFFSET;
+
+    if( ep >= SIM_OTG_NUM_EPS ) {
+      *reg = value;
+    } else if( reg_ofs == 0x00 ) { // DIEPCTL/DOEPCTL
+      SIM_OTG_WriteEpCtl(reg, ep, is_in, value);
+    } else if( reg_ofs == 0x08 ) { // DIEPINT/DOEPINT
+      *reg &= ~value;
+    } else if( is_in && reg_ofs == offsetof(USB_OTG_INEPREGS, DTXFSTS) ) {
+      // read only
+    } else {
+      *reg = value;
+    }
+  } else {
+    switch( ofs ) {
+    case OFS_GREGS(GINTSTS):
+      *reg &= ~value;
+      break;
+
+    case OFS_GREGS(GRSTCTL): {
+      USB_OTG_GRSTCTL_TypeDef greset;
+      greset.d32 = value;
+      if( greset.b.rxfflsh )
+	SIM_OTG_FlushRx();
+      if( greset.b.txfflsh ) {
+	uint8_t ep;
+	for(ep=0; ep<SIM_OTG_NUM_EPS; ++ep)
+	  if( greset.b.txfnum == 0x10 || greset.b.txfnum == ep )
+	    SIM_OTG_FlushTx(ep);
+      }
+      *reg = 0; // all reset/flush bits are self-clearing
+    } break;
+
+    case OFS_GREGS(GRXSTSR):
+    case OFS_GREGS(GRXSTSP):
+    case OFS_DREGS(DAINT):
+    case OFS_DREGS(DEACHINT):
+    case OFS_DREGS(DSTS):
+      break; // read only
+
+    default:
+      *reg = value;
+    }
+  }
+
+  // a register access could have raised an interrupt (e.g. TXFE after EP enable)
+  SIM_OTG_Dispatch();
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! Enables/disables an OTG interrupt vector (SIM_OTG_IRQ_*) in the NVIC model
+/////////////////////////////////////////////////////////////////////////////
+void SIM_OTG_IRQ_Enable(uint8_t vector, uint8_t enable)
+{
+  if( enable ) {
+    nvic_enabled |= vector;
+    SIM_OTG_Dispatch();
+  } else {
+    nvic_enabled &= ~vector;
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! Executes the OTG interrupt handler as long as an interrupt is pending.
+//! Called whenever the interrupt state could have changed, and when
+//! interrupts are enabled again after IRQ_Disable()
+/////////////////////////////////////////////////////////////////////////////
+void SIM_OTG_Dispatch(void)
+{
+  uint32_t loops = 0;
+  uint8_t pending;
+
+  if( !nvic_enabled || in_isr || irq_hold || SIM_BSP_IRQ_Masked() )
+    return;
+
+  in_isr = 1;
+  while( (pending=SIM_OTG_IrqPending()) ) {
+    uint64_t enter_ns;
+
+    if( ++loops > SIM_OTG_MAX_ISR_LOOPS ) {
+      ++sim_otg_stats.errors; // interrupt storm
+      break;
+    }
+    ++sim_otg_stats.isr_calls;
+    enter_ns = SIM_BSP_ExceptionEnter();
+
+    // same priority: the vector with the lowest number is taken first
+    isr_enter_ns = enter_ns;
+    isr_enter_regs = sim_otg_stats.reg_reads + sim_otg_stats.reg_writes;
+#ifdef USB_OTG_HS_DEDICATED_EP1_ENABLED
+    if( pending & SIM_OTG_IRQ_EP1_OUT ) {
+      isr_vector = SIM_OTG_IRQ_EP1_OUT;
+      ++sim_otg_stats.ep1_isr_calls;
+      USBD_OTG_EP1OUT_ISR_Handler(&USB_OTG_dev);
+    } else if( pending & SIM_OTG_IRQ_EP1_IN ) {
+      isr_vector = SIM_OTG_IRQ_EP1_IN;
+      ++sim_otg_stats.ep1_isr_calls;
+      USBD_OTG_EP1IN_ISR_Handler(&USB_OTG_dev);
+    } else
+#endif
+    {
+      isr_vector = SIM_OTG_IRQ_OTG;
+      USBD_OTG_ISR_Handler(&USB_OTG_dev);
+    }
+    in_isr = 0; // PendSV can be tail-chained, the OTG interrupt preempts it
+    SIM_BSP_ExceptionExit(enter_ns);
+    in_isr = 1;
+  }
+  in_isr = 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//! Returns the vector (SIM_OTG_IRQ_*) of the interrupt handler which is
+//! executed currently, and the host time and the number of register accesses
+//! at its entry (e.g. to measure the dispatch path to a class callback)
+/////////////////////////////////////////////////////////////////////////////
+uint8_t SIM_OTG_IsrEntry(uint64_t *enter_ns, uint32_t *enter_regs)
+{
+  *enter_ns = isr_enter_ns;
+  *enter_regs = isr_enter_regs;
+  return isr_vector;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//! Replaces the DWT cycle counter of the target for the interrupt source
+//! statistics of usb_dcd_int.c (USB_OTG_ISR_STATS): counts host nS
+/////////////////////////////////////////////////////////////////////////////
+uint32_t SIM_OTG_Cycles(void)
+{
+  return (uint32_t)SIM_BSP_HostTime_nS();
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! Maps the register windows and puts the selected core into reset state
+//! \param[in] core_base_addr USB_OTG_FS_BASE_ADDR or USB_OTG_HS_BASE_ADDR
+//! \return < 0 if the register window can't be mapped
+/////////////////////////////////////////////////////////////////////////////
+int32_t SIM_OTG_Init(uint32_t core_base_addr)
+{
+  if( !windows_mapped ) {
+    // map both cores, the FS and HS builds of usb.c use different windows
+    const uintptr_t bases[2] = { USB_OTG_FS_BASE_ADDR, USB_OTG_HS_BASE_ADDR };
+    int i;
+
+    for(i=0; i<2; ++i) {
+      void *p = mmap((void *)bases[i], SIM_OTG_WINDOW_SIZE, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+      if( p == MAP_FAILED || p != (void *)bases[i] )
+	return -1;
+    }
+    windows_mapped = 1;
+  }
+
+  core_base = core_base_addr;
+  core = (uint8_t *)(uintptr_t)core_base;
+  memset(core, 0, SIM_OTG_WINDOW_SIZE);
+
+  memset(in_ep, 0, sizeof(in_ep));
+  memset(out_ep, 0, sizeof(out_ep));
+  SIM_OTG_FlushRx();
+  nvic_enabled = 0;
+  in_isr = 0;
+  frame_number = 0;
+  memset(&sim_otg_stats, 0, sizeof(sim_otg_stats));
+
+  REG(OFS_GREGS(CID)) = 0x00001200;
+
+  return 0;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! Sets the number of bus transactions the host issues before the CPU
+//! services an interrupt raised by a transaction (0: immediately)
+/////////////////////////////////////////////////////////////////////////////
+void SIM_OTG_SetIrqLatency(uint8_t tokens)
+{
+  irq_latency = tokens;
+  irq_hold = 0;
+  SIM_OTG_Dispatch();
+}
+
+// called at the end of each host token
+static void SIM_OTG_TokenDone(void)
+{
+  if( irq_hold ) {
+    if( --irq_hold )
+      return;
+  } else if( irq_latency && SIM_OTG_IrqPending() ) {
+    irq_hold = irq_latency;
+    return;
+  }
+
+  SIM_OTG_Dispatch();
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! Host side: USB reset followed by speed enumeration
+/////////////////////////////////////////////////////////////////////////////
+void SIM_OTG_BusReset(uint8_t high_speed)
+{
+  USB_OTG_DSTS_TypeDef dsts;
+  uint8_t ep;
+
+  for(ep=0; ep<SIM_OTG_NUM_EPS; ++ep) {
+    in_ep[ep].active = 0;
+    out_ep[ep].active = 0;
+    SIM_OTG_FlushTx(ep);
+  }
+  SIM_OTG_FlushRx();
+
+  REG(OFS_GREGS(GINTSTS)) |= (1 << 12); // usbreset
+  SIM_OTG_Dispatch();
+
+  dsts.d32 = REG(OFS_DREGS(DSTS));
+  dsts.b.enumspd = high_speed ? DSTS_ENUMSPD_HS_PHY_30MHZ_OR_60MHZ : DSTS_ENUMSPD_FS_PHY_48MHZ;
+  REG(OFS_DREGS(DSTS)) = dsts.d32;
+  REG(OFS_GREGS(GINTSTS)) |= (1 << 13); // enumdone
+  SIM_OTG_Dispatch();
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! Host side: start of a new (micro)frame
+/////////////////////////////////////////////////////////////////////////////
+void SIM_OTG_StartOfFrame(void)
+{
+  USB_OTG_DSTS_TypeDef dsts;
+
+  ++frame_number;
+  dsts.d32 = REG(OFS_DREGS(DSTS));
+  dsts.b.soffn = frame_number & 0x3fff;
+  REG(OFS_DREGS(DSTS)) = dsts.d32;
+
+  REG(OFS_GREGS(GINTSTS)) |= (1 << 3); // sofintr
+  SIM_OTG_TokenDone();
+}
+
+uint32_t SIM_OTG_FrameNumber(void)
+{
+  return frame_number;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! Host side: one IN token
+//! \param[in] ep endpoint number
+//! \param[out] buffer receives the packet
+//! \param[in] max_len size of buffer
+//! \return -1 if the token was NAKed, otherwise the packet size
+/////////////////////////////////////////////////////////////////////////////
+int32_t SIM_OTG_HostIn(uint8_t ep, uint8_t *buffer, uint16_t max_len)
+{
+  sim_in_ep_t *e = &in_ep[ep];
+  uint32_t len, words, i;
+
+  if( !e->active ) {
+    ++sim_otg_stats.in_naks;
+    SIM_OTG_TokenDone();
+    return -1;
+  }
+
+  len = SIM_OTG_InMaxPacket(ep);
+  if( len > e->xfer_rem )
+    len = e->xfer_rem;
+  words = (len + 3) / 4;
+
+  if( SIM_OTG_DmaEnabled() ) {
+    // the DMA fetches the packet from memory
+    const uint8_t *src = (const uint8_t *)(uintptr_t)REG(OFS_INEP(ep, DIEPDMA));
+
+    if( len > max_len ) {
+      ++sim_otg_stats.errors; // babble
+      len = max_len;
+    }
+    if( buffer && len )
+      memcpy(buffer, src, len);
+    REG(OFS_INEP(ep, DIEPDMA)) += len;
+    sim_otg_stats.dma_bytes += len;
+  } else {
+    // packet not completely in the FIFO yet
+    if( e->fifo_count < words ) {
+      ++sim_otg_stats.in_naks;
+      SIM_OTG_TokenDone();
+      return -1;
+    }
+
+    if( len > max_len ) {
+      ++sim_otg_stats.errors; // babble
+      len = max_len;
+    }
+
+    for(i=0; i<words; ++i) {
+      uint32_t word = e->fifo[e->fifo_head];
+      uint32_t n = len - 4*i;
+
+      e->fifo_head = (e->fifo_head + 1) % SIM_OTG_TXFIFO_WORDS;
+      --e->fifo_count;
+      if( buffer && 4*i < len )
+	memcpy(buffer + 4*i, &word, (n > 4) ? 4 : n);
+    }
+  }
+
+  e->xfer_rem -= len;
+  --e->pkt_rem;
+  SIM_OTG_InUpdatePktCnt(ep);
+  if( e->pkt_rem == 0 ) {
+    e->active = 0;
+    REG(OFS_INEP(ep, DIEPCTL)) &= ~(1UL << 31); // epena
+    REG(OFS_INEP(ep, DIEPINT)) |= (1 << 0); // xfercompl
+  }
+  ++sim_otg_stats.in_packets;
+
+  SIM_OTG_TokenDone();
+
+  return len;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! Host side: one OUT token with data packet
+//! \param[in] ep endpoint number
+//! \param[in] buffer packet data
+//! \param[in] len packet size (<= max packet size)
+//! \return -1 if the packet was NAKed, otherwise len
+/////////////////////////////////////////////////////////////////////////////
+int32_t SIM_OTG_HostOut(uint8_t ep, const uint8_t *buffer, uint16_t len)
+{
+  sim_out_ep_t *e = &out_ep[ep];
+  uint8_t dma = SIM_OTG_DmaEnabled();
+  uint32_t mps;
+
+  // (the DMA drains the Rx FIFO while the packet is received)
+  if( !e->active || (!dma && SIM_OTG_RxFifoFree() < ((len + 3) / 4 + 2U)) ) {
+    ++sim_otg_stats.out_naks;
+    SIM_OTG_TokenDone();
+    return -1;
+  }
+
+  mps = SIM_OTG_OutMaxPacket(ep);
+  if( len > mps ) {
+    ++sim_otg_stats.errors;
+    return -1;
+  }
+
+  if( dma ) {
+    uint8_t *dst = (uint8_t *)(uintptr_t)REG(OFS_OUTEP(ep, DOEPDMA));
+    if( len )
+      memcpy(dst, buffer, len);
+    REG(OFS_OUTEP(ep, DOEPDMA)) += len;
+    sim_otg_stats.dma_bytes += len;
+  } else {
+    SIM_OTG_PushRxStatus(ep, STS_DATA_UPDT, len, buffer);
+  }
+  e->xfer_rem = (len > e->xfer_rem) ? 0 : (e->xfer_rem - len);
+  if( --e->pkt_rem == 0 || len < mps ) {
+    e->active = 0;
+    REG(OFS_OUTEP(ep, DOEPCTL)) &= ~(1UL << 31); // epena
+    if( dma ) {
+      SIM_OTG_OutUpdateSize(ep);
+      REG(OFS_OUTEP(ep, DOEPINT)) |= (1 << 0); // xfercompl
+    } else {
+      SIM_OTG_PushRxStatus(ep, STS_XFER_COMP, 0, NULL);
+    }
+  } else if( dma ) {
+    SIM_OTG_OutUpdateSize(ep);
+  }
+  ++sim_otg_stats.out_packets;
+
+  SIM_OTG_TokenDone();
+
+  return len;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! Host side: complete control transfer on EP0
+//! \param[in] setup 8 byte SETUP packet
+//! \param[in,out] data data stage buffer
+//! \param[in] len size of the data buffer
+//! \return < 0 on errors, otherwise the number of data stage bytes
+/////////////////////////////////////////////////////////////////////////////
+int32_t SIM_OTG_ControlTransfer(const uint8_t *setup, uint8_t *data, uint16_t len)
+{
+  uint16_t w_length = setup[6] | (setup[7] << 8);
+  uint8_t dir_in = setup[0] & 0x80;
+  uint32_t count = 0;
+  int32_t tries;
+
+  if( w_length > len )
+    w_length = len;
+
+  if( SIM_OTG_DmaEnabled() ) {
+    // the DMA writes the SETUP packet to the buffer of USB_OTG_EP0_OutStart()
+    memcpy((uint8_t *)(uintptr_t)REG(OFS_OUTEP(0, DOEPDMA)), setup, 8);
+    sim_otg_stats.dma_bytes += 8;
+    REG(OFS_OUTEP(0, DOEPINT)) |= (1 << 3); // setup
+  } else {
+    SIM_OTG_PushRxStatus(0, STS_SETUP_UPDT, 8, setup);
+    SIM_OTG_PushRxStatus(0, STS_SETUP_COMP, 0, NULL);
+  }
+  SIM_OTG_Dispatch();
+
+  if( w_length && dir_in ) {
+    // data stage IN until short packet
+    for(tries=0; tries<100 && count < w_length; ++tries) {
+      int32_t r = SIM_OTG_HostIn(0, data + count, w_length - count);
+      if( r < 0 )
+	continue;
+      count += r;
+      if( r < USB_OTG_MAX_EP0_SIZE )
+	break;
+    }
+    // status stage OUT
+    for(tries=0; tries<100; ++tries)
+      if( SIM_OTG_HostOut(0, NULL, 0) >= 0 )
+	break;
+  } else {
+    if( w_length ) {
+      // data stage OUT
+      for(tries=0; tries<100 && count < w_length; ++tries) {
+	uint16_t n = w_length - count;
+	if( n > USB_OTG_MAX_EP0_SIZE )
+	  n = USB_OTG_MAX_EP0_SIZE;
+	if( SIM_OTG_HostOut(0, data + count, n) >= 0 )
+	  count += n;
+      }
+    }
+    // status stage IN
+    for(tries=0; tries<100; ++tries)
+      if( SIM_OTG_HostIn(0, NULL, 0) >= 0 )
+	break;
+  }
+
+  return (tries >= 100) ? -1 : (int32_t)count;
+}
+
+//! \}
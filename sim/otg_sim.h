@@ -0,0 +1,84 @@
+/*
+ * Header file for the simulated USB OTG core (host build)
+ *
+ * ==========================================================================
+ *
+ *  Software model of the STM32F2/F4 OTG_FS/OTG_HS register file which
+ *  allows to run the unmodified USB device stack and the USB MIDI layer
+ *  on a Linux host. The "host" side of the bus (IN/OUT tokens, SETUP
+ *  packets, SOF, bus reset) is driven from sim/bench.c
+ *
+ * ==========================================================================
+ */
+
+#ifndef _OTG_SIM_H
+#define _OTG_SIM_H
+
+#include <stdint.h>
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Global definitions
+/////////////////////////////////////////////////////////////////////////////
+
+// size of the mapped register window of one core (registers + DFIFO windows)
+#define SIM_OTG_WINDOW_SIZE    0x20000
+
+// number of modelled endpoints (HS core has 6)
+#define SIM_OTG_NUM_EPS        6
+
+// interrupt vectors of the NVIC model
+#define SIM_OTG_IRQ_OTG        (1 << 0) // OTG_FS/OTG_HS global interrupt
+#define SIM_OTG_IRQ_EP1_OUT    (1 << 1) // OTG_HS_EP1_OUT (USB_OTG_HS_DEDICATED_EP1_ENABLED)
+#define SIM_OTG_IRQ_EP1_IN     (1 << 2) // OTG_HS_EP1_IN
+
+// statistics collected by the register model
+typedef struct {
+  uint32_t reg_reads;
+  uint32_t reg_writes;
+  uint32_t fifo_words_in;     // words written into Tx FIFOs by the device
+  uint32_t fifo_words_out;    // words read from the Rx FIFO by the device
+  uint32_t dma_bytes;         // bytes moved by the internal DMA (OTG_HS build)
+  uint32_t isr_calls;         // interrupt handler invocations (all vectors)
+  uint32_t ep1_isr_calls;     // USBD_OTG_EP1IN/EP1OUT_ISR_Handler invocations
+  uint32_t in_packets;        // IN data packets delivered to the host
+  uint32_t in_naks;           // IN tokens NAKed (no data ready)
+  uint32_t out_packets;       // OUT data packets accepted by the device
+  uint32_t out_naks;          // OUT tokens NAKed (endpoint not armed)
+  uint32_t errors;            // protocol violations detected by the model
+} sim_otg_stats_t;
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Prototypes
+/////////////////////////////////////////////////////////////////////////////
+
+// device side (used by USB_OTG_READ_REG32/USB_OTG_WRITE_REG32)
+extern uint32_t SIM_OTG_ReadReg(volatile uint32_t *reg);
+extern void SIM_OTG_WriteReg(volatile uint32_t *reg, uint32_t value);
+
+// NVIC model
+extern void SIM_OTG_IRQ_Enable(uint8_t vector, uint8_t enable);
+extern void SIM_OTG_Dispatch(void);
+extern uint8_t SIM_OTG_IsrEntry(uint64_t *enter_ns, uint32_t *enter_regs);
+extern void SIM_OTG_SetIrqLatency(uint8_t tokens);
+extern uint32_t SIM_OTG_Cycles(void);
+
+// host side
+extern int32_t SIM_OTG_Init(uint32_t core_base_addr);
+extern void SIM_OTG_BusReset(uint8_t high_speed);
+extern void SIM_OTG_StartOfFrame(void);
+extern int32_t SIM_OTG_ControlTransfer(const uint8_t *setup, uint8_t *data, uint16_t len);
+extern int32_t SIM_OTG_HostIn(uint8_t ep, uint8_t *buffer, uint16_t max_len);
+extern int32_t SIM_OTG_HostOut(uint8_t ep, const uint8_t *buffer, uint16_t len);
+
+extern uint32_t SIM_OTG_FrameNumber(void);
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Export global variables
+/////////////////////////////////////////////////////////////////////////////
+
+extern sim_otg_stats_t sim_otg_stats;
+
+#endif /* _OTG_SIM_H */
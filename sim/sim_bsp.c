@@ -0,0 +1,477 @@
+//! \defgroup SIM_BSP
+//!
+//! Host versions of libs/irq.c, libs/delay.c, libs/event.c, libs/atomic.h and of the few StdPeriph
+//! functions referenced by midi/usb.c, and a model of the PendSV exception
+//!
+//! \{
+
+/////////////////////////////////////////////////////////////////////////////
+// Include files
+/////////////////////////////////////////////////////////////////////////////
+
+#include <time.h>
+
+#include "main.h"
+#include "libs/irq.h"
+#include "libs/delay.h"
+#include "libs/event.h"
+#include "libs/atomic.h"
+
+#include "otg_sim.h"
+#include "sim_bsp.h"
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Local Prototypes
+/////////////////////////////////////////////////////////////////////////////
+
+static void SIM_BSP_PendSV_Dispatch(void);
+static void SIM_BSP_Compare_Dispatch(void);
+static void SIM_BSP_Compare_Step(uint32_t uS);
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Local Variables
+/////////////////////////////////////////////////////////////////////////////
+
+static uint32_t nested_ctr;
+static uint64_t masked_since_ns;
+
+static uint32_t basepri;
+static uint64_t usb_masked_since_ns;
+
+static uint32_t exception_ctr;
+static uint8_t pendsv_pending;
+
+static uint32_t sim_time_us;
+
+static void (*compare_handler)(void);
+static uint32_t compare_at;
+static uint8_t compare_armed;
+static uint8_t compare_active;
+
+static uint32_t event_flags;
+
+static volatile void *exclusive_addr;
+static sim_bsp_preempt_hook_t preempt_hook;
+
+sim_bsp_stats_t sim_bsp_stats;
+
+
+/////////////////////////////////////////////////////////////////////////////
+// IRQ layer
+/////////////////////////////////////////////////////////////////////////////
+
+void IRQ_Disable(void)
+{
+  if( !nested_ctr ) {
+    ++sim_bsp_stats.irq_disable_calls;
+    masked_since_ns = SIM_BSP_HostTime_nS();
+  }
+
+  ++nested_ctr;
+}
+
+int32_t IRQ_Enable(void)
+{
+  if( nested_ctr == 0 )
+    return -1; // nesting error
+
+  if( --nested_ctr == 0 ) {
+    sim_bsp_stats.irq_masked_ns += SIM_BSP_HostTime_nS() - masked_since_ns;
+
+    // deliver interrupts which have been raised while masked
+    SIM_BSP_Compare_Dispatch();
+    SIM_OTG_Dispatch();
+    SIM_BSP_PendSV_Dispatch();
+  }
+
+  return 0; // no error
+}
+
+int32_t IRQ_Install(uint8_t IRQn, uint8_t priority)
+{
+  if( priority >= 16 )
+    return -1; // invalid priority
+
+  if( IRQn == OTG_FS_IRQn || IRQn == OTG_HS_IRQn )
+    SIM_OTG_IRQ_Enable(SIM_OTG_IRQ_OTG, 1);
+  else if( IRQn == OTG_HS_EP1_OUT_IRQn )
+    SIM_OTG_IRQ_Enable(SIM_OTG_IRQ_EP1_OUT, 1);
+  else if( IRQn == OTG_HS_EP1_IN_IRQn )
+    SIM_OTG_IRQ_Enable(SIM_OTG_IRQ_EP1_IN, 1);
+
+  return 0; // no error
+}
+
+void IRQ_DeInstall(uint8_t IRQn)
+{
+  if( IRQn == OTG_FS_IRQn || IRQn == OTG_HS_IRQn )
+    SIM_OTG_IRQ_Enable(SIM_OTG_IRQ_OTG, 0);
+  else if( IRQn == OTG_HS_EP1_OUT_IRQn )
+    SIM_OTG_IRQ_Enable(SIM_OTG_IRQ_EP1_OUT, 0);
+  else if( IRQn == OTG_HS_EP1_IN_IRQn )
+    SIM_OTG_IRQ_Enable(SIM_OTG_IRQ_EP1_IN, 0);
+}
+
+// BASEPRI: masks the OTG interrupt, SysTick and PendSV, but not the "interrupts"
+// of the preempt hook and the compare interrupt (higher priority)
+uint32_t IRQ_USB_Disable(void)
+{
+  uint32_t prev = basepri;
+
+  if( !basepri ) {
+    ++sim_bsp_stats.usb_disable_calls;
+    usb_masked_since_ns = SIM_BSP_HostTime_nS();
+  }
+
+  // BASEPRI_MAX
+  if( !basepri || IRQ_USB_BASEPRI < basepri )
+    basepri = IRQ_USB_BASEPRI;
+
+  return prev;
+}
+
+void IRQ_USB_Enable(uint32_t prev)
+{
+  basepri = prev;
+
+  if( !basepri ) {
+    sim_bsp_stats.usb_masked_ns += SIM_BSP_HostTime_nS() - usb_masked_since_ns;
+
+    // deliver interrupts which have been raised while masked
+    SIM_OTG_Dispatch();
+    SIM_BSP_PendSV_Dispatch();
+  }
+}
+
+// BASEPRI at the timer priority: masks the compare interrupt as well
+uint32_t IRQ_TIMER_Disable(void)
+{
+  uint32_t prev = basepri;
+
+  if( !basepri || IRQ_TIMER_BASEPRI < basepri )
+    basepri = IRQ_TIMER_BASEPRI;
+
+  return prev;
+}
+
+void IRQ_TIMER_Enable(uint32_t prev)
+{
+  basepri = prev;
+
+  if( !basepri || IRQ_TIMER_BASEPRI < basepri )
+    SIM_BSP_Compare_Dispatch();
+
+  if( !basepri ) {
+    SIM_OTG_Dispatch();
+    SIM_BSP_PendSV_Dispatch();
+  }
+}
+
+// the OTG interrupt, SysTick or PendSV is executed
+uint32_t IRQ_InHandler(void)
+{
+  return exception_ctr;
+}
+
+uint8_t SIM_BSP_IRQ_Masked(void)
+{
+  return (nested_ctr || basepri) ? 1 : 0;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// PendSV: executed once no other exception is active and interrupts are
+// not masked (the OTG interrupt can preempt it)
+/////////////////////////////////////////////////////////////////////////////
+
+void IRQ_PendSV_Init(void)
+{
+}
+
+void IRQ_PendSV_Set(void)
+{
+  pendsv_pending = 1;
+  SIM_BSP_PendSV_Dispatch();
+}
+
+static void SIM_BSP_PendSV_Dispatch(void)
+{
+  uint64_t enter_ns;
+
+  if( !pendsv_pending || exception_ctr || SIM_BSP_IRQ_Masked() )
+    return;
+
+  ++exception_ctr;
+  enter_ns = SIM_BSP_HostTime_nS();
+  while( pendsv_pending ) {
+    pendsv_pending = 0;
+    ++sim_bsp_stats.pendsv_calls;
+    PendSV_Handler();
+  }
+  sim_bsp_stats.pendsv_ns += SIM_BSP_HostTime_nS() - enter_ns;
+  --exception_ctr;
+}
+
+// called around the OTG interrupt handler and USB_MIDI_Periodic_mS() (SysTick)
+uint64_t SIM_BSP_ExceptionEnter(void)
+{
+  ++exception_ctr;
+  return SIM_BSP_HostTime_nS();
+}
+
+void SIM_BSP_ExceptionExit(uint64_t enter_ns)
+{
+  uint64_t ns = SIM_BSP_HostTime_nS() - enter_ns;
+
+  ++sim_bsp_stats.isr_calls;
+  sim_bsp_stats.isr_ns += ns;
+  ns /= SIM_BSP_ISR_HIST_NS;
+  ++sim_bsp_stats.isr_hist[(ns < SIM_BSP_ISR_HIST_SIZE) ? ns : (SIM_BSP_ISR_HIST_SIZE-1)];
+
+  // tail-chaining
+  --exception_ctr;
+  SIM_BSP_PendSV_Dispatch();
+}
+
+// upper bound of the handler time which isn't exceeded by permille/1000 of the handlers
+uint64_t SIM_BSP_IsrPercentile_nS(const sim_bsp_stats_t *stats, uint32_t permille)
+{
+  uint64_t limit = (uint64_t)stats->isr_calls * permille;
+  uint64_t sum = 0;
+  uint32_t i;
+
+  for(i=0; i<SIM_BSP_ISR_HIST_SIZE; ++i) {
+    sum += (uint64_t)stats->isr_hist[i] * 1000;
+    if( sum >= limit )
+      break;
+  }
+
+  return (uint64_t)(i + 1) * SIM_BSP_ISR_HIST_NS;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// ATOMIC layer: model of the exclusive monitor, the benchmark can run
+// "interrupts" between the exclusive load and store of the interrupted code
+/////////////////////////////////////////////////////////////////////////////
+
+uint16_t ATOMIC_LoadExclusive16(volatile uint16_t *addr)
+{
+  uint16_t value = *addr;
+
+  ++sim_bsp_stats.exclusive_loads;
+  exclusive_addr = addr;
+
+  // interrupts can't be taken while masked
+  if( preempt_hook && !nested_ctr && preempt_hook() ) {
+    ++sim_bsp_stats.preemptions;
+    exclusive_addr = NULL;
+  }
+
+  return value;
+}
+
+uint32_t ATOMIC_StoreExclusive16(volatile uint16_t *addr, uint16_t value)
+{
+  if( exclusive_addr != addr ) {
+    ++sim_bsp_stats.exclusive_fails;
+    return 1;
+  }
+
+  exclusive_addr = NULL;
+  *addr = value;
+
+  return 0;
+}
+
+uint32_t ATOMIC_LoadExclusive32(volatile uint32_t *addr)
+{
+  uint32_t value = *addr;
+
+  ++sim_bsp_stats.exclusive_loads;
+  exclusive_addr = addr;
+
+  if( preempt_hook && !nested_ctr && preempt_hook() ) {
+    ++sim_bsp_stats.preemptions;
+    exclusive_addr = NULL;
+  }
+
+  return value;
+}
+
+uint32_t ATOMIC_StoreExclusive32(volatile uint32_t *addr, uint32_t value)
+{
+  if( exclusive_addr != addr ) {
+    ++sim_bsp_stats.exclusive_fails;
+    return 1;
+  }
+
+  exclusive_addr = NULL;
+  *addr = value;
+
+  return 0;
+}
+
+void ATOMIC_ClearExclusive(void)
+{
+  exclusive_addr = NULL;
+}
+
+void SIM_BSP_PreemptHookSet(sim_bsp_preempt_hook_t hook)
+{
+  preempt_hook = hook;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// EVENT layer: there is nothing to wait for on the host, the benchmark
+// polls the events after each bus transaction
+// (plain read-modify-write like the LDREX/STREX of libs/event.c, the
+// interrupts are never masked for it; not modelled with the exclusive
+// monitor to keep the Tx buffer statistics of the preemption run apart)
+/////////////////////////////////////////////////////////////////////////////
+
+void EVENT_Set(uint32_t events)
+{
+  ++sim_bsp_stats.events_set;
+  event_flags |= events;
+}
+
+uint32_t EVENT_Get(uint32_t mask)
+{
+  uint32_t events = event_flags & mask;
+
+  event_flags &= ~events;
+
+  return events;
+}
+
+uint32_t EVENT_Wait(uint32_t mask)
+{
+  // returns 0 instead of sleeping
+  return EVENT_Get(mask);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// DELAY layer: advances the simulated time instead of polling a timer
+/////////////////////////////////////////////////////////////////////////////
+
+void DELAY_Init(void)
+{
+  sim_time_us = 0;
+}
+
+void DELAY_Wait_uS(uint32_t uS)
+{
+  sim_bsp_stats.wait_us += uS;
+  SIM_BSP_Compare_Step(uS);
+}
+
+uint32_t DELAY_Now_uS(void)
+{
+  return sim_time_us;
+}
+
+uint64_t DELAY_Now64_uS(void)
+{
+  return sim_time_us;
+}
+
+uint32_t SIM_BSP_Time_uS(void)
+{
+  return sim_time_us;
+}
+
+void SIM_BSP_AdvanceTime_uS(uint32_t uS)
+{
+  SIM_BSP_Compare_Step(uS);
+}
+
+uint64_t SIM_BSP_HostTime_nS(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Compare channel of the DELAY timer: the interrupt is taken at the
+// programmed time while the clock advances (IRQ_TIMER_PRIORITY, only
+// masked by IRQ_Disable() and IRQ_TIMER_Disable())
+/////////////////////////////////////////////////////////////////////////////
+
+void DELAY_CompareInit(void (*handler)(void))
+{
+  compare_handler = handler;
+  compare_armed = 0;
+}
+
+void DELAY_CompareSet(uint32_t at_uS)
+{
+  compare_at = at_uS;
+  compare_armed = 1;
+
+  // the time could already have passed
+  SIM_BSP_Compare_Dispatch();
+}
+
+void DELAY_CompareDisable(void)
+{
+  compare_armed = 0;
+}
+
+#define SIM_BSP_COMPARE_MASKED() \
+  (compare_active || nested_ctr || (basepri && basepri <= IRQ_TIMER_BASEPRI))
+
+static void SIM_BSP_Compare_Dispatch(void)
+{
+  // a compare value which is set again from the handler pends the interrupt once more
+  while( compare_armed && !SIM_BSP_COMPARE_MASKED() && (int32_t)(sim_time_us - compare_at) >= 0 ) {
+    uint64_t enter_ns;
+
+    compare_armed = 0;
+    compare_active = 1;
+    ++sim_bsp_stats.compare_irqs;
+    enter_ns = SIM_BSP_ExceptionEnter();
+    compare_handler();
+    SIM_BSP_ExceptionExit(enter_ns);
+    compare_active = 0;
+  }
+}
+
+// advances the clock, stops at each compare match on the way
+static void SIM_BSP_Compare_Step(uint32_t uS)
+{
+  while( compare_armed && !SIM_BSP_COMPARE_MASKED() ) {
+    int32_t d = (int32_t)(compare_at - sim_time_us);
+
+    if( d > (int32_t)uS )
+      break;
+
+    if( d > 0 ) {
+      sim_time_us += d;
+      uS -= d;
+    }
+    SIM_BSP_Compare_Dispatch();
+  }
+
+  sim_time_us += uS;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// StdPeriph stubs for USB_OTG_BSP_Init()
+/////////////////////////////////////////////////////////////////////////////
+
+void RCC_AHB1PeriphClockCmd(uint32_t RCC_AHB1Periph, FunctionalState NewState) {}
+void RCC_AHB2PeriphClockCmd(uint32_t RCC_AHB2Periph, FunctionalState NewState) {}
+void RCC_APB2PeriphClockCmd(uint32_t RCC_APB2Periph, FunctionalState NewState) {}
+void GPIO_Init(GPIO_TypeDef* GPIOx, GPIO_InitTypeDef* GPIO_InitStruct) {}
+void GPIO_PinAFConfig(GPIO_TypeDef* GPIOx, uint16_t GPIO_PinSource, uint8_t GPIO_AF) {}
+void EXTI_ClearITPendingBit(uint32_t EXTI_Line) {}
+
+//! \}
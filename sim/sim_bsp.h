@@ -0,0 +1,80 @@
+/*
+ * Header file for the host versions of the IRQ, DELAY, EVENT and ATOMIC layer
+ *
+ * ==========================================================================
+ *
+ *  Replaces libs/irq.c, libs/delay.c and libs/event.c in the host build. Interrupt
+ *  masking is tracked in software (and delays advance a simulated clock, which
+ *  takes the compare interrupt of the DELAY timer at its exact time),
+ *  so that the benchmark can report how often and how long the USB MIDI
+ *  layer masks the OTG interrupt. The exclusive load/store of the ATOMIC
+ *  layer can be interrupted by a hook of the benchmark.
+ *
+ * ==========================================================================
+ */
+
+#ifndef _SIM_BSP_H
+#define _SIM_BSP_H
+
+#include <stdint.h>
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Global definitions
+/////////////////////////////////////////////////////////////////////////////
+
+// histogram of the interrupt handler times (the host scheduler makes the max. meaningless)
+#define SIM_BSP_ISR_HIST_NS    20  // bucket width
+#define SIM_BSP_ISR_HIST_SIZE  500 // the last bucket counts all longer handlers
+
+typedef struct {
+  uint32_t irq_disable_calls; // outermost IRQ_Disable() calls
+  uint64_t irq_masked_ns;     // host time spent with interrupts masked
+  uint64_t wait_us;           // busy-waits of DELAY_Wait_uS()
+  uint32_t usb_disable_calls; // outermost IRQ_USB_Disable() calls
+  uint64_t usb_masked_ns;     // host time spent with BASEPRI at IRQ_USB_PRIORITY
+  uint32_t events_set;        // EVENT_Set() calls
+  uint32_t exclusive_loads;   // ATOMIC_LoadExclusive16() calls
+  uint32_t exclusive_fails;   // failed ATOMIC_StoreExclusive16() calls
+  uint32_t preemptions;       // interrupts taken between exclusive load and store
+  uint32_t isr_calls;         // outermost interrupt handler executions (OTG, SysTick)
+  uint64_t isr_ns;            // host time spent in these handlers
+  uint32_t isr_hist[SIM_BSP_ISR_HIST_SIZE];
+  uint32_t pendsv_calls;      // PendSV_Handler() executions
+  uint64_t pendsv_ns;
+  uint32_t compare_irqs;      // compare interrupts of the DELAY timer
+} sim_bsp_stats_t;
+
+// called after each exclusive load, returns 1 if an "interrupt" has been executed
+// (the exclusive monitor is cleared then, like on exception entry/return)
+typedef uint8_t (*sim_bsp_preempt_hook_t)(void);
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Prototypes
+/////////////////////////////////////////////////////////////////////////////
+
+extern uint8_t SIM_BSP_IRQ_Masked(void);
+
+extern uint32_t SIM_BSP_Time_uS(void);
+extern void SIM_BSP_AdvanceTime_uS(uint32_t uS);
+
+extern uint64_t SIM_BSP_HostTime_nS(void);
+
+extern void SIM_BSP_PreemptHookSet(sim_bsp_preempt_hook_t hook);
+
+extern uint64_t SIM_BSP_ExceptionEnter(void);
+extern void SIM_BSP_ExceptionExit(uint64_t enter_ns);
+extern uint64_t SIM_BSP_IsrPercentile_nS(const sim_bsp_stats_t *stats, uint32_t permille);
+
+// provided by the benchmark (core/stm32fxxx_it.c on the target)
+extern void PendSV_Handler(void);
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Export global variables
+/////////////////////////////////////////////////////////////////////////////
+
+extern sim_bsp_stats_t sim_bsp_stats;
+
+#endif /* _SIM_BSP_H */
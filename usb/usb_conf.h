@@ -51,10 +51,14 @@
 //#define USE_USB_OTG_FS
 #endif /* USE_USB_OTG_FS */
 
-#ifdef USE_USB_OTG_FS 
+#ifdef USE_USB_OTG_FS
  #define USB_OTG_FS_CORE
 #endif
 
+#ifdef USE_USB_OTG_HS
+ #define USB_OTG_HS_CORE
+#endif
+
 
 
 /*******************************************************************************
@@ -108,6 +112,45 @@
 #endif
 
 
+/****************** USB OTG HS CONFIGURATION **********************************/
+/* 1024 words of FIFO RAM: the Tx FIFO of the MIDI IN endpoint holds two
+   512 byte packets, so that the next packet is prepared while the host
+   reads the current one */
+#ifdef USB_OTG_HS_CORE
+ #define RX_FIFO_HS_SIZE                          512
+ #define TX0_FIFO_HS_SIZE                         128
+ #define TX1_FIFO_HS_SIZE                         372
+ #define TX2_FIFO_HS_SIZE                          0
+ #define TX3_FIFO_HS_SIZE                          0
+ #define TX4_FIFO_HS_SIZE                          0
+ #define TX5_FIFO_HS_SIZE                          0
+ #define TXH_NP_HS_FIFOSIZ                         96
+ #define TXH_P_HS_FIFOSIZ                          96
+
+ //#define USB_OTG_HS_LOW_PWR_MGMT_SUPPORT
+ //#define USB_OTG_HS_SOF_OUTPUT_ENABLED
+
+ #ifdef USE_ULPI_PHY
+  #define USB_OTG_ULPI_PHY_ENABLED
+ #endif
+ #ifdef USE_EMBEDDED_PHY
+  #define USB_OTG_EMBEDDED_PHY_ENABLED
+ #endif
+ #ifdef USE_I2C_PHY
+  #define USB_OTG_I2C_PHY_ENABLED
+ #endif
+
+ /* the endpoint buffers are read and written by the DMA of the core, they
+    have to be word aligned (__ALIGN_BEGIN/__ALIGN_END) */
+ #define USB_OTG_HS_INTERNAL_DMA_ENABLED
+ #define USB_OTG_EXTERNAL_VBUS_ENABLED
+
+ /* the interrupts of EP1 (MIDI data endpoints) are routed to the
+    OTG_HS_EP1_IN/OUT vectors instead of the global OTG_HS interrupt */
+ #define USB_OTG_HS_DEDICATED_EP1_ENABLED
+#endif
+
+
 /****************** USB OTG MODE CONFIGURATION ********************************/
 
 #define USE_DEVICE_MODE
@@ -139,6 +182,13 @@
  #endif
 #endif
 
+/****************** USB OTG ISR STATISTICS ************************************/
+/* 1: the calls and the cycles (DWT cycle counter) of each interrupt source are
+   counted in USBD_OTG_ISR_Stats[] (see usb_dcd_int.h) */
+#ifndef USB_OTG_ISR_STATS
+ #define USB_OTG_ISR_STATS                          0
+#endif
+
 /****************** C Compilers dependant keywords ****************************/
 /* In HS mode and when the DMA is used, all variables and data structures dealing
    with the DMA during the transaction process should be 4-bytes aligned */    
@@ -44,6 +44,14 @@
 * @{
 */ 
 
+/* Each address of a DFIFO window accesses the FIFO, so word aligned packets
+   are copied in LDM/STM bursts of this number of words (Cortex-M3/M4) */
+#define USB_OTG_FIFO_BURST_WORDS   4
+
+#if defined(__GNUC__) && (defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)) && !defined(USB_OTG_SIM)
+#define USB_OTG_FIFO_BURST_ASM     1
+#endif
+
 /**
 * @}
 */ 
@@ -156,6 +164,76 @@ static USB_OTG_STS USB_OTG_CoreReset(USB_OTG_CORE_HANDLE *pdev)
   return status;
 }
 
+/**
+* @brief  USB_OTG_WriteFifoAligned
+*         Writes words from a word aligned buffer into a Tx FIFO
+* @param  fifo : DFIFO window of the EP
+* @param  src : source pointer (word aligned)
+* @param  count32b : No. of words
+* @retval None
+*/
+static void USB_OTG_WriteFifoAligned(__IO uint32_t *fifo,
+                                     const uint32_t *src,
+                                     uint32_t count32b)
+{
+  for (; count32b >= USB_OTG_FIFO_BURST_WORDS; count32b -= USB_OTG_FIFO_BURST_WORDS)
+  {
+#ifdef USB_OTG_FIFO_BURST_ASM
+    __asm__ volatile ("ldmia %0!, {r2-r5}\n\t"
+                      "stmia %1, {r2-r5}"
+                      : "+r" (src)
+                      : "r" (fifo)
+                      : "r2", "r3", "r4", "r5", "memory");
+#else
+    USB_OTG_WRITE_REG32( fifo + 0, src[0] );
+    USB_OTG_WRITE_REG32( fifo + 1, src[1] );
+    USB_OTG_WRITE_REG32( fifo + 2, src[2] );
+    USB_OTG_WRITE_REG32( fifo + 3, src[3] );
+    src += USB_OTG_FIFO_BURST_WORDS;
+#endif
+  }
+  
+  while (count32b--)
+  {
+    USB_OTG_WRITE_REG32( fifo, *src++ );
+  }
+}
+
+/**
+* @brief  USB_OTG_ReadFifoAligned
+*         Reads words from the Rx FIFO into a word aligned buffer
+* @param  fifo : DFIFO window
+* @param  dest : destination pointer (word aligned)
+* @param  count32b : No. of words
+* @retval None
+*/
+static void USB_OTG_ReadFifoAligned(__IO uint32_t *fifo,
+                                    uint32_t *dest,
+                                    uint32_t count32b)
+{
+  for (; count32b >= USB_OTG_FIFO_BURST_WORDS; count32b -= USB_OTG_FIFO_BURST_WORDS)
+  {
+#ifdef USB_OTG_FIFO_BURST_ASM
+    __asm__ volatile ("ldmia %1, {r2-r5}\n\t"
+                      "stmia %0!, {r2-r5}"
+                      : "+r" (dest)
+                      : "r" (fifo)
+                      : "r2", "r3", "r4", "r5", "memory");
+#else
+    dest[0] = USB_OTG_READ_REG32( fifo + 0 );
+    dest[1] = USB_OTG_READ_REG32( fifo + 1 );
+    dest[2] = USB_OTG_READ_REG32( fifo + 2 );
+    dest[3] = USB_OTG_READ_REG32( fifo + 3 );
+    dest += USB_OTG_FIFO_BURST_WORDS;
+#endif
+  }
+  
+  while (count32b--)
+  {
+    *dest++ = USB_OTG_READ_REG32( fifo );
+  }
+}
+
 /**
 * @brief  USB_OTG_WritePacket : Writes a packet into the Tx FIFO associated 
 *         with the EP
@@ -178,6 +256,12 @@ USB_OTG_STS USB_OTG_WritePacket(USB_OTG_CORE_HANDLE *pdev,
     
     count32b =  (len + 3) / 4;
     fifo = pdev->regs.DFIFO[ch_ep_num];
+    /* the USB MIDI transfer buffers are word aligned, descriptors may not be */
+    if (((uint32_t)src & 3) == 0)
+    {
+      USB_OTG_WriteFifoAligned(fifo, (const uint32_t *)src, count32b);
+      return status;
+    }
     for (i = 0; i < count32b; i++, src+=4)
     {
       USB_OTG_WRITE_REG32( fifo, *((__packed uint32_t *)src) );
@@ -203,6 +287,12 @@ void *USB_OTG_ReadPacket(USB_OTG_CORE_HANDLE *pdev,
   
   __IO uint32_t *fifo = pdev->regs.DFIFO[0];
   
+  if (((uint32_t)dest & 3) == 0)
+  {
+    USB_OTG_ReadFifoAligned(fifo, (uint32_t *)dest, count32b);
+    return ((void *)(dest + count32b * 4));
+  }
+  
   for ( i = 0; i < count32b; i++, dest += 4 )
   {
     *(__packed uint32_t *)dest = USB_OTG_READ_REG32(fifo);
@@ -261,7 +261,7 @@ typedef struct _DCD
   uint32_t       DevRemoteWakeup;
   USB_OTG_EP     in_ep   [USB_OTG_MAX_TX_FIFOS];
   USB_OTG_EP     out_ep  [USB_OTG_MAX_TX_FIFOS];
-  uint8_t        setup_packet [8*3];
+  __ALIGN_BEGIN uint8_t setup_packet [8*3] __ALIGN_END; /* written by the DMA in HS mode */
   USBD_Class_cb_TypeDef         *class_cb;
   USBD_Usr_cb_TypeDef           *usr_cb;
   USBD_DEVICE                   *usr_device;  
@@ -40,6 +40,24 @@
 /** @defgroup USB_DCD_INT_Private_Defines
 * @{
 */ 
+/* GINTSTS bits of the interrupt sources handled in device mode */
+#define DCD_GINT_MODEMISMATCH      1
+#define DCD_GINT_OTG               2
+#define DCD_GINT_SOF               3
+#define DCD_GINT_RXSTSQLVL         4
+#define DCD_GINT_USBSUSPEND       11
+#define DCD_GINT_USBRESET         12
+#define DCD_GINT_ENUMDONE         13
+#define DCD_GINT_INEP             18
+#define DCD_GINT_OUTEP            19
+#define DCD_GINT_INCOMPLISOIN     20
+#define DCD_GINT_INCOMPLISOOUT    21
+#define DCD_GINT_SESSREQ          30
+#define DCD_GINT_WKUP             31
+
+/* DWT cycle counter (Cortex-M3/M4) */
+#define DCD_DWT_CTRL              ((__IO uint32_t *)0xE0001000)
+#define DCD_DWT_CYCCNT            ((__IO uint32_t *)0xE0001004)
 /**
 * @}
 */ 
@@ -48,6 +66,13 @@
 /** @defgroup USB_DCD_INT_Private_TypesDefinitions
 * @{
 */ 
+typedef uint32_t (* DCD_ISR_TypeDef) (USB_OTG_CORE_HANDLE *pdev);
+
+typedef struct _DCD_ISR_ENTRY
+{
+  uint8_t         src;  /* GINTSTS bit */
+  DCD_ISR_TypeDef isr;
+}DCD_ISR_Entry_TypeDef;
 /**
 * @}
 */ 
@@ -57,6 +82,15 @@
 /** @defgroup USB_DCD_INT_Private_Macros
 * @{
 */ 
+/* number of leading zeros, the endpoint interrupt bits are iterated from the
+   highest set bit downwards (value != 0) */
+#ifdef USB_OTG_SIM
+#define DCD_CLZ(value)            ((uint32_t)__builtin_clz(value))
+#define DCD_CYCLES()              SIM_OTG_Cycles()
+#else
+#define DCD_CLZ(value)            ((uint32_t)__CLZ(value))
+#define DCD_CYCLES()              (*DCD_DWT_CYCCNT)
+#endif
 /**
 * @}
 */ 
@@ -65,6 +99,9 @@
 /** @defgroup USB_DCD_INT_Private_Variables
 * @{
 */ 
+#if USB_OTG_ISR_STATS
+USB_OTG_ISR_STATS_TypeDef USBD_OTG_ISR_Stats[USB_OTG_ISR_STATS_NUM];
+#endif
 /**
 * @}
 */ 
@@ -75,6 +112,7 @@
 */ 
 /* static functions */
 static uint32_t DCD_ReadDevInEP (USB_OTG_CORE_HANDLE *pdev, uint8_t epnum);
+static uint32_t DCD_GetOutXferCount (USB_OTG_CORE_HANDLE *pdev, uint8_t epnum);
 
 /* Interrupt Handlers */
 static uint32_t DCD_HandleInEP_ISR(USB_OTG_CORE_HANDLE *pdev);
@@ -91,10 +129,40 @@ static uint32_t DCD_HandleUSBSuspend_ISR(USB_OTG_CORE_HANDLE *pdev);
 
 static uint32_t DCD_IsoINIncomplete_ISR(USB_OTG_CORE_HANDLE *pdev);
 static uint32_t DCD_IsoOUTIncomplete_ISR(USB_OTG_CORE_HANDLE *pdev);
+static uint32_t DCD_HandleModeMismatch_ISR(USB_OTG_CORE_HANDLE *pdev);
 #ifdef VBUS_SENSING_ENABLED
 static uint32_t DCD_SessionRequest_ISR(USB_OTG_CORE_HANDLE *pdev);
 static uint32_t DCD_OTG_ISR(USB_OTG_CORE_HANDLE *pdev);
 #endif
+#ifdef USB_OTG_HS_DEDICATED_EP1_ENABLED
+static uint32_t DCD_HandleEP1OUT_ISR(USB_OTG_CORE_HANDLE *pdev);
+static uint32_t DCD_HandleEP1IN_ISR(USB_OTG_CORE_HANDLE *pdev);
+#endif
+
+/* handlers of the GINTSTS bits in the order of the original if-chain:
+   the endpoints first (the common case ends after them), resume before
+   suspend, suspend before reset and enumeration done (a reset which follows
+   a suspend must not be undone by it), sources without a handler are ignored */
+static const DCD_ISR_Entry_TypeDef DCD_ISR_Table[] =
+{
+  { DCD_GINT_OUTEP,         DCD_HandleOutEP_ISR },
+  { DCD_GINT_INEP,          DCD_HandleInEP_ISR },
+  { DCD_GINT_MODEMISMATCH,  DCD_HandleModeMismatch_ISR },
+  { DCD_GINT_WKUP,          DCD_HandleResume_ISR },
+  { DCD_GINT_USBSUSPEND,    DCD_HandleUSBSuspend_ISR },
+  { DCD_GINT_SOF,           DCD_HandleSof_ISR },
+  { DCD_GINT_RXSTSQLVL,     DCD_HandleRxStatusQueueLevel_ISR },
+  { DCD_GINT_USBRESET,      DCD_HandleUsbReset_ISR },
+  { DCD_GINT_ENUMDONE,      DCD_HandleEnumDone_ISR },
+  { DCD_GINT_INCOMPLISOIN,  DCD_IsoINIncomplete_ISR },
+  { DCD_GINT_INCOMPLISOOUT, DCD_IsoOUTIncomplete_ISR },
+#ifdef VBUS_SENSING_ENABLED
+  { DCD_GINT_SESSREQ,       DCD_SessionRequest_ISR },
+  { DCD_GINT_OTG,           DCD_OTG_ISR },
+#endif
+};
+
+#define DCD_ISR_NUM               (sizeof(DCD_ISR_Table) / sizeof(DCD_ISR_Table[0]))
 
 /**
 * @}
@@ -106,18 +174,87 @@ static uint32_t DCD_OTG_ISR(USB_OTG_CORE_HANDLE *pdev);
 */ 
 
 
+/**
+* @brief  DCD_RunISR
+*         calls the handler of an interrupt source, with USB_OTG_ISR_STATS
+*         its calls and cycles are counted
+* @param  pdev: device instance
+* @param  isr: handler
+* @param  src: index of USBD_OTG_ISR_Stats[]
+* @retval status of the handler
+*/
+static uint32_t DCD_RunISR(USB_OTG_CORE_HANDLE *pdev, DCD_ISR_TypeDef isr, uint32_t src)
+{
+#if USB_OTG_ISR_STATS
+  uint32_t retval;
+  uint32_t start = DCD_CYCLES();
+  
+  retval = isr(pdev);
+  USBD_OTG_ISR_Stats[src].cycles += (uint32_t)(DCD_CYCLES() - start);
+  USBD_OTG_ISR_Stats[src].calls++;
+  return retval;
+#else
+  (void)src;
+  return isr(pdev);
+#endif
+}
+
+#if USB_OTG_ISR_STATS
+/**
+* @brief  USBD_OTG_ISR_StatsReset
+*         clears USBD_OTG_ISR_Stats[] and enables the DWT cycle counter
+* @param  None
+* @retval None
+*/
+void USBD_OTG_ISR_StatsReset(void)
+{
+  uint32_t i;
+  
+#ifndef USB_OTG_SIM
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  *DCD_DWT_CTRL |= 1; /* CYCCNTENA */
+#endif
+  for (i = 0; i < USB_OTG_ISR_STATS_NUM; i++)
+  {
+    USBD_OTG_ISR_Stats[i].calls = 0;
+    USBD_OTG_ISR_Stats[i].cycles = 0;
+  }
+}
+#endif
+
 #ifdef USB_OTG_HS_DEDICATED_EP1_ENABLED  
 /**
 * @brief  USBD_OTG_EP1OUT_ISR_Handler
-*         handles all USB Interrupts
+*         handles the interrupts of OUT EP1 (OTG_HS_EP1_OUT vector)
 * @param  pdev: device instance
 * @retval status
 */
 uint32_t USBD_OTG_EP1OUT_ISR_Handler (USB_OTG_CORE_HANDLE *pdev)
+{
+  return DCD_RunISR(pdev, DCD_HandleEP1OUT_ISR, USB_OTG_ISR_STATS_EP1OUT);
+}
+
+/**
+* @brief  USBD_OTG_EP1IN_ISR_Handler
+*         handles the interrupts of IN EP1 (OTG_HS_EP1_IN vector)
+* @param  pdev: device instance
+* @retval status
+*/
+uint32_t USBD_OTG_EP1IN_ISR_Handler (USB_OTG_CORE_HANDLE *pdev)
+{
+  return DCD_RunISR(pdev, DCD_HandleEP1IN_ISR, USB_OTG_ISR_STATS_EP1IN);
+}
+
+/**
+* @brief  DCD_HandleEP1OUT_ISR
+*         Indicates that OUT EP1 has a pending Interrupt
+* @param  pdev: device instance
+* @retval status
+*/
+static uint32_t DCD_HandleEP1OUT_ISR(USB_OTG_CORE_HANDLE *pdev)
 {
   
   USB_OTG_DOEPINTn_TypeDef  doepint;
-  USB_OTG_DEPXFRSIZ_TypeDef  deptsiz;  
   
   doepint.d32 = USB_OTG_READ_REG32(&pdev->regs.OUTEP_REGS[1]->DOEPINT);
   doepint.d32&= USB_OTG_READ_REG32(&pdev->regs.DREGS->DOUTEP1MSK);
@@ -129,10 +266,7 @@ uint32_t USBD_OTG_EP1OUT_ISR_Handler (USB_OTG_CORE_HANDLE *pdev)
     CLEAR_OUT_EP_INTR(1, xfercompl);
     if (pdev->cfg.dma_enable == 1)
     {
-      deptsiz.d32 = USB_OTG_READ_REG32(&(pdev->regs.OUTEP_REGS[1]->DOEPTSIZ));
-      /*ToDo : handle more than one single MPS size packet */
-      pdev->dev.out_ep[1].xfer_count = pdev->dev.out_ep[1].maxpacket - \
-        deptsiz.b.xfersize;
+      pdev->dev.out_ep[1].xfer_count = DCD_GetOutXferCount(pdev, 1);
     }    
     /* Inform upper layer: data ready */
     /* RX COMPLETE */
@@ -151,12 +285,12 @@ uint32_t USBD_OTG_EP1OUT_ISR_Handler (USB_OTG_CORE_HANDLE *pdev)
 }
 
 /**
-* @brief  USBD_OTG_EP1IN_ISR_Handler
-*         handles all USB Interrupts
+* @brief  DCD_HandleEP1IN_ISR
+*         Indicates that IN EP1 has a pending Interrupt
 * @param  pdev: device instance
 * @retval status
 */
-uint32_t USBD_OTG_EP1IN_ISR_Handler (USB_OTG_CORE_HANDLE *pdev)
+static uint32_t DCD_HandleEP1IN_ISR(USB_OTG_CORE_HANDLE *pdev)
 {
   
   USB_OTG_DIEPINTn_TypeDef  diepint;
@@ -202,98 +336,57 @@ uint32_t USBD_OTG_EP1IN_ISR_Handler (USB_OTG_CORE_HANDLE *pdev)
 
 /**
 * @brief  STM32_USBF_OTG_ISR_Handler
-*         handles all USB Interrupts
+*         handles all USB Interrupts: the pending and enabled sources
+*         (GINTSTS & GINTMSK) are dispatched through DCD_ISR_Table in its
+*         order, the walk ends once no source is left
 * @param  pdev: device instance
 * @retval status
 */
 uint32_t USBD_OTG_ISR_Handler (USB_OTG_CORE_HANDLE *pdev)
 {
-  USB_OTG_GINTSTS_TypeDef  gintr_status;
+  uint32_t gintr_status;
+  uint32_t src;
+  uint32_t i;
   uint32_t retval = 0;
   
   if (USB_OTG_IsDeviceMode(pdev)) /* ensure that we are in device mode */
   {
-    gintr_status.d32 = USB_OTG_ReadCoreItr(pdev);
-    if (!gintr_status.d32) /* avoid spurious interrupt */
+    gintr_status = USB_OTG_ReadCoreItr(pdev);
+    if (!gintr_status) /* avoid spurious interrupt */
     {
       return 0;
     }
     
-    if (gintr_status.b.outepintr)
-    {
-      retval |= DCD_HandleOutEP_ISR(pdev);
-    }    
-    
-    if (gintr_status.b.inepint)
-    {
-      retval |= DCD_HandleInEP_ISR(pdev);
-    }
-    
-    if (gintr_status.b.modemismatch)
-    {
-      USB_OTG_GINTSTS_TypeDef  gintsts;
-      
-      /* Clear interrupt */
-      gintsts.d32 = 0;
-      gintsts.b.modemismatch = 1;
-      USB_OTG_WRITE_REG32(&pdev->regs.GREGS->GINTSTS, gintsts.d32);
-    }
-    
-    if (gintr_status.b.wkupintr)
-    {
-      retval |= DCD_HandleResume_ISR(pdev);
-    }
-    
-    if (gintr_status.b.usbsuspend)
-    {
-      retval |= DCD_HandleUSBSuspend_ISR(pdev);
-    }
-    if (gintr_status.b.sofintr)
-    {
-      retval |= DCD_HandleSof_ISR(pdev);
-      
-    }
-    
-    if (gintr_status.b.rxstsqlvl)
-    {
-      retval |= DCD_HandleRxStatusQueueLevel_ISR(pdev);
-      
-    }
-    
-    if (gintr_status.b.usbreset)
-    {
-      retval |= DCD_HandleUsbReset_ISR(pdev);
-      
-    }
-    if (gintr_status.b.enumdone)
-    {
-      retval |= DCD_HandleEnumDone_ISR(pdev);
-    }
-    
-    if (gintr_status.b.incomplisoin)
-    {
-      retval |= DCD_IsoINIncomplete_ISR(pdev);
-    }
-
-    if (gintr_status.b.incomplisoout)
-    {
-      retval |= DCD_IsoOUTIncomplete_ISR(pdev);
-    }    
-#ifdef VBUS_SENSING_ENABLED
-    if (gintr_status.b.sessreqintr)
+    for (i = 0; i < DCD_ISR_NUM && gintr_status; i++)
     {
-      retval |= DCD_SessionRequest_ISR(pdev);
+      src = DCD_ISR_Table[i].src;
+      if (gintr_status & (1UL << src))
+      {
+        gintr_status &= ~(1UL << src);
+        retval |= DCD_RunISR(pdev, DCD_ISR_Table[i].isr, src);
+      }
     }
-
-    if (gintr_status.b.otgintr)
-    {
-      retval |= DCD_OTG_ISR(pdev);
-    }   
-#endif    
   }
   return retval;
 }
 
+/**
+* @brief  DCD_HandleModeMismatch_ISR
+*         Indicates an access to host mode registers in device mode
+* @param  pdev: device instance
+* @retval status
+*/
+static uint32_t DCD_HandleModeMismatch_ISR(USB_OTG_CORE_HANDLE *pdev)
+{
+  USB_OTG_GINTSTS_TypeDef  gintsts;
+  
+  /* Clear interrupt */
+  gintsts.d32 = 0;
+  gintsts.b.modemismatch = 1;
+  USB_OTG_WRITE_REG32(&pdev->regs.GREGS->GINTSTS, gintsts.d32);
+  return 0;
+}
+
 #ifdef VBUS_SENSING_ENABLED
 /**
 * @brief  DCD_SessionRequest_ISR
@@ -432,52 +525,49 @@ static uint32_t DCD_HandleInEP_ISR(USB_OTG_CORE_HANDLE *pdev)
   
   while ( ep_intr )
   {
-    if (ep_intr&0x1) /* In ITR */
+    epnum = 31 - DCD_CLZ(ep_intr);
+    ep_intr &= ~(1UL << epnum);
+    diepint.d32 = DCD_ReadDevInEP(pdev , epnum); /* Get In ITR status */
+    if ( diepint.b.xfercompl )
     {
-      diepint.d32 = DCD_ReadDevInEP(pdev , epnum); /* Get In ITR status */
-      if ( diepint.b.xfercompl )
+      fifoemptymsk = 0x1 << epnum;
+      USB_OTG_MODIFY_REG32(&pdev->regs.DREGS->DIEPEMPMSK, fifoemptymsk, 0);
+      CLEAR_IN_EP_INTR(epnum, xfercompl);
+      /* TX COMPLETE */
+      USBD_DCD_INT_fops->DataInStage(pdev , epnum);
+      
+      if (pdev->cfg.dma_enable == 1)
       {
-        fifoemptymsk = 0x1 << epnum;
-        USB_OTG_MODIFY_REG32(&pdev->regs.DREGS->DIEPEMPMSK, fifoemptymsk, 0);
-        CLEAR_IN_EP_INTR(epnum, xfercompl);
-        /* TX COMPLETE */
-        USBD_DCD_INT_fops->DataInStage(pdev , epnum);
-        
-        if (pdev->cfg.dma_enable == 1)
+        if((epnum == 0) && (pdev->dev.device_state == USB_OTG_EP0_STATUS_IN))
         {
-          if((epnum == 0) && (pdev->dev.device_state == USB_OTG_EP0_STATUS_IN))
-          {
-            /* prepare to rx more setup packets */
-            USB_OTG_EP0_OutStart(pdev);
-          }
-        }           
-      }
-      if ( diepint.b.timeout )
-      {
-        CLEAR_IN_EP_INTR(epnum, timeout);
-      }
-      if (diepint.b.intktxfemp)
-      {
-        CLEAR_IN_EP_INTR(epnum, intktxfemp);
-      }
-      if (diepint.b.inepnakeff)
-      {
-        CLEAR_IN_EP_INTR(epnum, inepnakeff);
-      }
-      if ( diepint.b.epdisabled )
-      {
-        CLEAR_IN_EP_INTR(epnum, epdisabled);
-      }       
-      if (diepint.b.emptyintr)
-      {
-        
-        DCD_WriteEmptyTxFifo(pdev , epnum);
-        
-        CLEAR_IN_EP_INTR(epnum, emptyintr);
-      }
+          /* prepare to rx more setup packets */
+          USB_OTG_EP0_OutStart(pdev);
+        }
+      }           
+    }
+    if ( diepint.b.timeout )
+    {
+      CLEAR_IN_EP_INTR(epnum, timeout);
+    }
+    if (diepint.b.intktxfemp)
+    {
+      CLEAR_IN_EP_INTR(epnum, intktxfemp);
+    }
+    if (diepint.b.inepnakeff)
+    {
+      CLEAR_IN_EP_INTR(epnum, inepnakeff);
+    }
+    if ( diepint.b.epdisabled )
+    {
+      CLEAR_IN_EP_INTR(epnum, epdisabled);
+    }       
+    if (diepint.b.emptyintr)
+    {
+      
+      DCD_WriteEmptyTxFifo(pdev , epnum);
+      
+      CLEAR_IN_EP_INTR(epnum, emptyintr);
     }
-    epnum++;
-    ep_intr >>= 1;
   }
   
   return 1;
@@ -493,7 +583,6 @@ static uint32_t DCD_HandleOutEP_ISR(USB_OTG_CORE_HANDLE *pdev)
 {
   uint32_t ep_intr;
   USB_OTG_DOEPINTn_TypeDef  doepint;
-  USB_OTG_DEPXFRSIZ_TypeDef  deptsiz;
   uint32_t epnum = 0;
   
   doepint.d32 = 0;
@@ -503,54 +592,47 @@ static uint32_t DCD_HandleOutEP_ISR(USB_OTG_CORE_HANDLE *pdev)
   
   while ( ep_intr )
   {
-    if (ep_intr&0x1)
+    epnum = 31 - DCD_CLZ(ep_intr);
+    ep_intr &= ~(1UL << epnum);
+    doepint.d32 = USB_OTG_ReadDevOutEP_itr(pdev, epnum);
+    
+    /* Transfer complete */
+    if ( doepint.b.xfercompl )
     {
+      /* Clear the bit in DOEPINTn for this interrupt */
+      CLEAR_OUT_EP_INTR(epnum, xfercompl);
+      if (pdev->cfg.dma_enable == 1)
+      {
+        pdev->dev.out_ep[epnum].xfer_count = DCD_GetOutXferCount(pdev, epnum);
+      }
+      /* Inform upper layer: data ready */
+      /* RX COMPLETE */
+      USBD_DCD_INT_fops->DataOutStage(pdev , epnum);
       
-      doepint.d32 = USB_OTG_ReadDevOutEP_itr(pdev, epnum);
-      
-      /* Transfer complete */
-      if ( doepint.b.xfercompl )
+      if (pdev->cfg.dma_enable == 1)
       {
-        /* Clear the bit in DOEPINTn for this interrupt */
-        CLEAR_OUT_EP_INTR(epnum, xfercompl);
-        if (pdev->cfg.dma_enable == 1)
+        if((epnum == 0) && (pdev->dev.device_state == USB_OTG_EP0_STATUS_OUT))
         {
-          deptsiz.d32 = USB_OTG_READ_REG32(&(pdev->regs.OUTEP_REGS[epnum]->DOEPTSIZ));
-          /*ToDo : handle more than one single MPS size packet */
-          pdev->dev.out_ep[epnum].xfer_count = pdev->dev.out_ep[epnum].maxpacket - \
-            deptsiz.b.xfersize;
+          /* prepare to rx more setup packets */
+          USB_OTG_EP0_OutStart(pdev);
         }
-        /* Inform upper layer: data ready */
-        /* RX COMPLETE */
-        USBD_DCD_INT_fops->DataOutStage(pdev , epnum);
-        
-        if (pdev->cfg.dma_enable == 1)
-        {
-          if((epnum == 0) && (pdev->dev.device_state == USB_OTG_EP0_STATUS_OUT))
-          {
-            /* prepare to rx more setup packets */
-            USB_OTG_EP0_OutStart(pdev);
-          }
-        }        
-      }
-      /* Endpoint disable  */
-      if ( doepint.b.epdisabled )
-      {
-        /* Clear the bit in DOEPINTn for this interrupt */
-        CLEAR_OUT_EP_INTR(epnum, epdisabled);
-      }
-      /* Setup Phase Done (control EPs) */
-      if ( doepint.b.setup )
-      {
-        
-        /* inform the upper layer that a setup packet is available */
-        /* SETUP COMPLETE */
-        USBD_DCD_INT_fops->SetupStage(pdev);
-        CLEAR_OUT_EP_INTR(epnum, setup);
-      }
+      }        
+    }
+    /* Endpoint disable  */
+    if ( doepint.b.epdisabled )
+    {
+      /* Clear the bit in DOEPINTn for this interrupt */
+      CLEAR_OUT_EP_INTR(epnum, epdisabled);
+    }
+    /* Setup Phase Done (control EPs) */
+    if ( doepint.b.setup )
+    {
+      
+      /* inform the upper layer that a setup packet is available */
+      /* SETUP COMPLETE */
+      USBD_DCD_INT_fops->SetupStage(pdev);
+      CLEAR_OUT_EP_INTR(epnum, setup);
     }
-    epnum++;
-    ep_intr >>= 1;
   }
   return 1;
 }
@@ -852,6 +934,27 @@ static uint32_t DCD_ReadDevInEP (USB_OTG_CORE_HANDLE *pdev, uint8_t epnum)
   return v;
 }
 
+/**
+* @brief  DCD_GetOutXferCount
+*         Number of bytes received by a DMA OUT transfer. DOEPTSIZ counts
+*         down from pktcnt * maxpacket (see USB_OTG_EPStartXfer), so that
+*         transfers of several max-packets are handled as well
+* @param  pdev: device instance
+* @param  epnum: endpoint number
+* @retval received bytes
+*/
+static uint32_t DCD_GetOutXferCount (USB_OTG_CORE_HANDLE *pdev, uint8_t epnum)
+{
+  USB_OTG_EP *ep = &pdev->dev.out_ep[epnum];
+  USB_OTG_DEPXFRSIZ_TypeDef  deptsiz;
+  uint32_t pktcnt;
+  
+  deptsiz.d32 = USB_OTG_READ_REG32(&(pdev->regs.OUTEP_REGS[epnum]->DOEPTSIZ));
+  pktcnt = ep->xfer_len ? (ep->xfer_len + ep->maxpacket - 1) / ep->maxpacket : 1;
+  
+  return pktcnt * ep->maxpacket - deptsiz.b.xfersize;
+}
+
 
 
 /**
@@ -62,6 +62,22 @@ typedef struct _USBD_DCD_INT
 }USBD_DCD_INT_cb_TypeDef;
 
 extern USBD_DCD_INT_cb_TypeDef *USBD_DCD_INT_fops;
+
+/* USBD_OTG_ISR_Stats[] is indexed by the GINTSTS bit of the interrupt source,
+   the dedicated EP1 interrupts of the OTG_HS core are counted behind them */
+#define USB_OTG_ISR_STATS_EP1OUT                  32
+#define USB_OTG_ISR_STATS_EP1IN                   33
+#define USB_OTG_ISR_STATS_NUM                     34
+
+#if USB_OTG_ISR_STATS
+typedef struct _USB_OTG_ISR_STATS
+{
+  uint32_t calls;
+  uint64_t cycles;
+}USB_OTG_ISR_STATS_TypeDef;
+
+extern USB_OTG_ISR_STATS_TypeDef USBD_OTG_ISR_Stats[USB_OTG_ISR_STATS_NUM];
+#endif
 /**
   * @}
   */ 
@@ -104,6 +120,9 @@ extern USBD_DCD_INT_cb_TypeDef *USBD_DCD_INT_fops;
   */ 
 
 uint32_t USBD_OTG_ISR_Handler (USB_OTG_CORE_HANDLE *pdev);
+#if USB_OTG_ISR_STATS
+void USBD_OTG_ISR_StatsReset (void);
+#endif
 
 /**
   * @}
@@ -220,8 +220,15 @@ typedef enum
 /** @defgroup Internal_Macro's
   * @{
   */
+#ifdef USB_OTG_SIM
+/* host build: core registers are modelled in software, see sim/otg_sim.c */
+#include "otg_sim.h"
+#define USB_OTG_READ_REG32(reg)  SIM_OTG_ReadReg((__IO uint32_t *)(reg))
+#define USB_OTG_WRITE_REG32(reg,value) SIM_OTG_WriteReg((__IO uint32_t *)(reg), (value))
+#else
 #define USB_OTG_READ_REG32(reg)  (*(__IO uint32_t *)reg)
 #define USB_OTG_WRITE_REG32(reg,value) (*(__IO uint32_t *)reg = value)
+#endif
 #define USB_OTG_MODIFY_REG32(reg,clear_mask,set_mask) \
   USB_OTG_WRITE_REG32(reg, (((USB_OTG_READ_REG32(reg)) & ~clear_mask) | set_mask ) )
 
@@ -26,8 +26,10 @@
 /* Includes ------------------------------------------------------------------*/
 #include "stm32fxxx.h"
 
-//#define USE_USB_OTG_HS  
+// USE_USB_OTG_HS (OTG_HS core with ULPI PHY and internal DMA) is selected in the Makefile
+#ifndef USE_USB_OTG_HS
 #define USE_USB_OTG_FS
+#endif
 
 #define USBD_CFG_MAX_NUM           1
 #define USBD_ITF_MAX_NUM           1
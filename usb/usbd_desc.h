@@ -1,8 +1,16 @@
 // $Id: usbd_desc.h 1800 2013-06-02 22:09:03Z tk $
 
-// Dummy file which only exists, since it's referenced in the STM32 device library (usbd_req.c)
+// Referenced in the STM32 device library (usbd_req.c), the descriptors are located in midi/usb.c
 
 #ifndef __USB_DESC_H
 #define __USB_DESC_H
 
+#include "usb_conf.h"
+#include "usbd_def.h"
+
+#ifdef USB_OTG_HS_CORE
+// returned for GET_DESCRIPTOR(DEVICE_QUALIFIER) by a high speed capable device
+extern uint8_t USBD_DeviceQualifierDesc[USB_LEN_DEV_QUALIFIER_DESC];
+#endif
+
 #endif /* __USB_DESC_H */
@@ -398,14 +398,8 @@ static void USBD_GetDescriptor(USB_OTG_CORE_HANDLE  *pdev,
     break;
     
   case USB_DESC_TYPE_CONFIGURATION:
-      pbuf   = (uint8_t *)pdev->dev.class_cb->GetConfigDescriptor(pdev->cfg.speed, &len);
-#ifdef USB_OTG_HS_CORE
-    if((pdev->cfg.speed == USB_OTG_SPEED_FULL )&&
-       (pdev->cfg.phy_itface  == USB_OTG_ULPI_PHY))
-    {
-      pbuf   = (uint8_t *)pdev->dev.class_cb->GetOtherConfigDescriptor(pdev->cfg.speed, &len);
-    }
-#endif  
+    /* the class returns the descriptor of the current speed */
+    pbuf   = (uint8_t *)pdev->dev.class_cb->GetConfigDescriptor(pdev->cfg.speed, &len);
     pbuf[1] = USB_DESC_TYPE_CONFIGURATION;
     pdev->dev.pConfig_descriptor = pbuf;    
     break;
@@ -449,15 +443,10 @@ static void USBD_GetDescriptor(USB_OTG_CORE_HANDLE  *pdev,
     break;
   case USB_DESC_TYPE_DEVICE_QUALIFIER:                   
 #ifdef USB_OTG_HS_CORE
-    if(pdev->cfg.speed == USB_OTG_SPEED_HIGH  )   
+    /* a high speed capable device answers at both speeds,
+       the class codes are the ones of the device descriptor */
+    if(pdev->cfg.phy_itface == USB_OTG_ULPI_PHY)
     {
-      
-      pbuf   = (uint8_t *)pdev->dev.class_cb->GetConfigDescriptor(pdev->cfg.speed, &len);
-            
-      USBD_DeviceQualifierDesc[4]= pbuf[14];
-      USBD_DeviceQualifierDesc[5]= pbuf[15];
-      USBD_DeviceQualifierDesc[6]= pbuf[16];
-      
       pbuf = USBD_DeviceQualifierDesc;
       len  = USB_LEN_DEV_QUALIFIER_DESC;
       break;
@@ -475,8 +464,9 @@ static void USBD_GetDescriptor(USB_OTG_CORE_HANDLE  *pdev,
   case USB_DESC_TYPE_OTHER_SPEED_CONFIGURATION:
 #ifdef USB_OTG_HS_CORE   
 
-    if(pdev->cfg.speed == USB_OTG_SPEED_HIGH  )   
+    if(pdev->cfg.phy_itface == USB_OTG_ULPI_PHY)
     {
+      /* descriptor of the speed which isn't used currently */
       pbuf   = (uint8_t *)pdev->dev.class_cb->GetOtherConfigDescriptor(pdev->cfg.speed, &len);
       pbuf[1] = USB_DESC_TYPE_OTHER_SPEED_CONFIGURATION;
       break; 